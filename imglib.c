@@ -0,0 +1,5369 @@
+#ifdef _POSIX_SOURCE
+/* POSIX.1-2001 is needed for threads */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* vmsplice() and pipe resizing */
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#ifdef _POSIX_SOURCE
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+/* stricmp() is only available in MS systems */
+#define stricmp(x, y) strcasecmp(x, y)
+#endif
+
+#ifdef __MSDOS__
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef __linux__
+/* BLKZEROOUT and BLKDISCARD */
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#if defined(__linux__) && defined(HAVE_IO_URING)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "imglib.h"
+
+#ifdef _POSIX_SOURCE
+/* Size of the zero buffer for full preallocation */
+#define ALLOC_BUF_SIZE 1048576L
+#else
+#define ALLOC_BUF_SIZE 32768L
+#endif
+
+/* Alignment of direct I/O buffers, offsets and lengths */
+#define DIRECT_ALIGN 4096L
+/* Size of the window of direct image files */
+#define DIRECT_BUF_SIZE 1048576L
+/* Maximum number of direct I/O buffers kept for reuse */
+#define DIRECT_POOL_MAX 8
+
+/* Size of the chunks compressed independently in gzip images */
+#define GZ_CHUNK_SIZE 1048576L
+/* Number of chunks compressed at once by each thread */
+#define GZ_BATCH 4
+/* Maximum number of compression threads */
+#define GZ_THREADS_MAX 64
+/* Maximum number of chunks compressed at once */
+#define GZ_BATCH_MAX (GZ_THREADS_MAX * GZ_BATCH)
+
+/* Size of a dynamic VHD block in bytes */
+#define VHD_BLOCK_SIZE 0x200000L
+/* Unallocated VHD block */
+#define VHD_UNUSED 0xFFFFFFFFUL
+/* Fixed VHD disk type */
+#define VHD_TYPE_FIXED 2UL
+/* Dynamic VHD disk type */
+#define VHD_TYPE_DYNAMIC 3UL
+/* Differencing VHD disk type */
+#define VHD_TYPE_DIFF 4UL
+/* VHD timestamp epoch (2000-01-01) as time_t */
+#define VHD_EPOCH 946684800UL
+
+/* Size of the zero page of streams */
+#define STREAM_PAGE_SIZE 4096
+/* Number of zero pages written at once to streams */
+#define STREAM_IOV_MAX 16
+/* Pipe buffer size requested for streams */
+#define STREAM_PIPE_SIZE 1048576
+
+/* Number of io_uring buffers, the most writes in flight */
+#define URING_DEPTH 64
+/* Size of each io_uring buffer */
+#define URING_BUF_SIZE 131072L
+/* Number of writes queued before they are submitted */
+#define URING_BATCH 8
+
+/* Largest gap between extents written as zeros to merge them into one write */
+#define FILE_GAP_MAX 131072L
+/* Maximum number of buffers of a vectored file write */
+#define FILE_IOV_MAX 128
+
+/* Size of reserved area in sectors, unless padded by -align */
+#define FS_RSV_SECT 1
+/* Reserved sectors of FAT32, with the FSInfo and backup boot sectors */
+#define FS_RSV_SECT32 32
+/* FSInfo sector of FAT32 */
+#define FS_FSINFO_SECT 1
+/* Backup boot sector of FAT32 */
+#define FS_BACKUP_SECT 6
+/* First cluster of the FAT32 root directory */
+#define FS_ROOT_CLUSTER 2L
+/* Largest FAT32 image in MiB: 2^32 sectors, or as far as long offsets reach */
+#define FS_FAT32_MIB_MAX (LONG_MAX / 1048576L < 2097151L ? LONG_MAX / 1048576L : 2097151L)
+/* Size of a directory entry in bytes */
+#define FS_DIRENT_SIZE 32
+/* Volume label attribute */
+#define FS_ATTR_VOLUME 0x08
+/* Directory attribute */
+#define FS_ATTR_DIR 0x10
+/* Archive attribute */
+#define FS_ATTR_ARCHIVE 0x20
+/* Most metadata extents: MBR, 3 FAT32 boot sectors, boot sector, 4 FATs, root */
+#define FS_EXTENTS_MAX 10
+/* Longest line of an access trace */
+#define FS_TRACE_LINE_MAX 1024
+
+/* Problems printed by -check, the rest are only counted */
+#define CHECK_MSG_MAX 20
+/* Deepest directory followed by -check */
+#define CHECK_DEPTH_MAX 32
+
+/* Histogram buckets of -plan */
+#define PLAN_BUCKETS 16
+/* Slack bytes that weigh as much as one FAT link in -plan */
+#define PLAN_LINK_BYTES 32
+
+/* Cases a -validate worker takes at once */
+#define VAL_BATCH 4096L
+/* Filesystem option sets of each -validate template and -size */
+#define VAL_FSOPTS (4L * 9L * 5L * 8L)
+/* -validate cases of the templates, of -size, of aligned -size and of -chs */
+#define VAL_TEMPLATES (16L * VAL_FSOPTS)
+#define VAL_SIZES (2012L * VAL_FSOPTS)
+#define VAL_ALIGNED (2012L * 8L)
+#define VAL_CHS ((long) HD_CYL_MAX * HD_HEAD_MAX * HD_SECT_MAX)
+
+/* Layout version hashed into the cache keys, to change with the image layout */
+#define SPEC_HASH_VERSION "imgmake-1"
+/* FNV-1a 32-bit prime and offset basis */
+#define FNV_PRIME 16777619UL
+#define FNV_BASIS 2166136261UL
+
+/*
+ * Blank MBR with the FreeDOS bootstrap code.
+ */
+const unsigned char mbr[] = {
+        0x33, 0xC0, 0x8E, 0xC0, 0x8E, 0xD8, 0x8E, 0xD0,
+        0xBC, 0x00, 0x7C, 0xFC, 0x8B, 0xF4, 0xBF, 0x00,
+        0x06, 0xB9, 0x00, 0x01, 0xF2, 0xA5, 0xEA, 0x67,
+        0x06, 0x00, 0x00, 0x8B, 0xD5, 0x58, 0xA2, 0x4F,
+        0x07, 0x3C, 0x35, 0x74, 0x23, 0xB4, 0x10, 0xF6,
+        0xE4, 0x05, 0xAE, 0x04, 0x8B, 0xF0, 0x80, 0x7C,
+        0x04, 0x00, 0x74, 0x44, 0x80, 0x7C, 0x04, 0x05,
+        0x74, 0x3E, 0xC6, 0x04, 0x80, 0xE8, 0xDA, 0x00,
+        0x8A, 0x74, 0x01, 0x8B, 0x4C, 0x02, 0xEB, 0x08,
+        0xE8, 0xCF, 0x00, 0xB9, 0x01, 0x00, 0x32, 0xD1,
+        0xBB, 0x00, 0x7C, 0xB8, 0x01, 0x02, 0xCD, 0x13,
+        0x72, 0x1E, 0x81, 0xBF, 0xFE, 0x01, 0x55, 0xAA,
+        0x75, 0x16, 0xEA, 0x00, 0x7C, 0x00, 0x00, 0x80,
+        0xFA, 0x81, 0x74, 0x02, 0xB2, 0x80, 0x8B, 0xEA,
+        0x42, 0x80, 0xF2, 0xB3, 0x88, 0x16, 0x41, 0x07,
+        0xBF, 0xBE, 0x07, 0xB9, 0x04, 0x00, 0xC6, 0x06,
+        0x34, 0x07, 0x31, 0x32, 0xF6, 0x88, 0x2D, 0x8A,
+        0x45, 0x04, 0x3C, 0x00, 0x74, 0x23, 0x3C, 0x05,
+        0x74, 0x1F, 0xFE, 0xC6, 0xBE, 0x31, 0x07, 0xE8,
+        0x71, 0x00, 0xBE, 0x4F, 0x07, 0x46, 0x46, 0x8B,
+        0x1C, 0x0A, 0xFF, 0x74, 0x05, 0x32, 0x7D, 0x04,
+        0x75, 0xF3, 0x8D, 0xB7, 0x7B, 0x07, 0xE8, 0x5A,
+        0x00, 0x83, 0xC7, 0x10, 0xFE, 0x06, 0x34, 0x07,
+        0xE2, 0xCB, 0x80, 0x3E, 0x75, 0x04, 0x02, 0x74,
+        0x0B, 0xBE, 0x42, 0x07, 0x0A, 0xF6, 0x75, 0x0A,
+        0xCD, 0x18, 0xEB, 0xAC, 0xBE, 0x31, 0x07, 0xE8,
+        0x39, 0x00, 0xE8, 0x36, 0x00, 0x32, 0xE4, 0xCD,
+        0x1A, 0x8B, 0xDA, 0x83, 0xC3, 0x60, 0xB4, 0x01,
+        0xCD, 0x16, 0xB4, 0x00, 0x75, 0x0B, 0xCD, 0x1A,
+        0x3B, 0xD3, 0x72, 0xF2, 0xA0, 0x4F, 0x07, 0xEB,
+        0x0A, 0xCD, 0x16, 0x8A, 0xC4, 0x3C, 0x1C, 0x74,
+        0xF3, 0x04, 0xF6, 0x3C, 0x31, 0x72, 0xD6, 0x3C,
+        0x35, 0x77, 0xD2, 0x50, 0xBE, 0x2F, 0x07, 0xBB,
+        0x1B, 0x06, 0x53, 0xFC, 0xAC, 0x50, 0x24, 0x7F,
+        0xB4, 0x0E, 0xCD, 0x10, 0x58, 0xA8, 0x80, 0x74,
+        0xF2, 0xC3, 0x56, 0xB8, 0x01, 0x03, 0xBB, 0x00,
+        0x06, 0xB9, 0x01, 0x00, 0x32, 0xF6, 0xCD, 0x13,
+        0x5E, 0xC6, 0x06, 0x4F, 0x07, 0x3F, 0xC3, 0x0D,
+        0x8A, 0x0D, 0x0A, 0x46, 0x35, 0x20, 0x2E, 0x20,
+        0x2E, 0x20, 0x2E, 0xA0, 0x64, 0x69, 0x73, 0x6B,
+        0x20, 0x32, 0x0D, 0x0A, 0x0A, 0x44, 0x65, 0x66,
+        0x61, 0x75, 0x6C, 0x74, 0x3A, 0x20, 0x46, 0x31,
+        0xA0, 0x00, 0x01, 0x00, 0x04, 0x00, 0x06, 0x03,
+        0x07, 0x07, 0x0A, 0x0A, 0x63, 0x0E, 0x64, 0x0E,
+        0x65, 0x14, 0x80, 0x19, 0x81, 0x19, 0x82, 0x19,
+        0x83, 0x1E, 0x93, 0x24, 0xA5, 0x2B, 0x9F, 0x2F,
+        0x75, 0x33, 0x52, 0x33, 0xDB, 0x36, 0x40, 0x3B,
+        0xF2, 0x41, 0x00, 0x44, 0x6F, 0xF3, 0x48, 0x70,
+        0x66, 0xF3, 0x4F, 0x73, 0xB2, 0x55, 0x6E, 0x69,
+        0xF8, 0x4E, 0x6F, 0x76, 0x65, 0x6C, 0xEC, 0x4D,
+        0x69, 0x6E, 0x69, 0xF8, 0x4C, 0x69, 0x6E, 0x75,
+        0xF8, 0x41, 0x6D, 0x6F, 0x65, 0x62, 0xE1, 0x46,
+        0x72, 0x65, 0x65, 0x42, 0x53, 0xC4, 0x42, 0x53,
+        0x44, 0xE9, 0x50, 0x63, 0x69, 0xF8, 0x43, 0x70,
+        0xED, 0x56, 0x65, 0x6E, 0x69, 0xF8, 0x44, 0x6F,
+        0x73, 0x73, 0x65, 0xE3, 0x3F, 0xBF, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x55, 0xAA
+};
+
+/*
+ * Seconds elapsed since an arbitrary point, not affected by clock changes
+ * where the host allows it.
+ */
+double clock_monotonic(void) {
+#if defined(_POSIX_SOURCE) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#endif
+    return (double) clock() / CLOCKS_PER_SEC;
+}
+
+/*
+ * Initializes the statistics, starting the first phase now.
+ */
+void imgstats_init(imgstats *stats) {
+    memset(stats, 0, sizeof(imgstats));
+    stats->logical = -1L;
+    stats->allocated = -1L;
+    stats->mark = clock_monotonic();
+}
+
+/*
+ * Ends the given phase, adding the time since the previous phase ended.
+ */
+void imgstats_phase(imgstats *stats, int phase) {
+    double now;
+
+    if (stats != NULL) {
+        now = clock_monotonic();
+        stats->phase[phase] += now - stats->mark;
+        stats->mark = now;
+    }
+}
+
+/*
+ * Number of online processors, 1 if unknown.
+ */
+int cpu_count(void) {
+    long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return n < 1 ? 1 : (int) n;
+}
+
+/*
+ * Copies a word (2 bytes) into the destination memory address.
+ */
+void *memcpyw(void *dest, int word) {
+    ((char *) dest)[0] = (char) (word & 0x00FF);
+    ((char *) dest)[1] = (char) ((word & 0xFF00) >> 8);
+    return dest;
+}
+
+/*
+ * Copies a double word (4 bytes) into the destination memory address.
+ */
+void *memcpydw(void *dest, long dword) {
+    ((char *) dest)[0] = (char) (dword & 0x000000FFL);
+    ((char *) dest)[1] = (char) ((dword & 0x0000FF00L) >> 8);
+    ((char *) dest)[2] = (char) ((dword & 0x00FF0000L) >> 16);
+    ((char *) dest)[3] = (char) ((dword & 0xFF000000L) >> 24);
+    return dest;
+}
+
+/*
+ * Copies the lowest len bytes of a value into the destination memory address
+ * in big endian order, as used by VHD files.
+ */
+void *memcpybe(void *dest, unsigned long val, int len) {
+    while (len-- > 0) {
+        ((unsigned char *) dest)[len] = (unsigned char) (val & 0xFFUL);
+        val >>= 8;
+    }
+    return dest;
+}
+
+/*
+ * Reads a big endian value of len bytes from the source memory address.
+ */
+unsigned long memgetbe(const void *src, int len) {
+    const unsigned char *p = (const unsigned char *) src;
+    unsigned long val = 0;
+
+    while (len-- > 0)
+        val = (val << 8) | *p++;
+    return val;
+}
+
+/*
+ * Reads a little endian value of len bytes from the source memory address.
+ */
+unsigned long memgetle(const void *src, int len) {
+    const unsigned char *p = (const unsigned char *) src;
+    unsigned long val = 0;
+
+    while (len-- > 0)
+        val = (val << 8) | p[len];
+    return val;
+}
+
+/*
+ * Offset of the first non-zero byte of a buffer, len if it is all zeros.
+ * Zero runs are compared four words at a time.
+ */
+size_t memnonzero(const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *) buf;
+    unsigned long w[4];
+    size_t i = 0;
+
+    for (; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(w, p + i, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3]) != 0UL)
+            break;
+    }
+    while (i < len && p[i] == 0)
+        i++;
+    return i;
+}
+
+/*
+ * Prints an error of the options like fprintf(), unless they are only being
+ * tried.
+ */
+void options_error(const options *opts, const char *fmt, ...) {
+    va_list ap;
+
+    if (!(opts->flags & OPTS_QUIET)) {
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+    }
+}
+
+/*
+ * Checks whether a buffer is all zeros.
+ */
+int memzero(const void *buf, size_t len) {
+    return memnonzero(buf, len) == len;
+}
+
+int options_tocustomchs(const options *opts, imgspec *img) {
+    /* prioritize -size when both -size and -chs are set */
+    if (opts->size >= 0) {
+        /*
+         * chs = size in B / 512
+         *     = size in MiB * 1024 * 1024 / 512
+         *     = size in MiB * 2048
+         */
+        long target_chs = opts->size * 2048L;
+        long eff_size;
+
+        if (opts->size < 3 || (opts->size > 2014 && opts->fat != FS_FAT32)) {
+            options_error(opts, "Invalid -size option. Must be between 3 and 2014 MiB, or larger with -fs 32.");
+            return EC_INV_SIZE;
+        }
+        if (opts->size > FS_FAT32_MIB_MAX) {
+            options_error(opts, "Invalid -size option. FAT32 images can have at most %ld MiB.", FS_FAT32_MIB_MAX);
+            return EC_INV_SIZE;
+        }
+
+        /* Figure out good CHS values */
+        img->heads = 2;
+        while ((long) img->heads * HD_SECT_MAX * HD_CYL_MAX < target_chs)
+            img->heads <<= 1;
+        if (img->heads > HD_HEAD_MAX)
+            img->heads = HD_HEAD_MAX;
+
+        img->sectors = 8;
+        while ((long) img->heads * img->sectors * HD_CYL_MAX < target_chs)
+            img->sectors <<= 1;
+        if (img->sectors > HD_SECT_MAX)
+            img->sectors = HD_SECT_MAX;
+
+        img->cylinders = (int) (target_chs / (img->heads * img->sectors));
+        if (img->cylinders > HD_CYL_MAX)
+            img->cylinders = HD_CYL_MAX;
+
+        /* LBA disks past 1023 cylinders, with the usual 255 heads translation */
+        if (target_chs > (long) HD_CYL_MAX * img->heads * img->sectors) {
+            img->heads = HD_LBA_HEADS;
+            img->sectors = HD_SECT_MAX;
+            img->cylinders = (int) (target_chs / ((long) HD_LBA_HEADS * HD_SECT_MAX));
+        }
+
+        eff_size = (long) img->cylinders * img->heads * img->sectors / 2048L;
+        if (opts->size != eff_size) {
+            options_error(opts, "Warning: effective image size will be %ld MiB.\n", eff_size);
+        }
+
+    } else if (opts->c >= 0 && opts->h >= 0 && opts->s >= 0) {
+        /* only FAT32 disks are addressed by LBA past 1023 cylinders */
+        if (opts->c > HD_CYL_MAX && opts->fat != FS_FAT32) {
+            options_error(opts, "Invalid -chs option. Cylinders must be between 1 and %d, or more with -fs 32.", HD_CYL_MAX);
+            return EC_INV_CHS;
+        }
+        if (opts->h > (opts->fat == FS_FAT32 ? HD_LBA_HEADS : HD_HEAD_MAX)) {
+            options_error(opts, "Invalid -chs option. Heads must be between 1 and %d.",
+                    opts->fat == FS_FAT32 ? HD_LBA_HEADS : HD_HEAD_MAX);
+            return EC_INV_CHS;
+        }
+        if (opts->s > HD_SECT_MAX) {
+            options_error(opts, "Invalid -chs option. Sectors must be between 1 and %d.", HD_SECT_MAX);
+            return EC_INV_CHS;
+        }
+        if ((long) opts->c * opts->h * opts->s / 2048L > FS_FAT32_MIB_MAX) {
+            options_error(opts, "Invalid -chs option. FAT32 images can have at most %ld MiB.", FS_FAT32_MIB_MAX);
+            return EC_INV_CHS;
+        }
+        if ((long) opts->c * opts->h * opts->s < 6144L /* 3 MiB */) {
+            options_error(opts, "Invalid -chs option. The provided geometry specifies a disk that is smaller than 3 MiB.");
+            return EC_INV_CHS;
+        }
+        img->cylinders = opts->c;
+        img->heads = opts->h;
+        img->sectors = opts->s;
+    } else {
+        options_error(opts, "You must specify a valid -size or -chs when using type \"hd\".");
+        return EC_INV_TYPE;
+    }
+
+    return 0;
+}
+
+int options_tofsspec(const options *opts, imgspec *img) {
+    if (opts->flags & OPTS_NOFS) {
+        img->fs = NULL;
+    } else {
+        const long chs = (long) img->cylinders * img->heads * img->sectors;
+        long clusters, max_clusters, min_clusters;
+        long eff_vsize;
+        fsspec *fs = img->fs;
+
+        /* files are added later by fstree_load() */
+        fs->root = NULL;
+        fs->trace = NULL;
+        fs->fat = NULL;
+        fs->fatused = 0L;
+
+        /* copy the label even if it is NULL */
+        if (opts->label == NULL) {
+            fs->vlabel = NULL;
+        } else {
+            fs->vlabel->text = opts->label;
+            fs->vlabel->len = strlen(opts->label);
+
+            if (fs->vlabel->len > 11) {
+                options_error(opts, "Warning: provided label is too long, truncating to 11 characters.");
+                fs->vlabel->len = 11;
+            }
+        }
+
+        /* volume offset and size (in sectors) */
+        fs->voff = fs->mdesc == HD_MDESC ? img->sectors : 0L;
+        fs->padding = 0L;
+        if (opts->align > 0 && fs->voff % opts->align != 0) {
+            fs->padding = opts->align - fs->voff % opts->align;
+            fs->voff += fs->padding;
+        }
+        fs->vsize = chs - fs->voff;
+
+        if (opts->fat >= 0) {
+            if (opts->fat != FS_FAT12 && opts->fat != FS_FAT16 && opts->fat != FS_FAT32) {
+                options_error(opts, "Invalid -fat option. Must be 12, 16 or 32.");
+                return EC_INV_FAT;
+            }
+            if (opts->fat == FS_FAT12 && fs->vsize >= 65536L /* 32 MiB */) {
+                options_error(opts, "Invalid -fat option. Disk is too large for FAT12.");
+                return EC_INV_FAT;
+            }
+            if (opts->fat == FS_FAT32 && fs->mdesc != HD_MDESC) {
+                options_error(opts, "Invalid -fat option. Floppy disks cannot use FAT32.");
+                return EC_INV_FAT;
+            }
+            fs->type = opts->fat;
+        } else {
+            fs->type = fs->vsize >= 24576L /* 12 MiB */ ? FS_FAT16 : FS_FAT12;
+        }
+
+        if (fs->type == FS_FAT12) {
+            max_clusters = 0x0FF6L;
+            min_clusters = 0L;
+        } else if (fs->type == FS_FAT16) {
+            /* DOS reads fewer than 4085 clusters as FAT12 */
+            max_clusters = 0xFFF6L;
+            min_clusters = 0x0FF7L;
+        } else {
+            max_clusters = 0x0FFFFFF6L;
+            min_clusters = 0xFFF7L;
+        }
+
+        if (opts->fatcopies >= 0) {
+            if (opts->fatcopies < 1 || opts->fatcopies > 4) {
+                options_error(opts, "Invalid -fatcopies option, must be between 1 and 4.");
+                return EC_INV_FATCOPIES;
+            }
+            fs->fatnum = opts->fatcopies;
+        } else {
+            fs->fatnum = 2;
+        }
+
+        if (opts->spc >= 0) {
+            if (opts->spc < 1 || opts->spc > 128) {
+                options_error(opts, "Invalid -spc option, must be between 1 and 128.");
+                return EC_INV_SPC;
+            }
+            if ((opts->spc & (opts->spc - 1)) != 0) {
+                options_error(opts, "Invalid -spc option, must be a power of 2.");
+                return EC_INV_SPC;
+            }
+            fs->spc = opts->spc;
+        } else if (fs->type == FS_FAT32) {
+            /* same cluster sizes as the FAT32 format of Windows */
+            if (fs->vsize > 67108864L /* 32 GiB */)
+                fs->spc = 64;
+            else if (fs->vsize > 33554432L /* 16 GiB */)
+                fs->spc = 32;
+            else if (fs->vsize > 16777216L /* 8 GiB */)
+                fs->spc = 16;
+            else if (fs->vsize > 532480L /* 260 MiB */)
+                fs->spc = 8;
+            else
+                fs->spc = 1;
+        } else {
+            if (chs >= 1048576L /* 512 MiB */)
+                fs->spc = 4;
+            else if (chs >= 131072L /* 64 MiB */)
+                fs->spc = 2;
+            else
+                fs->spc = 1;
+        }
+
+        /* SPC just enough that we don't use more clusters than possible */
+        while (fs->vsize >= fs->spc * (max_clusters - 2L) && fs->spc < 128)
+            fs->spc <<= 1;
+        if (opts->spc >= 0 && fs->spc != opts->spc)
+            options_error(opts, "Warning: -spc %d gives too many clusters, using %d.\n", opts->spc, fs->spc);
+
+        /* clusters at least as large as the alignment, unless overridden or too few */
+        while (opts->spc < 0 && fs->spc < opts->align && fs->spc < 128 &&
+               fs->vsize / (fs->spc * 2L) > min_clusters)
+            fs->spc <<= 1;
+
+        if (fs->type == FS_FAT12)
+            fs->fatsize = ((fs->vsize / fs->spc + 1L) * 3L / 2L + 511L) / 512L;
+        else if (fs->type == FS_FAT16)
+            fs->fatsize = (fs->vsize / fs->spc * 2L + 511L) / 512L;
+        else
+            fs->fatsize = ((fs->vsize / fs->spc + 2L) * 4L + 511L) / 512L;
+
+        if (fs->fatsize > 65536L && fs->type != FS_FAT32) {
+            options_error(opts, "Error: Generated filesystem has more than 64K sectors per FAT.\n");
+            return EC_INV_FATSIZE;
+        }
+
+        /* the FAT32 root directory is a cluster chain */
+        if (fs->type == FS_FAT32) {
+            if (opts->rootdir >= 0) {
+                options_error(opts, "Invalid -rootdir option. FAT32 has no fixed root directory.");
+                return EC_INV_ROOTDIR;
+            }
+            fs->rtent = 0;
+        }
+
+        /* if not overridden here, rtent should be already set */
+        if (opts->rootdir >= 0) {
+            if (opts->rootdir < 1 || opts->rootdir > 4096) {
+                options_error(opts, "Invalid -rootdir option, must be between 1 and 4096.");
+                return EC_INV_ROOTDIR;
+            }
+            img->fs->rtent = opts->rootdir;
+        }
+
+        /* the FAT maps two reserved entries besides the clusters */
+        fs->rsvd = fs->type == FS_FAT32 ? FS_RSV_SECT32 : FS_RSV_SECT;
+        eff_vsize = fs->vsize - fs->rsvd - (fs->fatsize * fs->fatnum)
+                    - ((fs->rtent * 32L) + 511L) / 512L;
+        if (fs->fatsize * 4096L / (fs->type == FS_FAT12 ? 12L : fs->type) < eff_vsize / fs->spc + 2L)
+            fs->fatsize++;
+
+        /* pad the reserved sectors so that the first cluster is aligned */
+        fs->next = fs->type == FS_FAT32 ? FS_ROOT_CLUSTER + 1L : 2L;
+        if (opts->align > 0) {
+            long datasect = fs->voff + fs->rsvd + fs->fatsize * fs->fatnum
+                            + ((fs->rtent * 32L) + 511L) / 512L;
+
+            if (datasect % opts->align != 0) {
+                fs->rsvd += (int) (opts->align - datasect % opts->align);
+                fs->padding += opts->align - datasect % opts->align;
+            }
+        }
+
+        /*
+         * Effective volume size in sectors without:
+         * - Reserved sectors (1, or 32 for FAT32, unless aligned)
+         * - FAT copies area
+         * - Root filesystem entries area
+         */
+        eff_vsize = fs->vsize - fs->rsvd - (fs->fatsize * fs->fatnum)
+                    - ((fs->rtent * 32L) + 511L) / 512L;
+        clusters = eff_vsize / fs->spc + 2L;
+
+        if (clusters < min_clusters) {
+            options_error(opts, "Error: Generated filesystem has too few clusters given the parameters.\n");
+            return EC_INV_CLUSTERS;
+        }
+
+        if (clusters > max_clusters) {
+            options_error(opts, "Error: Cluster count is too high given the volume size.\n");
+            return EC_INV_CLUSTERS;
+        }
+    }
+
+    return 0;
+}
+
+int options_toimgspec(const options *opts, imgspec *img) {
+    int rc;
+
+    img->alloc = opts->alloc;
+    img->format = opts->format;
+    img->threads = opts->threads < 0 ? cpu_count() : opts->threads;
+    img->ioengine = opts->ioengine;
+    img->advice = opts->advice;
+    img->msync = (opts->flags & OPTS_MSYNC) != 0;
+    img->direct = (opts->flags & OPTS_DIRECT) != 0;
+    img->sync = opts->sync;
+    img->seeded = (opts->flags & OPTS_SEED) != 0;
+    img->seed = opts->seed;
+    img->device = (opts->flags & OPTS_DEVICE) != 0;
+    img->stats = opts->stats;
+
+    /* hard disk defaults */
+    img->fs->mdesc = HD_MDESC;
+    img->fs->rtent = 512;
+
+    if (stricmp(opts->type, "fd_160") == 0) {
+        img->fs->mdesc = 0xFE;
+        img->fs->rtent = 56;
+        img->cylinders = 40;
+        img->heads = 1;
+        img->sectors = 8;
+    } else if (stricmp(opts->type, "fd_180") == 0) {
+        img->fs->mdesc = 0xFC;
+        img->fs->rtent = 56;
+        img->cylinders = 40;
+        img->heads = 1;
+        img->sectors = 9;
+    } else if (stricmp(opts->type, "fd_200") == 0) {
+        img->fs->mdesc = 0xFC;
+        img->fs->rtent = 56;
+        img->cylinders = 40;
+        img->heads = 1;
+        img->sectors = 10;
+    } else if (stricmp(opts->type, "fd_320") == 0) {
+        img->fs->mdesc = 0xFF;
+        img->fs->rtent = 112;
+        img->cylinders = 40;
+        img->heads = 2;
+        img->sectors = 8;
+    } else if (stricmp(opts->type, "fd_360") == 0) {
+        img->fs->mdesc = 0xFD;
+        img->fs->rtent = 112;
+        img->cylinders = 40;
+        img->heads = 2;
+        img->sectors = 9;
+    } else if (stricmp(opts->type, "fd_400") == 0) {
+        img->fs->mdesc = 0xFD;
+        img->fs->rtent = 112;
+        img->cylinders = 40;
+        img->heads = 2;
+        img->sectors = 10;
+    } else if (stricmp(opts->type, "fd_720") == 0) {
+        img->fs->mdesc = 0xF9;
+        img->fs->rtent = 112;
+        img->cylinders = 80;
+        img->heads = 2;
+        img->sectors = 9;
+    } else if (stricmp(opts->type, "fd_1200") == 0) {
+        img->fs->mdesc = 0xF9;
+        img->fs->rtent = 224;
+        img->cylinders = 80;
+        img->heads = 2;
+        img->sectors = 15;
+    } else if (stricmp(opts->type, "fd_1440") == 0 ||
+               stricmp(opts->type, "fd") == 0 ||
+               stricmp(opts->type, "floppy") == 0) {
+        img->fs->mdesc = 0xF0;
+        img->fs->rtent = 224;
+        img->cylinders = 80;
+        img->heads = 2;
+        img->sectors = 18;
+    } else if (stricmp(opts->type, "fd_2880") == 0) {
+        img->fs->mdesc = 0xF0;
+        img->fs->rtent = 512;
+        img->cylinders = 80;
+        img->heads = 2;
+        img->sectors = 36;
+    } else if (stricmp(opts->type, "hd_250") == 0) {
+        img->cylinders = 489;
+        img->heads = 16;
+        img->sectors = 63;
+    } else if (stricmp(opts->type, "hd_520") == 0) {
+        img->cylinders = 1023;
+        img->heads = 16;
+        img->sectors = 63;
+    } else if (stricmp(opts->type, "hd_1gig") == 0) {
+        img->cylinders = 1023;
+        img->heads = 32;
+        img->sectors = 63;
+    } else if (stricmp(opts->type, "hd_2gig") == 0) {
+        img->cylinders = 1023;
+        img->heads = 64;
+        img->sectors = 63;
+    } else if (stricmp(opts->type, "hd_st251") == 0) {
+        img->cylinders = 820;
+        img->heads = 6;
+        img->sectors = 17;
+    } else if (stricmp(opts->type, "hd_st225") == 0) {
+        img->cylinders = 615;
+        img->heads = 4;
+        img->sectors = 17;
+    } else if (stricmp(opts->type, "hd") == 0) {
+        if ((rc = options_tocustomchs(opts, img)) != 0)
+            return rc;
+    } else {
+        options_error(opts, "Invalid -t option. Type \"imgmake -?\" for possible values.");
+        return EC_INV_TYPE;
+    }
+
+    return options_tofsspec(opts, img);
+}
+
+/*
+ * Characters allowed in a short name besides letters and digits.
+ */
+const char *sfn_chars = "!#$%&'()-@^_`{}~";
+
+/*
+ * Converts a host file name into a space padded short name. Returns 1 if
+ * some information was lost in the conversion, 0 otherwise.
+ */
+int sfn_convert(const char *name, char *sfn) {
+    const char *ext;
+    int i, lossy = 0;
+
+    memset(sfn, ' ', 11);
+
+    /* leading dots are not allowed */
+    while (*name == '.') {
+        name++;
+        lossy = 1;
+    }
+
+    ext = strrchr(name, '.');
+    for (i = 0; *name != '\0' && name != ext; name++) {
+        if (*name == ' ' || *name == '.') {
+            lossy = 1;
+        } else if (i == 8) {
+            lossy = 1;
+        } else if (isalnum((unsigned char) *name) || strchr(sfn_chars, *name) != NULL) {
+            sfn[i++] = (char) toupper((unsigned char) *name);
+        } else {
+            sfn[i++] = '_';
+            lossy = 1;
+        }
+    }
+
+    if (i == 0) {
+        sfn[0] = '_';
+        lossy = 1;
+    }
+
+    for (i = 8, name = ext != NULL ? ext + 1 : ""; *name != '\0'; name++) {
+        if (*name == ' ' || i == 11) {
+            lossy = 1;
+        } else if (isalnum((unsigned char) *name) || strchr(sfn_chars, *name) != NULL) {
+            sfn[i++] = (char) toupper((unsigned char) *name);
+        } else {
+            sfn[i++] = '_';
+            lossy = 1;
+        }
+    }
+
+    return lossy;
+}
+
+/*
+ * Checks whether a short name is used by the entries preceding last.
+ */
+int sfn_exists(const fsnode *first, const fsnode *last, const char *sfn) {
+    for (; first != last; first = first->next) {
+        if (memcmp(first->name, sfn, 11) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Assigns a unique short name to every entry of a directory, adding a numeric
+ * tail (like "LONGFI~1.TXT") to names that are lossy or clashing.
+ */
+int sfn_assign(fsnode *dir) {
+    fsnode *node;
+    char sfn[11], tail[8];
+    const char *name;
+    long n;
+    int base, len;
+
+    for (node = dir->child; node != NULL; node = node->next) {
+        name = strrchr(node->path, '/') + 1;
+
+        if (sfn_convert(name, sfn) == 0 && !sfn_exists(dir->child, node, sfn)) {
+            memcpy(node->name, sfn, 11);
+            continue;
+        }
+
+        for (base = 0; base < 8 && sfn[base] != ' '; base++);
+        for (n = 1; n < 1000000L; n++) {
+            len = sprintf(tail, "~%ld", n);
+            memcpy(node->name, sfn, 11);
+            memcpy(node->name + (base + len > 8 ? 8 - len : base), tail, len);
+            if (!sfn_exists(dir->child, node, node->name))
+                break;
+        }
+
+        if (n == 1000000L) {
+            fprintf(stderr, "Unable to generate a short name for \"%s\".\n", node->path);
+            return EC_COPY_ERROR;
+        }
+    }
+
+    /* 0xE5 marks deleted entries, it is stored as 0x05 instead */
+    for (node = dir->child; node != NULL; node = node->next) {
+        if ((unsigned char) node->name[0] == 0xE5)
+            node->name[0] = 0x05;
+    }
+
+    return 0;
+}
+
+/*
+ * Converts a host timestamp into FAT date and time.
+ */
+void fat_datetime(time_t t, unsigned *date, unsigned *tm) {
+#ifdef _POSIX_SOURCE
+    /* localtime() is not thread safe */
+    struct tm buf;
+    struct tm *lt = localtime_r(&t, &buf);
+#else
+    struct tm *lt = localtime(&t);
+#endif
+
+    if (lt == NULL || lt->tm_year < 80) {
+        /* 1980-01-01 00:00:00 is the earliest FAT timestamp */
+        *date = (1 << 5) | 1;
+        *tm = 0;
+    } else {
+        *date = ((lt->tm_year - 80) << 9) | ((lt->tm_mon + 1) << 5) | lt->tm_mday;
+        *tm = (lt->tm_hour << 11) | (lt->tm_min << 5) | (lt->tm_sec / 2);
+    }
+}
+
+/*
+ * Frees a node and all of its siblings and children.
+ */
+void fstree_free(fsnode *node) {
+    fsnode *next;
+
+    for (; node != NULL; node = next) {
+        next = node->next;
+        fstree_free(node->child);
+        free(node->path);
+        free(node);
+    }
+}
+
+/*
+ * Reads the entries of a host directory and all of its subdirectories.
+ */
+int fstree_scan(fsnode *dir) {
+    DIR *dp;
+    struct dirent *de;
+    struct stat st;
+    fsnode *node, **link;
+    int rc;
+
+    dp = opendir(dir->path);
+    if (dp == NULL) {
+        fprintf(stderr, "Unable to read directory \"%s\".\n", dir->path);
+        return EC_COPY_ERROR;
+    }
+
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        node = calloc(1, sizeof(fsnode));
+        if (node == NULL ||
+            (node->path = malloc(strlen(dir->path) + strlen(de->d_name) + 2)) == NULL) {
+            fputs("Not enough memory to copy the host directory.\n", stderr);
+            free(node);
+            closedir(dp);
+            return EC_COPY_ERROR;
+        }
+        sprintf(node->path, "%s/%s", dir->path, de->d_name);
+
+        if (stat(node->path, &st) != 0) {
+            fprintf(stderr, "Unable to read \"%s\".\n", node->path);
+            fstree_free(node);
+            closedir(dp);
+            return EC_COPY_ERROR;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            node->attr = FS_ATTR_DIR;
+        } else if (S_ISREG(st.st_mode)) {
+            node->attr = FS_ATTR_ARCHIVE;
+            node->size = (long) st.st_size;
+        } else {
+            /* devices, sockets and the like have no FAT counterpart */
+            fstree_free(node);
+            continue;
+        }
+        fat_datetime(st.st_mtime, &node->mdate, &node->mtime);
+        node->htime = (long) st.st_mtime;
+
+        /* keep entries sorted, so that the layout does not depend on the host */
+        for (link = &dir->child; *link != NULL && strcmp((*link)->path, node->path) < 0;
+             link = &(*link)->next);
+        node->next = *link;
+        *link = node;
+        dir->entries++;
+    }
+
+    closedir(dp);
+
+    if ((rc = sfn_assign(dir)) != 0)
+        return rc;
+
+    for (node = dir->child; node != NULL; node = node->next) {
+        if ((node->attr & FS_ATTR_DIR) && (rc = fstree_scan(node)) != 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+/*
+ * Sets a FAT entry in the in-memory FAT.
+ */
+void fat_set(const fsspec *fs, unsigned char *fat, long cluster, long value) {
+    if (fs->type == FS_FAT12) {
+        unsigned char *p = fat + cluster * 3L / 2L;
+
+        if (cluster & 1) {
+            p[0] = (unsigned char) ((p[0] & 0x0F) | ((value & 0x0F) << 4));
+            p[1] = (unsigned char) ((value & 0xFF0) >> 4);
+        } else {
+            p[0] = (unsigned char) (value & 0xFF);
+            p[1] = (unsigned char) ((p[1] & 0xF0) | ((value & 0xF00) >> 8));
+        }
+    } else if (fs->type == FS_FAT16) {
+        memcpyw(fat + cluster * 2L, (int) value);
+    } else {
+        memcpydw(fat + cluster * 4L, value & 0x0FFFFFFFL);
+    }
+}
+
+/*
+ * Links a run of clusters into a chain in the in-memory FAT.
+ */
+void fat_chain(const fsspec *fs, long cluster, long clusters) {
+    const long eoc = fs->type == FS_FAT12 ? 0x0FFFL : fs->type == FS_FAT16 ? 0xFFFFL : 0x0FFFFFFFL;
+    long i;
+
+    for (i = 0; i < clusters; i++)
+        fat_set(fs, fs->fat, cluster + i, i == clusters - 1L ? eoc : cluster + i + 1L);
+}
+
+/*
+ * Hands out the clusters of a file.
+ */
+void fsnode_alloc(const fsspec *fs, fsnode *node, long *next) {
+    const long csize = fs->spc * 512L;
+
+    node->clusters = (node->size + csize - 1L) / csize;
+    node->cluster = node->clusters > 0 ? *next : 0L;
+    *next += node->clusters;
+}
+
+/*
+ * Hands out clusters to the entries of a directory. Clusters are allocated in
+ * the very same order fstree_write() writes them, so that every file is
+ * contiguous and the data region is written sequentially. Traced files are
+ * skipped, they already have their clusters.
+ */
+void fstree_alloc(const fsspec *fs, fsnode *dir, long *next) {
+    const long csize = fs->spc * 512L;
+    fsnode *node;
+
+    for (node = dir->child; node != NULL; node = node->next) {
+        if (!(node->attr & FS_ATTR_DIR) && !node->traced)
+            fsnode_alloc(fs, node, next);
+    }
+
+    for (node = dir->child; node != NULL; node = node->next) {
+        if (node->attr & FS_ATTR_DIR) {
+            /* "." and ".." take two entries */
+            node->clusters = ((node->entries + 2L) * FS_DIRENT_SIZE + csize - 1L) / csize;
+            node->cluster = *next;
+            *next += node->clusters;
+            fstree_alloc(fs, node, next);
+        }
+    }
+}
+
+/*
+ * Links the cluster chains of a directory tree in the in-memory FAT.
+ */
+void fstree_chain(const fsspec *fs, const fsnode *dir) {
+    const fsnode *node;
+
+    for (node = dir->child; node != NULL; node = node->next) {
+        fat_chain(fs, node->cluster, node->clusters);
+        if (node->attr & FS_ATTR_DIR)
+            fstree_chain(fs, node);
+    }
+}
+
+/*
+ * Number of clusters plus 2 that the data region can hold, limited by what
+ * the FAT can address.
+ */
+long fsspec_clusters(const fsspec *fs) {
+    const long rtsect = (fs->rtent * (long) FS_DIRENT_SIZE + 511L) / 512L;
+    const long datasect = fs->rsvd + fs->fatsize * fs->fatnum + rtsect;
+    long clusters = (fs->vsize - datasect) / fs->spc + 2L;
+
+    if (fs->type == FS_FAT12) {
+        if (clusters > fs->fatsize * 512L * 2L / 3L)
+            clusters = fs->fatsize * 512L * 2L / 3L;
+        if (clusters > 0x0FF6L)
+            clusters = 0x0FF6L;
+    } else if (fs->type == FS_FAT16) {
+        if (clusters > fs->fatsize * 256L)
+            clusters = fs->fatsize * 256L;
+        if (clusters > 0xFFF6L)
+            clusters = 0xFFF6L;
+    } else {
+        if (clusters > fs->fatsize * 128L)
+            clusters = fs->fatsize * 128L;
+        if (clusters > 0x0FFFFFF6L)
+            clusters = 0x0FFFFFF6L;
+    }
+    return clusters;
+}
+
+/*
+ * Checks whether a path component names an entry, by its host name or, in
+ * any case, by its short name.
+ */
+int fsnode_named(const fsnode *node, const char *name, size_t len) {
+    const char *host = strrchr(node->path, '/') + 1;
+    char sfn[11];
+    size_t i, n;
+
+    if (strlen(host) == len && memcmp(host, name, len) == 0)
+        return 1;
+
+    memset(sfn, ' ', 11);
+    for (i = 0, n = 0; i < len && name[i] != '.'; i++) {
+        if (n == 8)
+            return 0;
+        sfn[n++] = (char) toupper((unsigned char) name[i]);
+    }
+    for (i++, n = 8; i < len; i++) {
+        if (n == 11)
+            return 0;
+        sfn[n++] = (char) toupper((unsigned char) name[i]);
+    }
+    /* 0xE5 is stored as 0x05 by sfn_assign() */
+    if ((unsigned char) sfn[0] == 0xE5)
+        sfn[0] = 0x05;
+    return memcmp(node->name, sfn, 11) == 0;
+}
+
+/*
+ * Finds the entry of a directory tree named by a path of len characters.
+ * Components are separated by / or \, and a leading DOS drive is skipped,
+ * so that paths logged inside the emulator can be used as they are.
+ */
+fsnode *fstree_find(fsnode *dir, const char *path, size_t len) {
+    const char *end = path + len;
+    const char *sep;
+    fsnode *node = NULL;
+
+    if (len >= 2 && isalpha((unsigned char) path[0]) && path[1] == ':')
+        path += 2;
+
+    while (path < end) {
+        if (*path == '/' || *path == '\\') {
+            path++;
+            continue;
+        }
+        if (node != NULL) {
+            if (!(node->attr & FS_ATTR_DIR))
+                return NULL;
+            dir = node;
+        }
+        for (sep = path; sep < end && *sep != '/' && *sep != '\\'; sep++);
+        for (node = dir->child; node != NULL && !fsnode_named(node, path, (size_t) (sep - path));
+             node = node->next);
+        if (node == NULL)
+            return NULL;
+        path = sep;
+    }
+
+    return node;
+}
+
+/*
+ * Reads an access trace and queues the files it names in the order they are
+ * first read. Each line names a file, optionally followed by the offset of a
+ * read, so that both plain file lists and read logs work. Files are placed
+ * whole, so only the first read of each file counts. Empty lines and lines
+ * starting with # are skipped.
+ */
+int fstree_trace(fsspec *fs, const char *filename) {
+    char buf[FS_TRACE_LINE_MAX];
+    fsnode *node, **link = &fs->trace;
+    long lineno, unknown = 0L;
+    size_t len, end, n;
+    FILE *fp;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "The trace file \"%s\" cannot be opened for reading.\n", filename);
+        return EC_COPY_ERROR;
+    }
+
+    for (lineno = 1L; fgets(buf, sizeof(buf), fp) != NULL; lineno++) {
+        if (strchr(buf, '\n') == NULL && !feof(fp)) {
+            fprintf(stderr, "Trace line %ld is too long.\n", lineno);
+            fclose(fp);
+            return EC_COPY_ERROR;
+        }
+
+        for (len = strlen(buf); len > 0 && isspace((unsigned char) buf[len - 1]); len--);
+        for (n = 0; n < len && isspace((unsigned char) buf[n]); n++);
+        if (n == len || buf[n] == '#')
+            continue;
+
+        /* host names may contain spaces, so the offset is only dropped if needed */
+        node = fstree_find(fs->root, buf + n, len - n);
+        if (node == NULL) {
+            for (end = len; len > n && isdigit((unsigned char) buf[len - 1]); len--);
+            if (len < end && len > n && (buf[len - 1] == ',' || isspace((unsigned char) buf[len - 1]))) {
+                for (len--; len > n && isspace((unsigned char) buf[len - 1]); len--);
+                node = fstree_find(fs->root, buf + n, len - n);
+            }
+        }
+
+        if (node == NULL) {
+            unknown++;
+        } else if (!(node->attr & FS_ATTR_DIR) && !node->traced) {
+            node->traced = 1;
+            *link = node;
+            link = &node->tnext;
+        }
+    }
+
+    if (ferror(fp)) {
+        fprintf(stderr, "Unable to read the trace file \"%s\".\n", filename);
+        fclose(fp);
+        return EC_COPY_ERROR;
+    }
+    fclose(fp);
+
+    if (unknown > 0L)
+        fprintf(stderr, "Warning: %ld lines of the trace name no host file, they are skipped.\n", unknown);
+    return 0;
+}
+
+/*
+ * Reads a host directory and lays out its contents in the filesystem,
+ * building the FAT in memory. The files named by the access trace, if not
+ * NULL, come first in the data region in the order they are read, so that
+ * a load sequence reads the image sequentially.
+ */
+int fstree_load(fsspec *fs, const char *path, const char *trace) {
+    const long csize = fs->spc * 512L;
+    long clusters, next = 2L;
+    fsnode *node;
+    int rc;
+
+    fs->root = calloc(1, sizeof(fsnode));
+    if (fs->root == NULL || (fs->root->path = malloc(strlen(path) + 1)) == NULL) {
+        fputs("Not enough memory to copy the host directory.\n", stderr);
+        return EC_COPY_ERROR;
+    }
+    strcpy(fs->root->path, path);
+    fs->root->attr = FS_ATTR_DIR;
+
+    if ((rc = fstree_scan(fs->root)) != 0)
+        return rc;
+
+    if (fs->type == FS_FAT32) {
+        /* the root directory takes the first clusters, with the label */
+        fs->root->clusters = ((fs->root->entries + 1L) * FS_DIRENT_SIZE + csize - 1L) / csize;
+        fs->root->cluster = FS_ROOT_CLUSTER;
+        next = FS_ROOT_CLUSTER + fs->root->clusters;
+    } else if (fs->root->entries + (fs->vlabel != NULL ? 1 : 0) > fs->rtent) {
+        fprintf(stderr, "Error: \"%s\" has more entries than the root directory can hold (%d).\n",
+                path, fs->rtent);
+        return EC_COPY_ERROR;
+    }
+
+    if (trace != NULL && (rc = fstree_trace(fs, trace)) != 0)
+        return rc;
+
+    clusters = fsspec_clusters(fs);
+    for (node = fs->trace; node != NULL; node = node->tnext)
+        fsnode_alloc(fs, node, &next);
+    fstree_alloc(fs, fs->root, &next);
+    if (next > clusters) {
+        fprintf(stderr, "Error: \"%s\" needs %ld clusters, but the filesystem only has %ld.\n",
+                path, next - 2L, clusters - 2L);
+        return EC_COPY_ERROR;
+    }
+    fs->next = next;
+
+    if (fs->type == FS_FAT12)
+        fs->fatused = (next * 3L / 2L + 1L + 511L) / 512L;
+    else
+        fs->fatused = (next * (fs->type == FS_FAT16 ? 2L : 4L) + 511L) / 512L;
+    fs->fat = calloc((size_t) fs->fatused, 512);
+    if (fs->fat == NULL) {
+        fputs("Not enough memory to build the FAT.\n", stderr);
+        return EC_COPY_ERROR;
+    }
+
+    /* media descriptor and end of chain marker in the first two entries */
+    if (fs->type == FS_FAT12) {
+        fat_set(fs, fs->fat, 0L, 0x0F00L | fs->mdesc);
+        fat_set(fs, fs->fat, 1L, 0x0FFFL);
+    } else if (fs->type == FS_FAT16) {
+        fat_set(fs, fs->fat, 0L, 0xFF00L | fs->mdesc);
+        fat_set(fs, fs->fat, 1L, 0xFFFFL);
+    } else {
+        fat_set(fs, fs->fat, 0L, 0x0FFFFF00L | fs->mdesc);
+        fat_set(fs, fs->fat, 1L, 0x0FFFFFFFL);
+        fat_chain(fs, fs->root->cluster, fs->root->clusters);
+    }
+    fstree_chain(fs, fs->root);
+
+    return 0;
+}
+
+/*
+ * Byte offset of a cluster in the image.
+ */
+long cluster_offset(const fsspec *fs, long cluster) {
+    const long rtsect = (fs->rtent * (long) FS_DIRENT_SIZE + 511L) / 512L;
+
+    return (fs->voff + fs->rsvd + fs->fatsize * fs->fatnum + rtsect +
+            (cluster - 2L) * fs->spc) * 512L;
+}
+
+/*
+ * Fills a 32 bytes directory entry.
+ */
+void dirent_set(unsigned char *ent, const char *name, const fsnode *node) {
+    memcpy(ent, name, 11);
+    ent[0x00B] = (unsigned char) node->attr;
+    memcpyw(ent + 0x016, (int) node->mtime);
+    memcpyw(ent + 0x018, (int) node->mdate);
+    memcpyw(ent + 0x014, (int) (node->cluster >> 16));
+    memcpyw(ent + 0x01A, (int) (node->cluster & 0xFFFFL));
+    memcpydw(ent + 0x01C, node->attr & FS_ATTR_DIR ? 0L : node->size);
+}
+
+/*
+ * Fills the entries of a directory into buf, which must be zeroed. Parent is
+ * NULL for the root directory, which has no "." and ".." entries.
+ */
+void fstree_dirents(const fsnode *dir, const fsnode *parent, unsigned char *buf) {
+    const fsnode *node;
+
+    if (parent != NULL) {
+        dirent_set(buf, ".          ", dir);
+        buf += FS_DIRENT_SIZE;
+        /* the root directory has cluster 0, as ".." expects */
+        dirent_set(buf, "..         ", parent);
+        buf += FS_DIRENT_SIZE;
+    }
+
+    for (node = dir->child; node != NULL; node = node->next) {
+        dirent_set(buf, node->name, node);
+        buf += FS_DIRENT_SIZE;
+    }
+}
+
+/*
+ * Zero buffer of ALLOC_BUF_SIZE bytes shared by all images. It is allocated on
+ * first use and kept, never written, so that a process creating many images
+ * does not allocate and fault in a new one for each.
+ */
+unsigned char *zero_buf = NULL;
+#ifdef _POSIX_SOURCE
+pthread_mutex_t zero_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Returns the shared zero buffer, or NULL if there is not enough memory.
+ */
+const unsigned char *zero_bufget(void) {
+    const unsigned char *buf;
+
+#ifdef _POSIX_SOURCE
+    pthread_mutex_lock(&zero_lock);
+    if (zero_buf == NULL) {
+        /* page aligned, so that the kernel can copy it efficiently */
+        if (posix_memalign((void **) &zero_buf, 4096, (size_t) ALLOC_BUF_SIZE) != 0)
+            zero_buf = NULL;
+        else
+            memset(zero_buf, 0, (size_t) ALLOC_BUF_SIZE);
+    }
+    buf = zero_buf;
+    pthread_mutex_unlock(&zero_lock);
+#else
+    if (zero_buf == NULL)
+        zero_buf = calloc((size_t) ALLOC_BUF_SIZE, 1);
+    buf = zero_buf;
+#endif
+    return buf;
+}
+
+/*
+ * Zero fills the image file with a large buffer.
+ */
+int image_zerofill(FILE *fp, long size) {
+    const unsigned char *buf = zero_bufget();
+    size_t n;
+    int rc = 0;
+
+    if (buf == NULL)
+        return 1;
+
+    if (fseek(fp, 0L, SEEK_SET) != 0)
+        rc = 1;
+    for (; rc == 0 && size > 0L; size -= (long) n) {
+        n = size > ALLOC_BUF_SIZE ? (size_t) ALLOC_BUF_SIZE : (size_t) size;
+        if (fwrite(buf, 1, n, fp) != n)
+            rc = 1;
+    }
+
+    return rc;
+}
+
+/*
+ * Preallocates the image file according to the given policy.
+ */
+int image_alloc(FILE *fp, long size, int policy) {
+#ifdef _POSIX_SOURCE
+    if (fflush(fp) != 0)
+        return 1;
+
+    if (policy == ALLOC_SPARSE) {
+        /* only sets the file size, no blocks are allocated */
+        return ftruncate(fileno(fp), (off_t) size) != 0;
+    } else if (policy == ALLOC_RESERVE) {
+        /* allocates blocks without writing them, fails early without space */
+        errno = posix_fallocate(fileno(fp), 0, (off_t) size);
+        return errno != 0;
+    }
+#else
+    if (policy == ALLOC_SPARSE) {
+        /* writing the last byte allocates as little as the host allows */
+        return fseek(fp, size - 1L, SEEK_SET) != 0 || fwrite("\0", 1, 1, fp) != 1;
+    }
+#endif
+
+    /* full, or reserve where it cannot be done without writing */
+    return image_zerofill(fp, size);
+}
+
+int filesink_alloc(imgsink *sink, long size, int policy) {
+    /* the position is unknown after preallocation */
+    sink->pos = -1L;
+    return image_alloc(sink->fp, size, policy);
+}
+
+int filesink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    if (off != sink->pos && fseek(sink->fp, off, SEEK_SET) != 0)
+        return 1;
+    if (fwrite(buf, 1, len, sink->fp) != len)
+        return 1;
+    sink->pos = off + (long) len;
+    return 0;
+}
+
+int filesink_finish(imgsink *sink, long size) {
+    (void) size;
+    return fflush(sink->fp) != 0;
+}
+
+#if defined(_POSIX_SOURCE) && defined(__linux__)
+/*
+ * Writes a vector at the given offset, resuming short writes.
+ */
+int fd_pwritev(int fd, struct iovec *iov, int cnt, long off) {
+    ssize_t n;
+
+    while (cnt > 0) {
+        n = pwritev(fd, iov, cnt, (off_t) off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+
+        /* skip the buffers written, and the written part of the next one */
+        off += (long) n;
+        for (; cnt > 0 && (size_t) n >= iov->iov_len; iov++, cnt--)
+            n -= (ssize_t) iov->iov_len;
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= (size_t) n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes the extents with as few pwritev() calls as possible. Extents with
+ * small gaps between them are merged by writing the gaps as zeros, which also
+ * clears stale data of reused image files.
+ */
+int filesink_writev(imgsink *sink, const imgextent *ext, int count) {
+    struct iovec iov[FILE_IOV_MAX];
+    char *zero;
+    long off, end, gap;
+    int i = 0, cnt, rc = 0;
+
+    /* buffered writes come first, pwritev() bypasses the stream */
+    if (fflush(sink->fp) != 0)
+        return 1;
+    zero = calloc(STREAM_PAGE_SIZE, 1);
+    if (zero == NULL)
+        return 1;
+
+    while (rc == 0 && i < count) {
+        off = ext[i].off;
+        end = off;
+        cnt = 0;
+        for (; i < count; i++) {
+            gap = ext[i].off - end;
+            if (cnt > 0 && (gap > FILE_GAP_MAX ||
+                            cnt + 1 + (gap + STREAM_PAGE_SIZE - 1L) / STREAM_PAGE_SIZE > FILE_IOV_MAX))
+                break;
+            for (; gap > 0L; gap -= (long) iov[cnt++].iov_len) {
+                iov[cnt].iov_base = zero;
+                iov[cnt].iov_len = gap > STREAM_PAGE_SIZE ? STREAM_PAGE_SIZE : (size_t) gap;
+            }
+            iov[cnt].iov_base = (void *) ext[i].buf;
+            iov[cnt].iov_len = ext[i].len;
+            cnt++;
+            end = ext[i].off + (long) ext[i].len;
+        }
+        rc = fd_pwritev(fileno(sink->fp), iov, cnt, off);
+    }
+
+    /* the stream position no longer matches */
+    sink->pos = -1L;
+    free(zero);
+    return rc;
+}
+#endif
+
+void filesink_release(imgsink *sink) {
+    (void) sink;
+}
+
+/*
+ * Initializes a sink writing to a random access file.
+ */
+void imgsink_file(imgsink *sink, FILE *fp) {
+    memset(sink, 0, sizeof(imgsink));
+    sink->alloc = filesink_alloc;
+    sink->write = filesink_write;
+#if defined(_POSIX_SOURCE) && defined(__linux__)
+    sink->writev = filesink_writev;
+#endif
+    sink->finish = filesink_finish;
+    sink->release = filesink_release;
+    sink->fp = fp;
+}
+
+/*
+ * Writes a buffer to the stream.
+ */
+int streamsink_put(imgsink *sink, const void *buf, size_t len) {
+#ifdef _POSIX_SOURCE
+    const char *p = (const char *) buf;
+    ssize_t n;
+
+    /* stdio buffering would only add a copy on top of large writes */
+    while (len > 0) {
+        n = write(sink->fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+#else
+    return fwrite(buf, 1, len, sink->fp) != len;
+#endif
+}
+
+/*
+ * Writes a run of zeros to the stream, all from the same zero page.
+ */
+int streamsink_zero(imgsink *sink, long len) {
+#ifdef _POSIX_SOURCE
+    struct iovec iov[STREAM_IOV_MAX];
+    ssize_t n;
+    int i, cnt;
+
+    for (i = 0; i < STREAM_IOV_MAX; i++) {
+        iov[i].iov_base = sink->zero;
+        iov[i].iov_len = STREAM_PAGE_SIZE;
+    }
+
+    while (len > 0L) {
+        cnt = len >= STREAM_IOV_MAX * (long) STREAM_PAGE_SIZE
+              ? STREAM_IOV_MAX : (int) ((len + STREAM_PAGE_SIZE - 1L) / STREAM_PAGE_SIZE);
+        iov[cnt - 1].iov_len = (size_t) (len - (cnt - 1) * (long) STREAM_PAGE_SIZE);
+        if (iov[cnt - 1].iov_len > STREAM_PAGE_SIZE)
+            iov[cnt - 1].iov_len = STREAM_PAGE_SIZE;
+
+#ifdef __linux__
+        /* a pipe can reference the zero page instead of copying it */
+        if (sink->pipe) {
+            n = vmsplice(sink->fd, iov, (unsigned long) cnt, 0);
+            if (n < 0 && errno != EINTR) {
+                /* not supported by this pipe, fall back to writev() */
+                sink->pipe = 0;
+                n = 0;
+            }
+        } else
+#endif
+        n = writev(sink->fd, iov, cnt);
+
+        iov[cnt - 1].iov_len = STREAM_PAGE_SIZE;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (n == 0 && !sink->pipe))
+            return 1;
+
+        /* all the bytes are zeros, a short write can simply be resumed */
+        len -= (long) n;
+    }
+    return 0;
+#else
+    size_t n;
+
+    for (; len > 0L; len -= (long) n) {
+        n = len > STREAM_PAGE_SIZE ? STREAM_PAGE_SIZE : (size_t) len;
+        if (fwrite(sink->zero, 1, n, sink->fp) != n)
+            return 1;
+    }
+    return 0;
+#endif
+}
+
+int streamsink_alloc(imgsink *sink, long size, int policy) {
+    /* nothing to preallocate, zeros are written when needed */
+    (void) size;
+    (void) policy;
+    sink->pos = 0L;
+    return 0;
+}
+
+int streamsink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    if (off < sink->pos) {
+        /* streams cannot seek backwards */
+        errno = ESPIPE;
+        return 1;
+    }
+    if (streamsink_zero(sink, off - sink->pos) != 0 || streamsink_put(sink, buf, len) != 0)
+        return 1;
+    sink->pos = off + (long) len;
+    return 0;
+}
+
+int streamsink_finish(imgsink *sink, long size) {
+    if (streamsink_zero(sink, size - sink->pos) != 0)
+        return 1;
+    sink->pos = size;
+    return fflush(sink->fp) != 0;
+}
+
+void streamsink_release(imgsink *sink) {
+    free(sink->zero);
+    sink->zero = NULL;
+}
+
+/*
+ * Initializes a sink writing sequentially to a stream, like a pipe. Gaps
+ * between writes are filled with zeros.
+ */
+int imgsink_stream(imgsink *sink, FILE *fp) {
+#ifdef _POSIX_SOURCE
+    struct stat st;
+#endif
+
+    memset(sink, 0, sizeof(imgsink));
+    sink->alloc = streamsink_alloc;
+    sink->write = streamsink_write;
+    sink->finish = streamsink_finish;
+    sink->release = streamsink_release;
+    sink->fp = fp;
+
+#ifdef _POSIX_SOURCE
+    if (posix_memalign((void **) &sink->zero, STREAM_PAGE_SIZE, STREAM_PAGE_SIZE) != 0)
+        sink->zero = NULL;
+    else
+        memset(sink->zero, 0, STREAM_PAGE_SIZE);
+
+    sink->fd = fileno(fp);
+    if (fflush(fp) != 0 || fstat(sink->fd, &st) != 0)
+        return 1;
+    sink->pipe = S_ISFIFO(st.st_mode);
+#ifdef F_SETPIPE_SZ
+    /* larger pipes need fewer system calls, failing is not an issue */
+    if (sink->pipe)
+        fcntl(sink->fd, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+#endif
+#else
+    sink->zero = calloc(STREAM_PAGE_SIZE, 1);
+#ifdef __MSDOS__
+    setmode(fileno(fp), O_BINARY);
+#endif
+#endif
+
+    return sink->zero == NULL;
+}
+
+#ifdef _POSIX_SOURCE
+/*
+ * Mapped image file state.
+ */
+typedef struct {
+    unsigned char *map; /* Mapped image, NULL if not mapped */
+    size_t size;        /* Size of the mapping */
+    int advice;         /* Access advice */
+    int sync;           /* Non-zero to msync() before unmapping */
+} mmapstate;
+
+int mmapsink_alloc(imgsink *sink, long size, int policy) {
+    mmapstate *mm = (mmapstate *) sink->data;
+    void *map;
+
+    /* sets the file size the mapping needs, zeros are read from holes */
+    if (image_alloc(sink->fp, size, policy) != 0 || fflush(sink->fp) != 0)
+        return 1;
+    if (size == 0L)
+        return 0;
+
+    map = mmap(NULL, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(sink->fp), 0);
+    if (map == MAP_FAILED)
+        return 1;
+    mm->map = (unsigned char *) map;
+    mm->size = (size_t) size;
+
+    if (mm->advice == MMAP_ADVICE_SEQUENTIAL)
+        madvise(mm->map, mm->size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+int mmapsink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    mmapstate *mm = (mmapstate *) sink->data;
+
+    if (off < 0L || (size_t) off + len > mm->size) {
+        errno = EINVAL;
+        return 1;
+    }
+    memcpy(mm->map + off, buf, len);
+    return 0;
+}
+
+int mmapsink_finish(imgsink *sink, long size) {
+    mmapstate *mm = (mmapstate *) sink->data;
+    int rc = 0;
+
+    (void) size;
+    if (mm->map == NULL)
+        return 0;
+
+    if (mm->sync && msync(mm->map, mm->size, MS_SYNC) != 0)
+        rc = 1;
+    /* the pages stay in the file, they only leave this process */
+    if (mm->advice == MMAP_ADVICE_DONTNEED)
+        madvise(mm->map, mm->size, MADV_DONTNEED);
+    if (munmap(mm->map, mm->size) != 0)
+        rc = 1;
+    mm->map = NULL;
+    return rc;
+}
+
+void mmapsink_release(imgsink *sink) {
+    mmapstate *mm = (mmapstate *) sink->data;
+
+    if (mm != NULL && mm->map != NULL)
+        munmap(mm->map, mm->size);
+    free(mm);
+    sink->data = NULL;
+}
+
+/*
+ * Initializes a sink writing a raw image file through a shared memory
+ * mapping, with the given access advice. The file is sized by the
+ * preallocation and every structure is then copied in place.
+ */
+int imgsink_mmap(imgsink *sink, FILE *fp, int advice, int sync) {
+    mmapstate *mm;
+
+    memset(sink, 0, sizeof(imgsink));
+    sink->alloc = mmapsink_alloc;
+    sink->write = mmapsink_write;
+    sink->finish = mmapsink_finish;
+    sink->release = mmapsink_release;
+    sink->fp = fp;
+
+    mm = calloc(1, sizeof(mmapstate));
+    if (mm == NULL)
+        return 1;
+    mm->advice = advice;
+    mm->sync = sync;
+    sink->data = mm;
+    return 0;
+}
+#endif
+
+#ifdef _POSIX_SOURCE
+/*
+ * Aligned buffers kept for reuse by direct sinks, shared by all images.
+ */
+void *direct_pool[DIRECT_POOL_MAX];
+int direct_pooled = 0;
+pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Takes an aligned buffer of DIRECT_BUF_SIZE bytes from the pool, or
+ * allocates one. Returns NULL if there is not enough memory.
+ */
+void *direct_bufget(void) {
+    void *buf = NULL;
+
+    pthread_mutex_lock(&direct_lock);
+    if (direct_pooled > 0)
+        buf = direct_pool[--direct_pooled];
+    pthread_mutex_unlock(&direct_lock);
+
+    if (buf == NULL && posix_memalign(&buf, DIRECT_ALIGN, (size_t) DIRECT_BUF_SIZE) != 0)
+        buf = NULL;
+    return buf;
+}
+
+/*
+ * Gives a buffer back to the pool, or frees it if the pool is full.
+ */
+void direct_bufput(void *buf) {
+    if (buf == NULL)
+        return;
+
+    pthread_mutex_lock(&direct_lock);
+    if (direct_pooled < DIRECT_POOL_MAX) {
+        direct_pool[direct_pooled++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&direct_lock);
+    free(buf);
+}
+
+/*
+ * Direct image file state. The window mirrors the image from the block of
+ * the first write since the window was moved.
+ */
+typedef struct {
+    unsigned char *buf; /* Aligned window of the image */
+    long base;          /* Image offset of the window, block aligned */
+    long len;           /* Bytes of the window written so far */
+} directstate;
+
+/*
+ * Writes an aligned buffer at an aligned offset of the image file.
+ */
+int direct_pwrite(imgsink *sink, const unsigned char *buf, long len, long off) {
+    ssize_t n;
+
+    for (; len > 0L; len -= (long) n, off += (long) n, buf += n) {
+        n = pwrite(sink->fd, buf, (size_t) len, (off_t) off);
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else if (n <= 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Writes the window padded with zeros to whole blocks.
+ */
+int direct_flush(imgsink *sink) {
+    directstate *dio = (directstate *) sink->data;
+    long end = (dio->len + DIRECT_ALIGN - 1L) & ~(DIRECT_ALIGN - 1L);
+
+    if (dio->len == 0L)
+        return 0;
+    memset(dio->buf + dio->len, 0, (size_t) (end - dio->len));
+    return direct_pwrite(sink, dio->buf, end, dio->base);
+}
+
+int directsink_alloc(imgsink *sink, long size, int policy) {
+    directstate *dio = (directstate *) sink->data;
+    long off, n;
+    int rc = 0;
+
+    sink->pos = 0L;
+    if (policy == ALLOC_SPARSE)
+        return ftruncate(sink->fd, (off_t) size) != 0;
+    if (policy == ALLOC_RESERVE) {
+        errno = posix_fallocate(sink->fd, 0, (off_t) size);
+        return errno != 0;
+    }
+
+    /* full, the window is not in use yet; the tail is truncated at the end */
+    memset(dio->buf, 0, (size_t) DIRECT_BUF_SIZE);
+    for (off = 0L; rc == 0 && off < size; off += n) {
+        n = size - off > DIRECT_BUF_SIZE ? DIRECT_BUF_SIZE
+                                         : (size - off + DIRECT_ALIGN - 1L) & ~(DIRECT_ALIGN - 1L);
+        rc = direct_pwrite(sink, dio->buf, n, off);
+    }
+    return rc;
+}
+
+int directsink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    directstate *dio = (directstate *) sink->data;
+    const unsigned char *p = (const unsigned char *) buf;
+    long end, rel, n;
+
+    if (off < sink->pos) {
+        /* blocks are only written once */
+        errno = ESPIPE;
+        return 1;
+    }
+    sink->pos = off + (long) len;
+
+    while (len > 0) {
+        /* writes beyond the last block of the window move it */
+        end = (dio->len + DIRECT_ALIGN - 1L) & ~(DIRECT_ALIGN - 1L);
+        if (dio->len == 0L || off > dio->base + end || off >= dio->base + DIRECT_BUF_SIZE) {
+            if (direct_flush(sink) != 0)
+                return 1;
+
+            dio->base = off & ~(DIRECT_ALIGN - 1L);
+            dio->len = 0L;
+        }
+
+        rel = off - dio->base;
+        memset(dio->buf + dio->len, 0, (size_t) (rel - dio->len));
+        n = DIRECT_BUF_SIZE - rel < (long) len ? DIRECT_BUF_SIZE - rel : (long) len;
+        memcpy(dio->buf + rel, p, (size_t) n);
+        dio->len = rel + n;
+        off += n;
+        p += n;
+        len -= (size_t) n;
+    }
+
+    return 0;
+}
+
+int directsink_finish(imgsink *sink, long size) {
+    directstate *dio = (directstate *) sink->data;
+
+    if (direct_flush(sink) != 0)
+        return 1;
+    dio->len = 0L;
+
+    /* drops the padding of the last block */
+    return ftruncate(sink->fd, (off_t) size) != 0;
+}
+
+void directsink_release(imgsink *sink) {
+    directstate *dio = (directstate *) sink->data;
+
+    if (dio != NULL)
+        direct_bufput(dio->buf);
+    free(dio);
+    sink->data = NULL;
+}
+
+/*
+ * Initializes a sink writing a raw image file with O_DIRECT, bypassing the
+ * page cache. Writes are gathered in an aligned window and written as whole
+ * blocks, skipping the blocks that are never written so that the file stays
+ * sparse. Falls back to cached writes where O_DIRECT is not supported.
+ */
+int imgsink_direct(imgsink *sink, FILE *fp) {
+    directstate *dio;
+    int flags;
+
+    memset(sink, 0, sizeof(imgsink));
+    sink->alloc = directsink_alloc;
+    sink->write = directsink_write;
+    sink->finish = directsink_finish;
+    sink->release = directsink_release;
+    sink->fp = fp;
+    sink->fd = fileno(fp);
+
+    dio = calloc(1, sizeof(directstate));
+    if (dio == NULL)
+        return 1;
+    sink->data = dio;
+    if ((dio->buf = direct_bufget()) == NULL)
+        return 1;
+
+    /* nothing was written through the stream, it only holds the descriptor */
+#ifdef O_DIRECT
+    flags = fcntl(sink->fd, F_GETFL);
+    if (flags != -1 && fcntl(sink->fd, F_SETFL, flags | O_DIRECT) == 0)
+        return 0;
+#else
+    (void) flags;
+#endif
+    fputs("Warning: direct I/O is not supported for the image file, using the page cache.\n", stderr);
+
+    return 0;
+}
+#endif
+
+#ifdef _POSIX_SOURCE
+int pwritesink_alloc(imgsink *sink, long size, int policy) {
+    /* nothing is buffered in the stream afterwards, it only holds the descriptor */
+    return image_alloc(sink->fp, size, policy) != 0 || fflush(sink->fp) != 0;
+}
+
+int pwritesink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    return direct_pwrite(sink, (const unsigned char *) buf, (long) len, off);
+}
+
+int pwritesink_finish(imgsink *sink, long size) {
+    (void) sink;
+    (void) size;
+    return 0;
+}
+
+/*
+ * Initializes a sink writing a raw image file with pwrite(), without the
+ * seeks and copies of the stream.
+ */
+int imgsink_pwrite(imgsink *sink, FILE *fp) {
+    memset(sink, 0, sizeof(imgsink));
+    sink->alloc = pwritesink_alloc;
+    sink->write = pwritesink_write;
+#ifdef __linux__
+    sink->writev = filesink_writev;
+#endif
+    sink->finish = pwritesink_finish;
+    sink->release = filesink_release;
+    sink->fp = fp;
+    sink->fd = fileno(fp);
+    return 0;
+}
+
+int devsink_alloc(imgsink *sink, long size, int policy) {
+#ifdef __linux__
+    unsigned long long range[2];
+    struct stat st;
+
+    range[0] = 0ULL;
+    range[1] = (unsigned long long) size;
+    if (fstat(sink->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        /* lets flash media reclaim the blocks, the contents are undefined */
+        if (policy == ALLOC_SPARSE)
+            ioctl(sink->fd, BLKDISCARD, range);
+        /* the device zeroes or unmaps the range itself where it can */
+        if (ioctl(sink->fd, BLKZEROOUT, range) == 0)
+            return 0;
+    } else {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        /* holes read as zeros and free the blocks of a file */
+        if (fallocate(sink->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, (off_t) size) == 0)
+            return 0;
+#endif
+    }
+#else
+    (void) policy;
+#endif
+
+    /* neither the device nor the filesystem can clear it */
+    return image_zerofill(sink->fp, size) != 0 || fflush(sink->fp) != 0;
+}
+
+/*
+ * Initializes a sink writing a raw image in place onto an existing target,
+ * like a block device, which is cleared instead of truncated. Only the
+ * structures and the files are then written.
+ */
+int imgsink_device(imgsink *sink, FILE *fp) {
+    imgsink_pwrite(sink, fp);
+    sink->alloc = devsink_alloc;
+    return 0;
+}
+#endif
+
+#if defined(__linux__) && defined(HAVE_IO_URING)
+/*
+ * io_uring image file state. Writes are copied into registered buffers and
+ * queued, so that many of them are in flight while the writer goes on.
+ */
+typedef struct {
+    int ring;                     /* Ring file descriptor */
+    unsigned *sqhead;             /* Submission queue head */
+    unsigned *sqtail;             /* Submission queue tail */
+    unsigned sqmask;              /* Submission queue index mask */
+    unsigned *sqarray;            /* Submission queue indexes */
+    struct io_uring_sqe *sqes;    /* Submission queue entries */
+    unsigned *cqhead;             /* Completion queue head */
+    unsigned *cqtail;             /* Completion queue tail */
+    unsigned cqmask;              /* Completion queue index mask */
+    struct io_uring_cqe *cqes;    /* Completion queue entries */
+    void *sqmap;                  /* Submission queue mapping */
+    size_t sqsize;                /* Size of the submission queue mapping */
+    void *cqmap;                  /* Completion queue mapping, can be sqmap */
+    size_t cqsize;                /* Size of the completion queue mapping */
+    size_t sqesize;               /* Size of the entries mapping */
+    unsigned char *pool;          /* Buffers, URING_BUF_SIZE bytes each */
+    int fixed;                    /* Non-zero if the buffers are registered */
+    int free[URING_DEPTH];        /* Free buffers */
+    int nfree;                    /* Number of free buffers */
+    long off[URING_DEPTH];        /* Image offset of each busy buffer */
+    size_t len[URING_DEPTH];      /* Length of each busy buffer */
+    unsigned queued;              /* Entries queued but not submitted */
+    int error;                    /* errno of the first failed write, 0 if none */
+} uringstate;
+
+/*
+ * Submits the queued writes and waits for at least the given number of them
+ * to complete, then reaps the completions.
+ */
+int uring_enter(imgsink *sink, unsigned wait) {
+    uringstate *ur = (uringstate *) sink->data;
+    struct io_uring_cqe *cqe;
+    unsigned head, slot;
+    long n;
+
+    while (ur->queued > 0 || wait > 0) {
+        n = syscall(__NR_io_uring_enter, ur->ring, ur->queued, wait,
+                    wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return 1;
+        ur->queued -= (unsigned) n;
+
+        /* the kernel publishes completions before moving the tail */
+        head = *ur->cqhead;
+        for (; head != __atomic_load_n(ur->cqtail, __ATOMIC_ACQUIRE); head++) {
+            cqe = &ur->cqes[head & ur->cqmask];
+            slot = (unsigned) cqe->user_data;
+            if (cqe->res < 0 && ur->error == 0) {
+                ur->error = -cqe->res;
+            } else if (cqe->res >= 0 && (size_t) cqe->res < ur->len[slot] && ur->error == 0 &&
+                       direct_pwrite(sink, ur->pool + slot * URING_BUF_SIZE + cqe->res,
+                                     (long) (ur->len[slot] - (size_t) cqe->res),
+                                     ur->off[slot] + cqe->res) != 0) {
+                /* short writes are completed synchronously */
+                ur->error = errno;
+            }
+            ur->free[ur->nfree++] = (int) slot;
+            if (wait > 0)
+                wait--;
+        }
+        __atomic_store_n(ur->cqhead, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int uringsink_alloc(imgsink *sink, long size, int policy) {
+    return image_alloc(sink->fp, size, policy) != 0 || fflush(sink->fp) != 0;
+}
+
+int uringsink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    uringstate *ur = (uringstate *) sink->data;
+    const unsigned char *p = (const unsigned char *) buf;
+    struct io_uring_sqe *sqe;
+    unsigned tail, index;
+    size_t n;
+    int slot;
+
+    for (; len > 0; len -= n, off += (long) n, p += n) {
+        if (ur->nfree == 0 && uring_enter(sink, 1) != 0)
+            return 1;
+        if (ur->error != 0) {
+            errno = ur->error;
+            return 1;
+        }
+
+        n = len > (size_t) URING_BUF_SIZE ? (size_t) URING_BUF_SIZE : len;
+        slot = ur->free[--ur->nfree];
+        memcpy(ur->pool + slot * URING_BUF_SIZE, p, n);
+        ur->off[slot] = off;
+        ur->len[slot] = n;
+
+        tail = *ur->sqtail;
+        index = tail & ur->sqmask;
+        sqe = &ur->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = ur->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = sink->fd;
+        sqe->off = (unsigned long long) off;
+        sqe->addr = (unsigned long long) (size_t) (ur->pool + slot * URING_BUF_SIZE);
+        sqe->len = (unsigned) n;
+        sqe->buf_index = (unsigned short) (ur->fixed ? slot : 0);
+        sqe->user_data = (unsigned long long) slot;
+        ur->sqarray[index] = index;
+        /* the entry must be visible before the tail that publishes it */
+        __atomic_store_n(ur->sqtail, tail + 1, __ATOMIC_RELEASE);
+
+        if (++ur->queued >= URING_BATCH && uring_enter(sink, 0) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+int uringsink_finish(imgsink *sink, long size) {
+    uringstate *ur = (uringstate *) sink->data;
+
+    (void) size;
+    if (uring_enter(sink, (unsigned) (URING_DEPTH - ur->nfree)) != 0)
+        return 1;
+    if (ur->error != 0) {
+        errno = ur->error;
+        return 1;
+    }
+    return 0;
+}
+
+void uringsink_release(imgsink *sink) {
+    uringstate *ur = (uringstate *) sink->data;
+
+    if (ur == NULL)
+        return;
+    /* the kernel may still use the buffers of writes in flight */
+    if (ur->nfree < URING_DEPTH && ur->sqes != NULL)
+        uring_enter(sink, (unsigned) (URING_DEPTH - ur->nfree));
+    if (ur->sqes != NULL)
+        munmap(ur->sqes, ur->sqesize);
+    if (ur->cqmap != NULL && ur->cqmap != ur->sqmap)
+        munmap(ur->cqmap, ur->cqsize);
+    if (ur->sqmap != NULL)
+        munmap(ur->sqmap, ur->sqsize);
+    if (ur->ring != -1)
+        close(ur->ring);
+    free(ur->pool);
+    free(ur);
+    sink->data = NULL;
+}
+
+/*
+ * Maps the queues of a new ring.
+ */
+int uring_setup(uringstate *ur) {
+    struct io_uring_params p;
+    unsigned char *sq, *cq;
+    void *map;
+
+    memset(&p, 0, sizeof(p));
+    ur->ring = (int) syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (ur->ring < 0)
+        return 1;
+
+    ur->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    /* both queues may share a single mapping */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cqsize > ur->sqsize)
+            ur->sqsize = ur->cqsize;
+        ur->cqsize = ur->sqsize;
+    }
+
+    map = mmap(NULL, ur->sqsize, PROT_READ | PROT_WRITE, MAP_SHARED, ur->ring, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED)
+        return 1;
+    ur->sqmap = map;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cqmap = map;
+    } else {
+        map = mmap(NULL, ur->cqsize, PROT_READ | PROT_WRITE, MAP_SHARED, ur->ring, IORING_OFF_CQ_RING);
+        if (map == MAP_FAILED)
+            return 1;
+        ur->cqmap = map;
+    }
+    ur->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, ur->sqesize, PROT_READ | PROT_WRITE, MAP_SHARED, ur->ring, IORING_OFF_SQES);
+    if (map == MAP_FAILED)
+        return 1;
+    ur->sqes = (struct io_uring_sqe *) map;
+
+    sq = (unsigned char *) ur->sqmap;
+    cq = (unsigned char *) ur->cqmap;
+    ur->sqhead = (unsigned *) (sq + p.sq_off.head);
+    ur->sqtail = (unsigned *) (sq + p.sq_off.tail);
+    ur->sqmask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    ur->sqarray = (unsigned *) (sq + p.sq_off.array);
+    ur->cqhead = (unsigned *) (cq + p.cq_off.head);
+    ur->cqtail = (unsigned *) (cq + p.cq_off.tail);
+    ur->cqmask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Initializes a sink writing a raw image file through io_uring, with many
+ * writes in flight. Returns non-zero if io_uring is not available, in which
+ * case the sink must still be released.
+ */
+int imgsink_uring(imgsink *sink, FILE *fp) {
+    struct iovec iov[URING_DEPTH];
+    uringstate *ur;
+    int i;
+
+    memset(sink, 0, sizeof(imgsink));
+    sink->alloc = uringsink_alloc;
+    sink->write = uringsink_write;
+    sink->finish = uringsink_finish;
+    sink->release = uringsink_release;
+    sink->fp = fp;
+    sink->fd = fileno(fp);
+
+    ur = calloc(1, sizeof(uringstate));
+    if (ur == NULL)
+        return 1;
+    ur->ring = -1;
+    sink->data = ur;
+
+    if (posix_memalign((void **) &ur->pool, 4096, (size_t) (URING_DEPTH * URING_BUF_SIZE)) != 0) {
+        ur->pool = NULL;
+        return 1;
+    }
+    for (i = 0; i < URING_DEPTH; i++) {
+        ur->free[i] = i;
+        iov[i].iov_base = ur->pool + i * URING_BUF_SIZE;
+        iov[i].iov_len = (size_t) URING_BUF_SIZE;
+    }
+    ur->nfree = URING_DEPTH;
+
+    if (uring_setup(ur) != 0)
+        return 1;
+    /* registered buffers save the kernel from mapping them on every write */
+    ur->fixed = syscall(__NR_io_uring_register, ur->ring, IORING_REGISTER_BUFFERS, iov, URING_DEPTH) == 0;
+    return 0;
+}
+#endif
+
+/*
+ * Memory sink state.
+ */
+typedef struct {
+    unsigned char *buf; /* Caller buffer */
+    long size;          /* Size of the caller buffer */
+    imgsink_fn fn;      /* Callback of callback sinks */
+    void *ctx;          /* Callback context */
+} memstate;
+
+int memsink_alloc(imgsink *sink, long size, int policy) {
+    memstate *mem = (memstate *) sink->data;
+
+    /* memory is always allocated by the caller */
+    (void) policy;
+    sink->pos = 0L;
+    if (size > mem->size) {
+        errno = ENOSPC;
+        return 1;
+    }
+    return 0;
+}
+
+int memsink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    memstate *mem = (memstate *) sink->data;
+
+    if (off < sink->pos || off + (long) len > mem->size) {
+        errno = ENOSPC;
+        return 1;
+    }
+
+    /* the caller buffer is not necessarily zeroed */
+    memset(mem->buf + sink->pos, 0, (size_t) (off - sink->pos));
+    memcpy(mem->buf + off, buf, len);
+    sink->pos = off + (long) len;
+    return 0;
+}
+
+int memsink_finish(imgsink *sink, long size) {
+    memstate *mem = (memstate *) sink->data;
+
+    memset(mem->buf + sink->pos, 0, (size_t) (size - sink->pos));
+    sink->pos = size;
+    return 0;
+}
+
+void memsink_release(imgsink *sink) {
+    free(sink->data);
+    sink->data = NULL;
+}
+
+/*
+ * Initializes a sink writing a raw image into a caller buffer of the given
+ * size, which must be at least as large as the image.
+ */
+int imgsink_memory(imgsink *sink, void *buf, long size) {
+    memstate *mem;
+
+    memset(sink, 0, sizeof(imgsink));
+    sink->alloc = memsink_alloc;
+    sink->write = memsink_write;
+    sink->finish = memsink_finish;
+    sink->release = memsink_release;
+
+    mem = calloc(1, sizeof(memstate));
+    if (mem == NULL)
+        return 1;
+    mem->buf = (unsigned char *) buf;
+    mem->size = size;
+    sink->data = mem;
+    return 0;
+}
+
+int cbsink_alloc(imgsink *sink, long size, int policy) {
+    (void) sink;
+    (void) size;
+    (void) policy;
+    return 0;
+}
+
+int cbsink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    memstate *mem = (memstate *) sink->data;
+
+    return mem->fn(mem->ctx, off, buf, len) != 0;
+}
+
+int cbsink_finish(imgsink *sink, long size) {
+    memstate *mem = (memstate *) sink->data;
+
+    return mem->fn(mem->ctx, size, NULL, 0) != 0;
+}
+
+/*
+ * Initializes a sink handing the raw image data to a callback, see
+ * imgsink_fn.
+ */
+int imgsink_callback(imgsink *sink, imgsink_fn fn, void *ctx) {
+    memstate *mem;
+
+    memset(sink, 0, sizeof(imgsink));
+    sink->alloc = cbsink_alloc;
+    sink->write = cbsink_write;
+    sink->finish = cbsink_finish;
+    sink->release = memsink_release;
+
+    mem = calloc(1, sizeof(memstate));
+    if (mem == NULL)
+        return 1;
+    mem->fn = fn;
+    mem->ctx = ctx;
+    sink->data = mem;
+    return 0;
+}
+
+/*
+ * Dynamic VHD state.
+ */
+typedef struct {
+    unsigned char footer[512]; /* Hard disk footer */
+    unsigned char header[1024]; /* Dynamic disk header */
+    unsigned char *locators;   /* Parent locators data, NULL if none */
+    long locsize;              /* Size of the parent locators data in bytes */
+    unsigned long *bat;        /* Block Allocation Table, in host byte order */
+    long entries;              /* Number of BAT entries */
+    long next;                 /* Sector where the next block is allocated */
+} vhdstate;
+
+/*
+ * Computes the checksum of a VHD footer or dynamic disk header.
+ */
+unsigned long vhd_checksum(const unsigned char *buf, size_t len) {
+    unsigned long sum = 0;
+
+    while (len-- > 0)
+        sum += *buf++;
+    return ~sum & 0xFFFFFFFFUL;
+}
+
+/*
+ * Writes a buffer at the given offset of the VHD file.
+ */
+int vhd_put(imgsink *sink, long off, const void *buf, size_t len) {
+    if (off != sink->pos && fseek(sink->fp, off, SEEK_SET) != 0)
+        return 1;
+    if (fwrite(buf, 1, len, sink->fp) != len)
+        return 1;
+    sink->pos = off + (long) len;
+    return 0;
+}
+
+/*
+ * Fills the 16 bytes unique id of a VHD from a seed.
+ */
+void vhd_uid(unsigned char *id, unsigned long seed) {
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        seed = seed * 1103515245UL + 12345UL;
+        id[i] = (unsigned char) ((seed >> 16) & 0xFF);
+    }
+}
+
+int vhdsink_alloc(imgsink *sink, long size, int policy) {
+    vhdstate *vhd = (vhdstate *) sink->data;
+    unsigned char *f = vhd->footer;
+    long i, batsize;
+
+    /* blocks are allocated as the image is written, nothing to preallocate */
+    (void) policy;
+
+    vhd->entries = (size + VHD_BLOCK_SIZE - 1L) / VHD_BLOCK_SIZE;
+    vhd->bat = malloc((size_t) vhd->entries * sizeof(unsigned long));
+    if (vhd->bat == NULL)
+        return 1;
+    for (i = 0; i < vhd->entries; i++)
+        vhd->bat[i] = VHD_UNUSED;
+
+    /* blocks follow the footer copy, the dynamic header, the BAT and the
+     * parent locators of differencing disks */
+    batsize = (vhd->entries * 4L + 511L) / 512L;
+    vhd->next = 3L + batsize;
+    for (i = 0; i < 8 && vhd->header[0x240 + i * 24] != 0; i++) {
+        memcpybe(vhd->header + 0x240 + i * 24 + 0x10, (unsigned long) vhd->next * 512UL, 8);
+        vhd->next += (long) memgetbe(vhd->header + 0x240 + i * 24 + 0x04, 4);
+    }
+
+    memcpybe(vhd->header + 0x01C, (unsigned long) vhd->entries, 4);
+    memcpybe(vhd->header + 0x024, vhd_checksum(vhd->header, 1024), 4);
+
+    /* reproducible images take their time stamp and unique id from the seed */
+    if (sink->seeded) {
+        memcpybe(f + 0x018, sink->seed > VHD_EPOCH ? sink->seed - VHD_EPOCH : 0UL, 4);
+        vhd_uid(f + 0x044, sink->seed);
+    }
+
+    memcpybe(f + 0x028, (unsigned long) size, 8);
+    memcpybe(f + 0x030, (unsigned long) size, 8);
+    memcpybe(f + 0x040, vhd_checksum(f, 512), 4);
+
+    return 0;
+}
+
+int vhdsink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    vhdstate *vhd = (vhdstate *) sink->data;
+    const char *p = (const char *) buf;
+    unsigned char bitmap[512];
+    long block, boff;
+    size_t n;
+
+    while (len > 0) {
+        block = off / VHD_BLOCK_SIZE;
+        boff = off % VHD_BLOCK_SIZE;
+        n = (long) len > VHD_BLOCK_SIZE - boff ? (size_t) (VHD_BLOCK_SIZE - boff) : len;
+
+        if (block >= vhd->entries)
+            return 1;
+
+        if (vhd->bat[block] == VHD_UNUSED) {
+            /* unallocated blocks read as zeros already */
+            if (memzero(p, n)) {
+                off += (long) n;
+                p += n;
+                len -= n;
+                continue;
+            }
+
+            /* every sector is marked present, unwritten ones are file holes */
+            memset(bitmap, 0xFF, sizeof(bitmap));
+            vhd->bat[block] = (unsigned long) vhd->next;
+            if (vhd_put(sink, vhd->next * 512L, bitmap, sizeof(bitmap)) != 0)
+                return 1;
+            vhd->next += 1L + VHD_BLOCK_SIZE / 512L;
+        }
+
+        if (vhd_put(sink, ((long) vhd->bat[block] + 1L) * 512L + boff, p, n) != 0)
+            return 1;
+
+        off += (long) n;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int vhdsink_finish(imgsink *sink, long size) {
+    vhdstate *vhd = (vhdstate *) sink->data;
+    unsigned char buf[1024];
+    long i;
+
+    (void) size;
+
+    /* the footer goes after the last block, a copy at the start of the file */
+    if (vhd_put(sink, vhd->next * 512L, vhd->footer, 512) != 0 ||
+        vhd_put(sink, 0L, vhd->footer, 512) != 0)
+        return 1;
+
+    if (vhd_put(sink, 512L, vhd->header, 1024) != 0)
+        return 1;
+
+    /* parent locators come right after the BAT */
+    if (vhd->locators != NULL &&
+        vhd_put(sink, 1536L + (vhd->entries * 4L + 511L) / 512L * 512L,
+                vhd->locators, (size_t) vhd->locsize) != 0)
+        return 1;
+
+    /* Block Allocation Table, one sector at a time */
+    for (i = 0; i < vhd->entries; i++) {
+        memcpybe(buf + (i % 128L) * 4L, vhd->bat[i], 4);
+        if (i % 128L == 127L || i == vhd->entries - 1L) {
+            memset(buf + (i % 128L + 1L) * 4L, 0xFF, (size_t) (127L - i % 128L) * 4U);
+            if (vhd_put(sink, 1536L + i / 128L * 512L, buf, 512) != 0)
+                return 1;
+        }
+    }
+
+    return fflush(sink->fp) != 0;
+}
+
+void vhdsink_release(imgsink *sink) {
+    vhdstate *vhd = (vhdstate *) sink->data;
+
+    if (vhd != NULL) {
+        free(vhd->bat);
+        free(vhd->locators);
+    }
+    free(vhd);
+    sink->data = NULL;
+}
+
+/*
+ * Number of VHD images created, so that images created in the same second
+ * get different identifiers.
+ */
+unsigned long vhd_count = 0UL;
+#ifdef _POSIX_SOURCE
+pthread_mutex_t vhd_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Initializes a VHD sink with the given geometry and disk type.
+ */
+int vhd_init(imgsink *sink, FILE *fp, int cylinders, int heads, int sectors, unsigned long type) {
+    unsigned long uid;
+    vhdstate *vhd;
+    unsigned char *f, *h;
+
+    memset(sink, 0, sizeof(imgsink));
+    sink->alloc = vhdsink_alloc;
+    sink->write = vhdsink_write;
+    sink->finish = vhdsink_finish;
+    sink->release = vhdsink_release;
+    sink->fp = fp;
+    sink->pos = -1L;
+
+    vhd = calloc(1, sizeof(vhdstate));
+    if (vhd == NULL)
+        return 1;
+    sink->data = vhd;
+
+    /* hard disk footer, sizes and checksum are filled in by alloc() */
+    f = vhd->footer;
+    memcpy(f + 0x000, "conectix", 8);
+    memcpybe(f + 0x008, 0x00000002UL, 4);
+    memcpybe(f + 0x00C, 0x00010000UL, 4);
+    memcpybe(f + 0x010, 512UL, 8);
+    /* VHD timestamps count seconds from 2000-01-01 */
+    memcpybe(f + 0x018, (unsigned long) time(NULL) - VHD_EPOCH, 4);
+    memcpy(f + 0x01C, "imgm", 4);
+    memcpybe(f + 0x020, 0x00010000UL, 4);
+    memcpy(f + 0x024, "Wi2k", 4);
+    /* the geometry of LBA disks is only a hint */
+    memcpybe(f + 0x038, (unsigned long) (cylinders > 0xFFFF ? 0xFFFF : cylinders), 2);
+    f[0x03A] = (unsigned char) heads;
+    f[0x03B] = (unsigned char) sectors;
+    memcpybe(f + 0x03C, type, 4);
+
+    /* unique id, it only has to differ between images */
+#ifdef _POSIX_SOURCE
+    pthread_mutex_lock(&vhd_lock);
+#endif
+    uid = ++vhd_count;
+#ifdef _POSIX_SOURCE
+    pthread_mutex_unlock(&vhd_lock);
+#endif
+    vhd_uid(f + 0x044, (unsigned long) time(NULL) ^ (unsigned long) clock() ^ (uid << 16));
+
+    /* dynamic disk header, entries and checksum are filled in by alloc() */
+    h = vhd->header;
+    memcpy(h + 0x000, "cxsparse", 8);
+    memset(h + 0x008, 0xFF, 8);
+    memcpybe(h + 0x010, 1536UL, 8);
+    memcpybe(h + 0x018, 0x00010000UL, 4);
+    memcpybe(h + 0x020, (unsigned long) VHD_BLOCK_SIZE, 4);
+
+    return 0;
+}
+
+/*
+ * Initializes a sink writing a dynamic VHD file. Only the blocks holding
+ * non-zero data are allocated.
+ */
+int imgsink_vhd(imgsink *sink, FILE *fp, const imgspec *img) {
+    return vhd_init(sink, fp, img->cylinders, img->heads, img->sectors, VHD_TYPE_DYNAMIC);
+}
+
+/*
+ * Encodes an UTF-8 string into at most max UTF-16 code units, in big or
+ * little endian order. Returns the number of code units.
+ */
+int utf16_encode(unsigned char *dest, int max, const char *src, int bigendian) {
+    const unsigned char *p = (const unsigned char *) src;
+    unsigned int c;
+    int n;
+
+    for (n = 0; *p != '\0' && n < max; n++) {
+        c = *p++;
+        if ((c & 0xE0) == 0xC0 && (p[0] & 0xC0) == 0x80) {
+            c = ((c & 0x1F) << 6) | (p[0] & 0x3F);
+            p += 1;
+        } else if ((c & 0xF0) == 0xE0 && (p[0] & 0xC0) == 0x80 && (p[1] & 0xC0) == 0x80) {
+            c = ((c & 0x0F) << 12) | ((p[0] & 0x3F) << 6) | (p[1] & 0x3F);
+            p += 2;
+        } else if (c >= 0x80) {
+            /* outside of the BMP or invalid */
+            c = '?';
+            while ((*p & 0xC0) == 0x80)
+                p++;
+        }
+
+        dest[n * 2 + (bigendian ? 0 : 1)] = (unsigned char) (c >> 8);
+        dest[n * 2 + (bigendian ? 1 : 0)] = (unsigned char) (c & 0xFF);
+    }
+
+    return n;
+}
+
+/*
+ * Computes the path of a file relative to the directory of another file.
+ * Both paths must be absolute. The returned string must be freed.
+ */
+char *path_relative(const char *from, const char *to) {
+    const char *p;
+    char *rel;
+    size_t common = 0, i, up = 0;
+
+    /* common leading directories */
+    for (i = 0; from[i] != '\0' && from[i] == to[i]; i++) {
+        if (from[i] == '/')
+            common = i + 1;
+    }
+    for (p = from + common; *p != '\0'; p++) {
+        if (*p == '/')
+            up++;
+    }
+
+    rel = malloc(up * 3 + strlen(to + common) + 3);
+    if (rel == NULL)
+        return NULL;
+
+    strcpy(rel, up == 0 ? "./" : "");
+    for (i = 0; i < up; i++)
+        strcat(rel, "../");
+    strcat(rel, to + common);
+    return rel;
+}
+
+/*
+ * Adds a parent locator entry with a UTF-16 path to a differencing VHD.
+ */
+int vhd_addlocator(vhdstate *vhd, int index, const char *code, const char *path) {
+    const long len = (long) strlen(path) * 2L;
+    const long space = (len + 511L) / 512L * 512L;
+    unsigned char *loc, *entry = vhd->header + 0x240 + index * 24;
+    int units;
+
+    loc = realloc(vhd->locators, (size_t) (vhd->locsize + space));
+    if (loc == NULL)
+        return 1;
+    memset(loc + vhd->locsize, 0, (size_t) space);
+    vhd->locators = loc;
+    units = utf16_encode(loc + vhd->locsize, (int) (len / 2L), path, 0);
+
+    /* the offset is set by alloc(), once the size of the BAT is known */
+    memcpy(entry, code, 4);
+    memcpybe(entry + 0x04, (unsigned long) space / 512UL, 4);
+    memcpybe(entry + 0x08, (unsigned long) units * 2UL, 4);
+    vhd->locsize += space;
+    return 0;
+}
+
+/*
+ * Initializes a sink writing a differencing VHD file for the given parent,
+ * whose footer has already been read. No blocks are allocated, every read
+ * goes to the parent until the emulator writes to the disk.
+ */
+int imgsink_vhddiff(imgsink *sink, FILE *fp, const unsigned char *parent,
+                    const char *parentpath, const char *childpath) {
+    const char *name;
+    struct stat st;
+    vhdstate *vhd;
+    int rc;
+#ifdef _POSIX_SOURCE
+    char *abspath, *absparent, *rel;
+#endif
+
+    if (vhd_init(sink, fp, (int) memgetbe(parent + 0x038, 2), parent[0x03A],
+                 parent[0x03B], VHD_TYPE_DIFF) != 0)
+        return 1;
+    vhd = (vhdstate *) sink->data;
+
+    /* parent unique id, modification time and file name */
+    memcpy(vhd->header + 0x028, parent + 0x044, 16);
+    if (stat(parentpath, &st) == 0)
+        memcpybe(vhd->header + 0x038, (unsigned long) st.st_mtime - VHD_EPOCH, 4);
+    name = strrchr(parentpath, '/');
+    utf16_encode(vhd->header + 0x040, 256, name != NULL ? name + 1 : parentpath, 1);
+
+#ifdef _POSIX_SOURCE
+    /* absolute and relative paths, so that the pair can be moved together */
+    absparent = realpath(parentpath, NULL);
+    abspath = realpath(childpath, NULL);
+    rel = absparent != NULL && abspath != NULL ? path_relative(abspath, absparent) : NULL;
+    rc = rel == NULL ||
+         vhd_addlocator(vhd, 0, "W2ku", absparent) != 0 ||
+         vhd_addlocator(vhd, 1, "W2ru", rel) != 0;
+    free(absparent);
+    free(abspath);
+    free(rel);
+#else
+    (void) childpath;
+    rc = vhd_addlocator(vhd, 0, "W2ru", parentpath);
+#endif
+
+    return rc;
+}
+
+/*
+ * Reads and validates the footer of a VHD file.
+ */
+int vhd_readfooter(const char *path, unsigned char *footer) {
+    unsigned char sum[4];
+    unsigned long type;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "The file \"%s\" cannot be opened for reading.\n", path);
+        return EC_FILE_ERROR;
+    }
+
+    if (fseek(fp, -512L, SEEK_END) != 0 || fread(footer, 1, 512, fp) != 512) {
+        fprintf(stderr, "Invalid -base option. \"%s\" is not a VHD image.", path);
+        fclose(fp);
+        return EC_INV_BASE;
+    }
+    fclose(fp);
+
+    /* the checksum is computed with its own field zeroed */
+    memcpy(sum, footer + 0x040, 4);
+    memset(footer + 0x040, 0, 4);
+    memcpybe(footer + 0x040, vhd_checksum(footer, 512), 4);
+    type = memgetbe(footer + 0x03C, 4);
+
+    if (memcmp(footer, "conectix", 8) != 0 || memcmp(sum, footer + 0x040, 4) != 0) {
+        fprintf(stderr, "Invalid -base option. \"%s\" is not a VHD image.", path);
+        return EC_INV_BASE;
+    }
+    if (type != VHD_TYPE_FIXED && type != VHD_TYPE_DYNAMIC && type != VHD_TYPE_DIFF) {
+        fprintf(stderr, "Invalid -base option. \"%s\" has an unsupported VHD disk type.", path);
+        return EC_INV_BASE;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+/*
+ * Chunk of a gzip image, compressed independently of the others.
+ */
+typedef struct {
+    unsigned char *in;   /* Uncompressed data, NULL for a run of zero chunks */
+    unsigned char *out;  /* Compressed data */
+    unsigned long len;   /* Uncompressed length, or number of zero chunks */
+    unsigned long olen;  /* Compressed length */
+    unsigned long crc;   /* CRC-32 of the uncompressed data */
+    int zero;            /* Non-zero if the data turned out to be all zeros */
+} gzchunk;
+
+/*
+ * Gzip image state. Chunks are queued in image order and compressed in
+ * batches, in parallel, then written in order.
+ */
+typedef struct {
+    gzchunk chunks[GZ_BATCH_MAX]; /* Queued chunks */
+    int count;                    /* Number of queued chunks */
+    int batch;                    /* Number of chunks compressed at once */
+    int threads;                  /* Number of compression threads */
+    int next;                     /* Next chunk to compress */
+    unsigned char *cur;           /* Chunk being filled */
+    unsigned long curlen;         /* Bytes in the chunk being filled */
+    const unsigned char *zout;    /* Compressed zero chunk, shared */
+    unsigned long zolen;          /* Length of the compressed zero chunk */
+    unsigned long zcrc;           /* CRC-32 of a zero chunk */
+    unsigned long crc;            /* CRC-32 of the image written so far */
+    unsigned long total;          /* Bytes of the image written so far */
+#ifdef _POSIX_SOURCE
+    pthread_mutex_t lock;         /* Protects next */
+#endif
+} gzstate;
+
+/*
+ * Compresses a chunk as raw deflate data ending on a byte boundary, so that
+ * compressed chunks can simply be concatenated.
+ */
+int gz_deflate(const unsigned char *in, unsigned long len, unsigned char **out, unsigned long *olen) {
+    z_stream z;
+    unsigned long bound;
+    int rc;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 1;
+
+    /* room for the full flush marker as well */
+    bound = deflateBound(&z, len) + 16UL;
+    *out = malloc((size_t) bound);
+    if (*out == NULL) {
+        deflateEnd(&z);
+        return 1;
+    }
+
+    z.next_in = (unsigned char *) in;
+    z.avail_in = (uInt) len;
+    z.next_out = *out;
+    z.avail_out = (uInt) bound;
+    rc = deflate(&z, Z_FULL_FLUSH);
+    *olen = bound - z.avail_out;
+    deflateEnd(&z);
+
+    return rc != Z_OK || z.avail_in != 0;
+}
+
+/*
+ * Compressed zero chunk shared by all gz images, made on first use and kept.
+ */
+unsigned char *gz_zout = NULL;
+unsigned long gz_zolen = 0UL;
+unsigned long gz_zcrc = 0UL;
+#ifdef _POSIX_SOURCE
+pthread_mutex_t gz_zlock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Gets the compressed zero chunk, its length and the CRC-32 of a zero chunk.
+ * Returns non-zero if there is not enough memory.
+ */
+int gz_zeroget(const unsigned char **out, unsigned long *olen, unsigned long *crc) {
+    unsigned char *zero, *zout = NULL;
+    unsigned long zolen;
+
+#ifdef _POSIX_SOURCE
+    pthread_mutex_lock(&gz_zlock);
+#endif
+    if (gz_zout == NULL && (zero = calloc((size_t) GZ_CHUNK_SIZE, 1)) != NULL) {
+        if (gz_deflate(zero, (unsigned long) GZ_CHUNK_SIZE, &zout, &zolen) == 0) {
+            gz_zcrc = crc32(0L, zero, (uInt) GZ_CHUNK_SIZE);
+            gz_zolen = zolen;
+            gz_zout = zout;
+        } else {
+            free(zout);
+        }
+        free(zero);
+    }
+    *out = gz_zout;
+    *olen = gz_zolen;
+    *crc = gz_zcrc;
+#ifdef _POSIX_SOURCE
+    pthread_mutex_unlock(&gz_zlock);
+#endif
+    return *out == NULL;
+}
+
+/*
+ * Compresses the queued chunks until there are none left.
+ */
+void *gz_worker(void *arg) {
+    gzstate *gz = (gzstate *) arg;
+    gzchunk *chunk;
+    int i;
+
+    for (;;) {
+#ifdef _POSIX_SOURCE
+        pthread_mutex_lock(&gz->lock);
+#endif
+        i = gz->next < gz->count ? gz->next++ : -1;
+#ifdef _POSIX_SOURCE
+        pthread_mutex_unlock(&gz->lock);
+#endif
+        if (i < 0)
+            break;
+
+        chunk = &gz->chunks[i];
+        if (chunk->in == NULL)
+            continue;
+
+        /* zero chunks reuse the data compressed once at the start */
+        if (chunk->len == (unsigned long) GZ_CHUNK_SIZE && memzero(chunk->in, (size_t) chunk->len)) {
+            chunk->zero = 1;
+            continue;
+        }
+
+        chunk->crc = crc32(0L, chunk->in, (uInt) chunk->len);
+        if (gz_deflate(chunk->in, chunk->len, &chunk->out, &chunk->olen) != 0) {
+            free(chunk->out);
+            chunk->out = NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Compresses the queued chunks in parallel and writes them in order.
+ */
+int gz_flush(imgsink *sink) {
+    gzstate *gz = (gzstate *) sink->data;
+    gzchunk *chunk;
+    unsigned long n;
+    int i, rc = 0;
+#ifdef _POSIX_SOURCE
+    pthread_t workers[GZ_THREADS_MAX];
+    int threads;
+
+    gz->next = 0;
+    for (threads = 1; threads < gz->threads && threads < gz->count; threads++) {
+        if (pthread_create(&workers[threads], NULL, gz_worker, gz) != 0)
+            break;
+    }
+    gz_worker(gz);
+    for (i = 1; i < threads; i++)
+        pthread_join(workers[i], NULL);
+#else
+    gz->next = 0;
+    gz_worker(gz);
+#endif
+
+    for (i = 0; i < gz->count; i++) {
+        chunk = &gz->chunks[i];
+
+        if (chunk->in == NULL || chunk->zero) {
+            for (n = chunk->in == NULL ? chunk->len : 1UL; rc == 0 && n > 0; n--) {
+                if (fwrite(gz->zout, 1, (size_t) gz->zolen, sink->fp) != (size_t) gz->zolen)
+                    rc = 1;
+                gz->crc = crc32_combine(gz->crc, gz->zcrc, GZ_CHUNK_SIZE);
+                gz->total += (unsigned long) GZ_CHUNK_SIZE;
+            }
+        } else if (chunk->out == NULL) {
+            rc = 1;
+        } else if (rc == 0) {
+            if (fwrite(chunk->out, 1, (size_t) chunk->olen, sink->fp) != (size_t) chunk->olen)
+                rc = 1;
+            gz->crc = crc32_combine(gz->crc, chunk->crc, (z_off_t) chunk->len);
+            gz->total += chunk->len;
+        }
+
+        free(chunk->in);
+        free(chunk->out);
+    }
+
+    memset(gz->chunks, 0, sizeof(gzchunk) * (size_t) gz->count);
+    gz->count = 0;
+    return rc;
+}
+
+/*
+ * Queues the chunk being filled, or a zero chunk if cur is NULL.
+ */
+int gz_queue(imgsink *sink, unsigned char *cur, unsigned long len) {
+    gzstate *gz = (gzstate *) sink->data;
+    gzchunk *last = gz->count > 0 ? &gz->chunks[gz->count - 1] : NULL;
+
+    /* runs of zero chunks take a single entry */
+    if (cur == NULL && last != NULL && last->in == NULL) {
+        last->len++;
+        return 0;
+    }
+
+    if (gz->count == gz->batch && gz_flush(sink) != 0) {
+        free(cur);
+        return 1;
+    }
+
+    gz->chunks[gz->count].in = cur;
+    gz->chunks[gz->count].len = cur == NULL ? 1UL : len;
+    gz->count++;
+    return 0;
+}
+
+/*
+ * Appends data, or zeros if buf is NULL, to the image.
+ */
+int gz_put(imgsink *sink, const void *buf, unsigned long len) {
+    gzstate *gz = (gzstate *) sink->data;
+    const unsigned char *p = (const unsigned char *) buf;
+    unsigned long n;
+
+    while (len > 0) {
+        /* whole zero chunks are never buffered */
+        if (p == NULL && gz->curlen == 0 && len >= (unsigned long) GZ_CHUNK_SIZE) {
+            if (gz_queue(sink, NULL, 0) != 0)
+                return 1;
+            len -= (unsigned long) GZ_CHUNK_SIZE;
+            continue;
+        }
+
+        if (gz->cur == NULL && (gz->cur = malloc((size_t) GZ_CHUNK_SIZE)) == NULL)
+            return 1;
+
+        n = (unsigned long) GZ_CHUNK_SIZE - gz->curlen;
+        if (n > len)
+            n = len;
+        if (p != NULL) {
+            memcpy(gz->cur + gz->curlen, p, (size_t) n);
+            p += n;
+        } else {
+            memset(gz->cur + gz->curlen, 0, (size_t) n);
+        }
+        gz->curlen += n;
+        len -= n;
+
+        if (gz->curlen == (unsigned long) GZ_CHUNK_SIZE) {
+            if (gz_queue(sink, gz->cur, gz->curlen) != 0) {
+                gz->cur = NULL;
+                return 1;
+            }
+            gz->cur = NULL;
+            gz->curlen = 0;
+        }
+    }
+
+    return 0;
+}
+
+int gzsink_alloc(imgsink *sink, long size, int policy) {
+    gzstate *gz = (gzstate *) sink->data;
+    unsigned char header[10] = {0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03};
+
+    /* the compressed size is unknown, nothing to preallocate */
+    (void) size;
+    (void) policy;
+    sink->pos = 0L;
+
+    /* every zero chunk of the image reuses the same compressed one */
+    if (gz_zeroget(&gz->zout, &gz->zolen, &gz->zcrc) != 0)
+        return 1;
+
+    gz->crc = crc32(0L, Z_NULL, 0);
+    memcpydw(header + 4, sink->seeded ? (long) sink->seed : (long) time(NULL));
+    return fwrite(header, 1, sizeof(header), sink->fp) != sizeof(header);
+}
+
+int gzsink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    if (off < sink->pos) {
+        /* chunks are compressed in image order */
+        errno = ESPIPE;
+        return 1;
+    }
+    if (gz_put(sink, NULL, (unsigned long) (off - sink->pos)) != 0 ||
+        gz_put(sink, buf, (unsigned long) len) != 0)
+        return 1;
+    sink->pos = off + (long) len;
+    return 0;
+}
+
+int gzsink_finish(imgsink *sink, long size) {
+    gzstate *gz = (gzstate *) sink->data;
+    /* empty final block that terminates the deflate stream */
+    unsigned char trailer[10] = {0x03, 0x00};
+
+    if (gz_put(sink, NULL, (unsigned long) (size - sink->pos)) != 0)
+        return 1;
+    sink->pos = size;
+
+    if (gz->curlen > 0) {
+        if (gz_queue(sink, gz->cur, gz->curlen) != 0) {
+            gz->cur = NULL;
+            return 1;
+        }
+        gz->cur = NULL;
+        gz->curlen = 0;
+    }
+    if (gz_flush(sink) != 0)
+        return 1;
+
+    memcpydw(trailer + 2, (long) gz->crc);
+    memcpydw(trailer + 6, (long) gz->total);
+    return fwrite(trailer, 1, sizeof(trailer), sink->fp) != sizeof(trailer) ||
+           fflush(sink->fp) != 0;
+}
+
+void gzsink_release(imgsink *sink) {
+    gzstate *gz = (gzstate *) sink->data;
+    int i;
+
+    if (gz != NULL) {
+        for (i = 0; i < gz->count; i++) {
+            free(gz->chunks[i].in);
+            free(gz->chunks[i].out);
+        }
+        free(gz->cur);
+#ifdef _POSIX_SOURCE
+        pthread_mutex_destroy(&gz->lock);
+#endif
+    }
+    free(gz);
+    sink->data = NULL;
+}
+
+/*
+ * Initializes a sink writing a gzip compressed raw image sequentially, like
+ * pigz does: the image is split in chunks that are compressed independently
+ * on the given number of threads.
+ */
+int imgsink_gzip(imgsink *sink, FILE *fp, int threads) {
+    gzstate *gz;
+
+    memset(sink, 0, sizeof(imgsink));
+    sink->alloc = gzsink_alloc;
+    sink->write = gzsink_write;
+    sink->finish = gzsink_finish;
+    sink->release = gzsink_release;
+    sink->fp = fp;
+
+    gz = calloc(1, sizeof(gzstate));
+    if (gz == NULL)
+        return 1;
+    sink->data = gz;
+
+    if (threads > GZ_THREADS_MAX)
+        threads = GZ_THREADS_MAX;
+    gz->threads = threads;
+    gz->batch = threads * GZ_BATCH;
+    if (gz->batch > GZ_BATCH_MAX)
+        gz->batch = GZ_BATCH_MAX;
+#ifdef _POSIX_SOURCE
+    pthread_mutex_init(&gz->lock, NULL);
+#endif
+#ifdef __MSDOS__
+    setmode(fileno(fp), O_BINARY);
+#endif
+
+    return 0;
+}
+#endif
+
+/*
+ * Copies the contents of a host file to its clusters.
+ */
+int fsnode_copy(const fsspec *fs, const fsnode *node, imgsink *sink, char *buf, size_t bufsize) {
+    FILE *src;
+    long off = cluster_offset(fs, node->cluster);
+    long left = node->size;
+    size_t n;
+
+    if (node->clusters == 0L)
+        return 0;
+
+    src = fopen(node->path, "rb");
+    if (src == NULL) {
+        fprintf(stderr, "Unable to open \"%s\" for reading.\n", node->path);
+        return 1;
+    }
+
+    for (; left > 0L; left -= (long) n, off += (long) n) {
+        n = left > (long) bufsize ? bufsize : (size_t) left;
+        if (fread(buf, 1, n, src) != n) {
+            fprintf(stderr, "Unable to read \"%s\".\n", node->path);
+            fclose(src);
+            return 1;
+        }
+        if (sink_write(sink, off, buf, n) != 0) {
+            perror("Unable to write image file data");
+            fclose(src);
+            return 1;
+        }
+    }
+
+    fclose(src);
+    return 0;
+}
+
+/*
+ * Writes the files of a directory, then every subdirectory with its
+ * contents, in cluster order. Traced files are written before.
+ */
+int fstree_write(const fsspec *fs, const fsnode *dir, imgsink *sink, char *buf, size_t bufsize) {
+    const fsnode *node;
+    unsigned char *ents;
+    size_t entsize;
+
+    for (node = dir->child; node != NULL; node = node->next) {
+        if (!(node->attr & FS_ATTR_DIR) && !node->traced &&
+            fsnode_copy(fs, node, sink, buf, bufsize) != 0)
+            return 1;
+    }
+
+    for (node = dir->child; node != NULL; node = node->next) {
+        if (!(node->attr & FS_ATTR_DIR))
+            continue;
+
+        entsize = (size_t) (node->clusters * fs->spc * 512L);
+        ents = calloc(entsize, 1);
+        if (ents == NULL) {
+            fputs("Not enough memory to write a directory.\n", stderr);
+            return 1;
+        }
+        fstree_dirents(node, dir, ents);
+        if (dir == fs->root && fs->type == FS_FAT32) {
+            /* ".." is cluster 0 for the root directory, even on FAT32 */
+            memset(ents + FS_DIRENT_SIZE + 0x014, 0, 2);
+            memset(ents + FS_DIRENT_SIZE + 0x01A, 0, 2);
+        }
+
+        if (sink_write(sink, cluster_offset(fs, node->cluster), ents, entsize) != 0) {
+            perror("Unable to write image file directory");
+            free(ents);
+            return 1;
+        }
+        free(ents);
+
+        if (fstree_write(fs, node, sink, buf, bufsize) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the host files and their directories into the image, in cluster
+ * order. The root directory is written with the metadata.
+ */
+int imgspec_writefiles(const imgspec *img, imgsink *sink) {
+    char *buf = malloc(32768U);
+    const fsnode *node;
+    int rc = 0;
+
+    if (buf == NULL) {
+        fputs("Not enough memory to write the host files.\n", stderr);
+        return 1;
+    }
+    /* traced files take the first clusters */
+    for (node = img->fs->trace; rc == 0 && node != NULL; node = node->tnext)
+        rc = fsnode_copy(img->fs, node, sink, buf, 32768U);
+    if (rc == 0)
+        rc = fstree_write(img->fs, img->fs->root, sink, buf, 32768U);
+    free(buf);
+    return rc;
+}
+
+/*
+ * Fills the FSInfo sector of a FAT32 filesystem.
+ */
+void fat32_fillinfo(const fsspec *fs, unsigned char *info) {
+    const long clusters = (fs->vsize - fs->rsvd - fs->fatsize * fs->fatnum) / fs->spc;
+
+    memcpy(info, "RRaA", 4);
+    memcpy(info + 0x1E4, "rrAa", 4);
+    /* free clusters and the first one to look at */
+    memcpydw(info + 0x1E8, clusters + 2L - fs->next);
+    memcpydw(info + 0x1EC, fs->next);
+    info[0x1FE] = 0x55;
+    info[0x1FF] = 0xAA;
+}
+
+/*
+ * MBR partition type of a volume, which must match its FAT type for DOS.
+ * Volumes reaching past cylinder 1023 are LBA.
+ */
+int fs_parttype(const fsspec *fs, int lba) {
+    if (fs->type == FS_FAT32) {
+        /* FAT32 (0x0B), FAT32 LBA (0x0C) past the reach of CHS */
+        return lba ? 0x0C : 0x0B;
+    }
+    if (fs->type == FS_FAT12)
+        return 0x01;
+    /* FAT16 (0x04), FAT16B (0x06) the only option when more than 65536 sectors */
+    return fs->vsize < 65536L ? 0x04 : 0x06;
+}
+
+/*
+ * Fills the MBR of a hard disk image.
+ */
+void imgspec_fillmbr(const imgspec *img, unsigned char *buf) {
+    const fsspec *fs = img->fs;
+    /* CHS addresses stop at cylinder 1023, LBA disks go on */
+    const int lastcyl = img->cylinders > HD_CYL_MAX ? HD_CYL_MAX - 1 : img->cylinders - 1;
+
+    /* load default MBR into buffer */
+    memcpy(buf, mbr, sizeof(mbr));
+
+    /* active partition marker */
+    buf[0x1BE] = 0x80;
+    /* start head: head 0 has partition table, head 1 first partition */
+    buf[0x1BF] = (unsigned char) (fs->voff / img->sectors % img->heads);
+    /* start sector with bits 8-9 of start cylinder in bits 6-7 */
+    buf[0x1C0] = (unsigned char) (fs->voff % img->sectors + 1L) |
+                 (unsigned char) ((fs->voff / img->sectors / img->heads & 0x300L) >> 2);
+    /* start cylinder bits 0-7 */
+    buf[0x1C1] = (unsigned char) (fs->voff / img->sectors / img->heads & 0xFFL);
+
+    /* partition type */
+    buf[0x1C2] = (unsigned char) fs_parttype(fs, img->cylinders > HD_CYL_MAX);
+
+    /* end head (0-based) */
+    buf[0x1C3] = img->heads - 1;
+    /* end sector with bits 8-9 of end cylinder (0-based) in bits 6-7 */
+    buf[0x1C4] = img->sectors | ((lastcyl & 0x300) >> 2);
+    /* end cylinder (0-based) bits 0-7 */
+    buf[0x1C5] = lastcyl & 0xFF;
+
+    /* first absolute sector of partition 1 */
+    memcpydw(buf + 0x1C6, fs->voff);
+    /* sector size of partition 1 */
+    memcpydw(buf + 0x1CA, fs->vsize);
+}
+
+/*
+ * Fills the boot sector of the filesystem, which must be zeroed.
+ */
+void imgspec_fillboot(const imgspec *img, unsigned char *buf) {
+    const fsspec *fs = img->fs;
+    unsigned char *ebpb;
+
+    /* ML to jump to boot code, past the larger FAT32 BPB */
+    buf[0x000] = 0xEB;
+    buf[0x001] = fs->type == FS_FAT32 ? 0x58 : 0x3C;
+    buf[0x002] = 0x90;
+
+    /* OEM name */
+    memcpy(buf + 0x003, "MSDOS5.0", 8);
+
+    /* always 512 bytes per sector */
+    memcpyw(buf + 0x00B, 512);
+
+    /* sectors per cluster */
+    buf[0x00D] = fs->spc;
+
+    /* reserved sectors (1 for FAT12/16 unless padded by -align) */
+    memcpyw(buf + 0x00E, fs->rsvd);
+
+    /* number of FATs */
+    buf[0x010] = fs->fatnum;
+
+    /* root entries, 0 for FAT32 */
+    memcpyw(buf + 0x011, fs->rtent);
+
+    /* total sectors in the filesystem, always 32 bits for FAT32 */
+    if (fs->vsize > 0xFFFFL || fs->type == FS_FAT32) {
+        memcpydw(buf + 0x020, fs->vsize);
+    } else {
+        memcpyw(buf + 0x013, (int) fs->vsize);
+    }
+
+    /* media descriptor */
+    buf[0x015] = fs->mdesc;
+
+    /* size of each FAT in sectors, always less than 2^16 for FAT12/16 */
+    if (fs->type != FS_FAT32)
+        memcpyw(buf + 0x016, (int) fs->fatsize);
+
+    /* geometry */
+    memcpyw(buf + 0x018, img->sectors);
+    memcpyw(buf + 0x01A, img->heads);
+
+    /* sectors before the start partition */
+    memcpydw(buf + 0x01C, fs->voff);
+
+    /* the FAT32 fields move the extended BPB 28 bytes further */
+    if (fs->type == FS_FAT32) {
+        /* size of each FAT, flags, version and first cluster of the root */
+        memcpydw(buf + 0x024, fs->fatsize);
+        memcpydw(buf + 0x02C, FS_ROOT_CLUSTER);
+        /* FSInfo and backup boot sectors */
+        memcpyw(buf + 0x030, FS_FSINFO_SECT);
+        memcpyw(buf + 0x032, FS_BACKUP_SECT);
+        ebpb = buf + 0x01C;
+    } else {
+        ebpb = buf;
+    }
+
+    /* BIOS INT 13h drive number (0x00 first floppy, 0x80 first hard disk) */
+    if (fs->mdesc == HD_MDESC)
+        ebpb[0x024] = 0x80;
+
+    /* extended boot signature */
+    ebpb[0x026] = 0x29;
+
+    /* volume serial number, from the seed of reproducible images */
+    memcpydw(ebpb + 0x027, img->seeded ? (long) img->seed : (long) time(NULL));
+
+    /* volume label */
+    if (fs->vlabel != NULL) {
+        memcpy(ebpb + 0x02B, fs->vlabel->text, fs->vlabel->len);
+        memset(ebpb + 0x02B + fs->vlabel->len, ' ', 11 - fs->vlabel->len);
+    } else {
+        memcpy(ebpb + 0x02B, "NO NAME    ", 11);
+    }
+
+    /* ASCII filesystem type */
+    if (fs->type == FS_FAT12) {
+        memcpy(ebpb + 0x036, "FAT12   ", 8);
+    } else if (fs->type == FS_FAT16) {
+        memcpy(ebpb + 0x036, "FAT16   ", 8);
+    } else {
+        memcpy(ebpb + 0x036, "FAT32   ", 8);
+    }
+
+    /* boot sector signature */
+    buf[0x1FE] = 0x55;
+    buf[0x1FF] = 0xAA;
+}
+
+/*
+ * Writes the MBR and the filesystem structures: the boot sector, the head of
+ * each FAT and the whole root directory, so that no stale data survives in a
+ * reused image file. They are built in memory and written at once, in
+ * increasing offset order as required by stream sinks.
+ */
+int imgspec_writefs(const imgspec *img, imgsink *sink) {
+    const fsspec *fs = img->fs;
+    /* the FAT32 root directory is the first chain */
+    const long rootcl = fs->root != NULL ? fs->root->cluster : FS_ROOT_CLUSTER;
+    const size_t rtsize = fs->type == FS_FAT32
+                          ? (size_t) ((fs->root != NULL ? fs->root->clusters : 1L) * fs->spc * 512L)
+                          : (size_t) fs->rtent * FS_DIRENT_SIZE;
+    imgextent ext[FS_EXTENTS_MAX];
+    unsigned char *meta, *boot, *info, *head, *root;
+    int i, n = 0, rc;
+
+    /* MBR, boot sector, FSInfo sector, FAT head and root directory */
+    meta = calloc(2048U + rtsize, 1);
+    if (meta == NULL) {
+        fputs("Not enough memory to write the filesystem.\n", stderr);
+        return 1;
+    }
+    boot = meta + 512;
+    info = meta + 1024;
+    head = meta + 1536;
+    root = meta + 2048;
+
+    /* if it is an hard disk, write MBR */
+    if (fs->mdesc == HD_MDESC) {
+        imgspec_fillmbr(img, meta);
+        ext[n].off = 0L;
+        ext[n].buf = meta;
+        ext[n++].len = 512;
+    }
+
+    imgspec_fillboot(img, boot);
+    ext[n].off = fs->voff * 512L;
+    ext[n].buf = boot;
+    ext[n++].len = 512;
+
+    /* FSInfo sector, then the backups of the boot and FSInfo sectors */
+    if (fs->type == FS_FAT32) {
+        fat32_fillinfo(fs, info);
+        ext[n].off = (fs->voff + FS_FSINFO_SECT) * 512L;
+        ext[n].buf = info;
+        ext[n++].len = 512;
+        ext[n].off = (fs->voff + FS_BACKUP_SECT) * 512L;
+        ext[n].buf = boot;
+        ext[n++].len = 512;
+        ext[n].off = (fs->voff + FS_BACKUP_SECT + FS_FSINFO_SECT) * 512L;
+        ext[n].buf = info;
+        ext[n++].len = 512;
+    }
+
+    /* the in-memory FAT if there are files, its first sector otherwise */
+    if (fs->type == FS_FAT12) {
+        memcpydw(head, 0x00FFFF00L | fs->mdesc);
+    } else if (fs->type == FS_FAT16) {
+        memcpydw(head, 0xFFFFFF00L | fs->mdesc);
+    } else {
+        memcpydw(head, 0x0FFFFF00L | fs->mdesc);
+        memcpydw(head + 4, 0x0FFFFFFFL);
+        memcpydw(head + 8, 0x0FFFFFFFL);
+    }
+    for (i = 0; i < fs->fatnum; i++) {
+        ext[n].off = (fs->voff + fs->rsvd + fs->fatsize * i) * 512L;
+        ext[n].buf = fs->fat != NULL ? fs->fat : head;
+        ext[n++].len = fs->fat != NULL ? (size_t) fs->fatused * 512U : 512U;
+    }
+
+    /* the special filesystem entry for the label comes first */
+    if (fs->vlabel != NULL) {
+        memcpy(root, fs->vlabel->text, fs->vlabel->len);
+        memset(root + fs->vlabel->len, ' ', 11 - fs->vlabel->len);
+        root[11] = FS_ATTR_VOLUME;
+    }
+    if (fs->root != NULL)
+        fstree_dirents(fs->root, NULL, root + (fs->vlabel != NULL ? FS_DIRENT_SIZE : 0));
+    ext[n].off = fs->type == FS_FAT32
+                 ? cluster_offset(fs, rootcl)
+                 : (fs->voff + fs->rsvd + fs->fatsize * fs->fatnum) * 512L;
+    ext[n].buf = root;
+    ext[n++].len = rtsize;
+
+    rc = sink_writev(sink, ext, n);
+    free(meta);
+    if (rc != 0) {
+        perror("Unable to write image file filesystem structures.\n");
+        return 1;
+    }
+
+    imgstats_phase(sink->stats, STATS_METADATA);
+    if (fs->root != NULL)
+        return imgspec_writefiles(img, sink);
+    return 0;
+}
+
+/*
+ * Writes a buffer to the sink, accounting it in the statistics.
+ */
+int sink_write(imgsink *sink, long off, const void *buf, size_t len) {
+    imgstats *stats = sink->stats;
+
+    if (stats != NULL) {
+        stats->writes++;
+        if (off != stats->next)
+            stats->seeks++;
+        stats->bytes += (long) len;
+        stats->next = off + (long) len;
+    }
+    return sink->write(sink, off, buf, len);
+}
+
+/*
+ * Writes extents in increasing offset order, with a single vectored write if
+ * the sink supports it.
+ */
+int sink_writev(imgsink *sink, const imgextent *ext, int count) {
+    imgstats *stats = sink->stats;
+    int i;
+
+    if (sink->writev == NULL) {
+        for (i = 0; i < count; i++) {
+            if (sink_write(sink, ext[i].off, ext[i].buf, ext[i].len) != 0)
+                return 1;
+        }
+        return 0;
+    }
+
+    if (stats != NULL && count > 0) {
+        stats->writes++;
+        if (ext[0].off != stats->next)
+            stats->seeks++;
+        for (i = 0; i < count; i++)
+            stats->bytes += (long) ext[i].len;
+        stats->next = ext[count - 1].off + (long) ext[count - 1].len;
+    }
+    return sink->writev(sink, ext, count);
+}
+
+/*
+ * Image being checked.
+ */
+typedef struct {
+    const unsigned char *img; /* Image contents */
+    long size;                /* Image size in bytes */
+    int type;                 /* File system type */
+    int spc;                  /* Sectors per cluster */
+    long voff;                /* Volume offset in bytes */
+    long fatoff;              /* Offset of the first FAT in bytes */
+    long fatlen;              /* Size of each FAT in bytes */
+    long rootoff;             /* Offset of the root directory in bytes */
+    int rtent;                /* Root directory entries */
+    long dataoff;             /* Offset of cluster 2 in bytes */
+    long clusters;            /* Number of clusters plus 2 */
+    long bad;                 /* Bad cluster marker */
+    long eoc;                 /* Smallest end of chain marker */
+    long rootcl;              /* First cluster of the FAT32 root directory */
+    long fsinfo;              /* Offset of the FAT32 FSInfo sector, 0 if none */
+    unsigned char *linked;    /* Clusters another cluster links to */
+    unsigned char *owned;     /* Clusters reached from the directories */
+    long used;                /* Clusters in use */
+    int errors;               /* Number of problems found */
+} chkstate;
+
+/*
+ * Reports a problem of the image, only the first CHECK_MSG_MAX are printed.
+ */
+void chk_error(chkstate *chk, const char *fmt, long a, long b) {
+    if (++chk->errors <= CHECK_MSG_MAX) {
+        fputs("  ", stdout);
+        fprintf(stdout, fmt, a, b);
+        fputc('\n', stdout);
+    } else if (chk->errors == CHECK_MSG_MAX + 1) {
+        fputs("  ...\n", stdout);
+    }
+}
+
+/*
+ * FAT entry of a cluster.
+ */
+long chk_fatget(const chkstate *chk, long cluster) {
+    const unsigned char *fat = chk->img + chk->fatoff;
+    long off;
+
+    if (chk->type == FS_FAT32)
+        return (long) (memgetle(fat + cluster * 4L, 4) & 0x0FFFFFFFUL);
+    if (chk->type == FS_FAT16)
+        return fat[cluster * 2L] | (long) fat[cluster * 2L + 1L] << 8;
+
+    off = cluster + cluster / 2L;
+    return cluster & 1L ? (fat[off] >> 4 | (long) fat[off + 1L] << 4)
+                        : (fat[off] | (long) (fat[off + 1L] & 0x0F) << 8);
+}
+
+/*
+ * Next cluster from the given one whose FAT entry is not free, or
+ * chk->clusters if there is none. Free runs are skipped a word at a time.
+ */
+long chk_nextused(const chkstate *chk, long cluster) {
+    const unsigned char *fat = chk->img + chk->fatoff;
+    const long bits = chk->type == FS_FAT12 ? 12L : chk->type;
+    long off, end, next;
+
+    while (cluster < chk->clusters) {
+        off = cluster * bits / 8L;
+        end = (chk->clusters * bits + 7L) / 8L;
+        off += (long) memnonzero(fat + off, (size_t) (end - off));
+        if (off >= end)
+            return chk->clusters;
+
+        /* first entry overlapping the non-zero byte */
+        next = off * 8L / bits;
+        if (next < cluster)
+            next = cluster;
+        if (chk_fatget(chk, next) != 0)
+            return next;
+        cluster = next + 1L;
+    }
+    return chk->clusters;
+}
+
+/*
+ * Checks the links of every cluster in use.
+ */
+void chk_fatscan(chkstate *chk) {
+    long cluster, next;
+
+    for (cluster = chk_nextused(chk, 2L); cluster < chk->clusters;
+         cluster = chk_nextused(chk, cluster + 1L)) {
+        next = chk_fatget(chk, cluster);
+        if (next >= chk->bad)
+            continue;
+        if (next < 2L || next >= chk->clusters) {
+            chk_error(chk, "Cluster %ld links to invalid cluster %ld.", cluster, next);
+        } else if (chk->linked[next >> 3] & (1 << (next & 7))) {
+            chk_error(chk, "Cluster %ld is cross-linked, cluster %ld links to it again.", next, cluster);
+        } else {
+            chk->linked[next >> 3] |= (unsigned char) (1 << (next & 7));
+        }
+    }
+}
+
+/*
+ * Follows the chain of a directory entry, marking its clusters as owned.
+ * Returns the chain length, or -1 if it is broken.
+ */
+long chk_chain(chkstate *chk, long cluster) {
+    long len = 0L;
+
+    if (cluster < 2L || cluster >= chk->clusters) {
+        chk_error(chk, "Directory entry starts at invalid cluster %ld.", cluster, 0L);
+        return -1L;
+    }
+    if (chk->linked[cluster >> 3] & (1 << (cluster & 7))) {
+        chk_error(chk, "Directory entry starts at cluster %ld, in the middle of a chain.", cluster, 0L);
+        return -1L;
+    }
+
+    while (cluster >= 2L && cluster < chk->clusters) {
+        if (chk->owned[cluster >> 3] & (1 << (cluster & 7))) {
+            chk_error(chk, "Cluster %ld belongs to more than one file or directory.", cluster, 0L);
+            return -1L;
+        }
+        chk->owned[cluster >> 3] |= (unsigned char) (1 << (cluster & 7));
+        len++;
+        cluster = chk_fatget(chk, cluster);
+    }
+
+    if (cluster < chk->eoc) {
+        chk_error(chk, "Chain of %ld clusters ends with entry %ld instead of an end marker.", len, cluster);
+        return -1L;
+    }
+    return len;
+}
+
+/*
+ * Checks the entries of a directory and, recursively, its subdirectories.
+ * The directory is either the root directory, of len bytes at off, or the
+ * chain starting at cluster.
+ */
+void chk_dir(chkstate *chk, long off, long len, long cluster, int depth) {
+    const long csize = chk->spc * 512L;
+    const unsigned char *ent;
+    long first, size, chain, pos;
+    int attr;
+
+    for (pos = 0L; ; pos += FS_DIRENT_SIZE) {
+        /* move to the next cluster of subdirectories */
+        if (pos == len) {
+            if (cluster < 2L || (cluster = chk_fatget(chk, cluster)) < 2L || cluster >= chk->clusters)
+                return;
+            off = chk->dataoff + (cluster - 2L) * csize;
+            pos = 0L;
+        }
+        if (off + pos + FS_DIRENT_SIZE > chk->size)
+            return;
+
+        ent = chk->img + off + pos;
+        attr = ent[11];
+        if (ent[0] == 0x00)
+            return;
+        /* deleted entries, long names, labels, and the . and .. entries */
+        if (ent[0] == 0xE5 || attr == 0x0F || (attr & FS_ATTR_VOLUME) ||
+            (ent[0] == '.' && (ent[1] == ' ' || ent[1] == '.')))
+            continue;
+
+        if (ent[0] < 0x20 && ent[0] != 0x05) {
+            chk_error(chk, "Directory entry at offset %ld has an invalid name.", off + pos, 0L);
+            continue;
+        }
+
+        first = ent[26] | (long) ent[27] << 8;
+        if (chk->type == FS_FAT32)
+            first |= (ent[20] | (long) ent[21] << 8) << 16;
+        size = ent[28] | (long) ent[29] << 8 | (long) ent[30] << 16 | (long) ent[31] << 24;
+        if (attr & FS_ATTR_DIR) {
+            if (depth >= CHECK_DEPTH_MAX)
+                chk_error(chk, "Directory at offset %ld is nested too deeply.", off + pos, 0L);
+            else if (chk_chain(chk, first) > 0L)
+                chk_dir(chk, chk->dataoff + (first - 2L) * csize, csize, first, depth + 1);
+        } else if (first == 0L) {
+            if (size != 0L)
+                chk_error(chk, "File at offset %ld has %ld bytes but no clusters.", off + pos, size);
+        } else {
+            chain = chk_chain(chk, first);
+            if (chain >= 0L && chain != size / csize + (size % csize != 0L))
+                chk_error(chk, "File at offset %ld has %ld clusters, which does not match its size.",
+                          off + pos, chain);
+        }
+    }
+}
+
+/*
+ * Checks the partition, boot sector and FAT layout of an image. Returns
+ * non-zero if the rest of the image cannot be checked.
+ */
+int chk_layout(chkstate *chk) {
+    const unsigned char *img = chk->img, *p, *bpb, *ebpb;
+    long start = 0L, count, total, fatsize, rtsect, sectors, backup;
+    int rsvd, fatnum, spt, heads, cyl;
+
+    if (chk->size < 512L) {
+        chk_error(chk, "Image file has %ld bytes, less than a sector.", chk->size, 0L);
+        return 1;
+    }
+
+    /* hard disk images start with an MBR, floppies with the boot sector */
+    if (img[0] != 0xEB && img[0] != 0xE9) {
+        p = img + 0x1BE;
+        if (img[0x1FE] != 0x55 || img[0x1FF] != 0xAA)
+            chk_error(chk, "MBR has no boot signature.", 0L, 0L);
+        if (p[0] != 0x00 && p[0] != 0x80)
+            chk_error(chk, "Partition has invalid boot flag %ld.", (long) p[0], 0L);
+        if (p[4] != 0x01 && p[4] != 0x04 && p[4] != 0x06 && p[4] != 0x0E && p[4] != 0x0B && p[4] != 0x0C) {
+            chk_error(chk, "Partition has type %ld, not a FAT type.", (long) p[4], 0L);
+            return 1;
+        }
+        start = (long) memgetle(p + 8, 4);
+        count = (long) memgetle(p + 12, 4);
+        if (start < 1L || (start + count) * 512L > chk->size) {
+            chk_error(chk, "Partition at sector %ld with %ld sectors is outside the image file.", start, count);
+            return 1;
+        }
+        chk->voff = start * 512L;
+    } else {
+        count = chk->size / 512L;
+    }
+
+    bpb = img + chk->voff;
+    if (bpb[0x1FE] != 0x55 || bpb[0x1FF] != 0xAA)
+        chk_error(chk, "Boot sector has no boot signature.", 0L, 0L);
+    if (bpb[0] != 0xE9 && (bpb[0] != 0xEB || bpb[2] != 0x90))
+        chk_error(chk, "Boot sector does not start with a jump.", 0L, 0L);
+
+    chk->spc = bpb[0x0D];
+    rsvd = (int) memgetle(bpb + 0x0E, 2);
+    fatnum = bpb[0x10];
+    chk->rtent = (int) memgetle(bpb + 0x11, 2);
+    total = (long) memgetle(bpb + 0x13, 2);
+    if (total == 0L)
+        total = (long) memgetle(bpb + 0x20, 4);
+    fatsize = (long) memgetle(bpb + 0x16, 2);
+    spt = (int) memgetle(bpb + 0x18, 2);
+    heads = (int) memgetle(bpb + 0x1A, 2);
+
+    /* FAT32 has no 16 bits FAT size and moves the extended BPB */
+    ebpb = bpb;
+    if (fatsize == 0L && chk->rtent == 0) {
+        fatsize = (long) memgetle(bpb + 0x24, 4);
+        chk->rootcl = (long) memgetle(bpb + 0x2C, 4);
+        ebpb = bpb + 0x1C;
+    }
+
+    if (memgetle(bpb + 0x0B, 2) != 512UL || chk->spc == 0 || (chk->spc & (chk->spc - 1)) != 0 ||
+        rsvd < 1 || fatnum < 1 || fatsize == 0L || (chk->rtent == 0 && chk->rootcl == 0L)) {
+        chk_error(chk, "Boot sector has an invalid BIOS parameter block.", 0L, 0L);
+        return 1;
+    }
+    if (bpb[0x15] != 0xF0 && bpb[0x15] < 0xF8)
+        chk_error(chk, "Boot sector has invalid media descriptor %ld.", (long) bpb[0x15], 0L);
+    if (total > count)
+        chk_error(chk, "Volume has %ld sectors, more than the %ld available.", total, count);
+    if ((long) memgetle(bpb + 0x1C, 4) != start)
+        chk_error(chk, "Boot sector has %ld hidden sectors, the partition starts at %ld.",
+                  (long) memgetle(bpb + 0x1C, 4), start);
+
+    /* the partition start must agree with the geometry, below 1024 cylinders */
+    if (start > 0L && spt > 0 && heads > 0) {
+        p = img + 0x1BE;
+        cyl = p[3] | (p[2] & 0xC0) << 2;
+        sectors = ((long) cyl * heads + p[1]) * spt + (p[2] & 0x3F) - 1L;
+        if (cyl < 1023 && sectors != start)
+            chk_error(chk, "Partition start CHS is sector %ld, its LBA is %ld.", sectors, start);
+    }
+
+    rtsect = (chk->rtent * (long) FS_DIRENT_SIZE + 511L) / 512L;
+    chk->fatoff = chk->voff + rsvd * 512L;
+    chk->fatlen = fatsize * 512L;
+    chk->rootoff = chk->fatoff + fatnum * chk->fatlen;
+    chk->dataoff = chk->rootoff + rtsect * 512L;
+    if (total <= rsvd + fatnum * fatsize + rtsect || chk->dataoff > chk->size) {
+        chk_error(chk, "Volume has no room for its data area.", 0L, 0L);
+        return 1;
+    }
+
+    /* the cluster count alone decides the FAT type */
+    chk->clusters = (total - rsvd - fatnum * fatsize - rtsect) / chk->spc + 2L;
+    if (chk->clusters - 2L < 4085L) {
+        chk->type = FS_FAT12;
+        chk->bad = 0x0FF7L;
+    } else if (chk->clusters - 2L < 65525L) {
+        chk->type = FS_FAT16;
+        chk->bad = 0xFFF7L;
+    } else {
+        chk->type = FS_FAT32;
+        chk->bad = 0x0FFFFFF7L;
+    }
+    chk->eoc = chk->bad + 1L;
+    if ((chk->type == FS_FAT32) != (chk->rootcl != 0L)) {
+        chk_error(chk, "Volume has %ld clusters, which does not match its BIOS parameter block.",
+                  chk->clusters - 2L, 0L);
+        return 1;
+    }
+    if (ebpb[0x26] == 0x29 &&
+        memcmp(ebpb + 0x36, chk->type == FS_FAT12 ? "FAT12   " : chk->type == FS_FAT16 ? "FAT16   " : "FAT32   ", 8) != 0)
+        chk_error(chk, "Boot sector names a FAT type other than FAT%ld.", (long) chk->type, 0L);
+
+    /* DOS reads the volume with the FAT type of its partition */
+    p = img + 0x1BE;
+    if (start > 0L &&
+        (chk->type == FS_FAT12 ? p[4] != 0x01
+         : chk->type == FS_FAT16 ? p[4] != 0x0E && p[4] != (total < 65536L ? 0x04 : 0x06)
+         : p[4] != 0x0B && p[4] != 0x0C))
+        chk_error(chk, "Partition has type %ld, which does not match a FAT%ld volume.", (long) p[4], (long) chk->type);
+    if ((chk->clusters * (chk->type == FS_FAT12 ? 12L : chk->type) + 7L) / 8L > chk->fatlen) {
+        chk_error(chk, "FAT of %ld sectors is too small for %ld clusters.", fatsize, chk->clusters - 2L);
+        return 1;
+    }
+
+    if (chk->type == FS_FAT32) {
+        if (chk->rootcl < 2L || chk->rootcl >= chk->clusters) {
+            chk_error(chk, "Root directory starts at invalid cluster %ld.", chk->rootcl, 0L);
+            return 1;
+        }
+        chk->fsinfo = (long) memgetle(bpb + 0x30, 2);
+        if (chk->fsinfo > 0L && chk->fsinfo < rsvd) {
+            chk->fsinfo = chk->voff + chk->fsinfo * 512L;
+            if (memcmp(img + chk->fsinfo, "RRaA", 4) != 0 || memcmp(img + chk->fsinfo + 0x1E4, "rrAa", 4) != 0) {
+                chk_error(chk, "FSInfo sector has no signature.", 0L, 0L);
+                chk->fsinfo = 0L;
+            }
+        } else {
+            chk->fsinfo = 0L;
+        }
+        backup = (long) memgetle(bpb + 0x32, 2);
+        if (backup > 0L && backup < rsvd && memcmp(bpb, img + chk->voff + backup * 512L, 512) != 0)
+            chk_error(chk, "Backup boot sector %ld differs from the boot sector.", backup, 0L);
+    }
+
+    /* every copy must be identical to the first one */
+    for (; fatnum > 1; fatnum--) {
+        if (memcmp(img + chk->fatoff, img + chk->fatoff + (fatnum - 1) * chk->fatlen, (size_t) chk->fatlen) != 0)
+            chk_error(chk, "FAT copy %ld differs from the first FAT.", (long) fatnum, 0L);
+    }
+    if (img[chk->fatoff] != bpb[0x15])
+        chk_error(chk, "FAT starts with %ld instead of the media descriptor.", (long) img[chk->fatoff], 0L);
+
+    return 0;
+}
+
+/*
+ * Maps an image file read-only, or reads it where the host cannot map it.
+ */
+int chk_open(chkstate *chk, const char *filename) {
+    FILE *fp;
+    unsigned char *data = NULL;
+
+    memset(chk, 0, sizeof(chkstate));
+    if ((fp = fopen(filename, "rb")) == NULL) {
+        fprintf(stderr, "The file \"%s\" cannot be opened for reading.\n", filename);
+        return EC_FILE_ERROR;
+    }
+    if (fseek(fp, 0L, SEEK_END) != 0 || (chk->size = ftell(fp)) < 0L) {
+        fprintf(stderr, "Unable to read \"%s\".\n", filename);
+        fclose(fp);
+        return EC_FILE_ERROR;
+    }
+
+#ifdef _POSIX_SOURCE
+    if (chk->size > 0L) {
+        data = mmap(NULL, (size_t) chk->size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+    }
+#else
+    if ((data = malloc((size_t) chk->size + 1)) != NULL &&
+        (fseek(fp, 0L, SEEK_SET) != 0 || fread(data, 1, (size_t) chk->size, fp) != (size_t) chk->size)) {
+        free(data);
+        data = NULL;
+    }
+#endif
+    fclose(fp);
+    if (data == NULL && chk->size > 0L) {
+        fprintf(stderr, "Unable to read \"%s\".\n", filename);
+        return EC_FILE_ERROR;
+    }
+    chk->img = data;
+    return 0;
+}
+
+/*
+ * Releases an image opened by chk_open().
+ */
+void chk_close(chkstate *chk) {
+#ifdef _POSIX_SOURCE
+    if (chk->img != NULL)
+        munmap((void *) chk->img, (size_t) chk->size);
+#else
+    free((void *) chk->img);
+#endif
+    chk->img = NULL;
+}
+
+/*
+ * Checks the layout, the cluster chains and the directories of an opened
+ * image, counting the problems in chk->errors. Clusters is left at 0 if the
+ * layout is too broken to check the rest.
+ */
+int chk_scan(chkstate *chk) {
+    unsigned long nfree;
+    long cluster, lost = 0L, bad = 0L;
+    int rc = 0;
+
+    if (chk_layout(chk) != 0) {
+        chk->clusters = 0L;
+        return 0;
+    }
+
+    chk->linked = calloc((size_t) (chk->clusters / 8L + 1L), 1);
+    chk->owned = calloc((size_t) (chk->clusters / 8L + 1L), 1);
+    if (chk->linked == NULL || chk->owned == NULL) {
+        fputs("Not enough memory to check the image.\n", stderr);
+        rc = EC_FILE_ERROR;
+    } else {
+        chk_fatscan(chk);
+        if (chk->type != FS_FAT32)
+            chk_dir(chk, chk->rootoff, chk->rtent * (long) FS_DIRENT_SIZE, 0L, 0);
+        else if (chk_chain(chk, chk->rootcl) > 0L)
+            chk_dir(chk, chk->dataoff + (chk->rootcl - 2L) * chk->spc * 512L, chk->spc * 512L, chk->rootcl, 0);
+
+        /* clusters in use that no directory reaches */
+        for (cluster = chk_nextused(chk, 2L); cluster < chk->clusters;
+             cluster = chk_nextused(chk, cluster + 1L)) {
+            if (chk_fatget(chk, cluster) == chk->bad) {
+                bad++;
+                continue;
+            }
+            chk->used++;
+            if (!(chk->owned[cluster >> 3] & (1 << (cluster & 7))))
+                lost++;
+        }
+        if (lost > 0L)
+            chk_error(chk, "%ld of the %ld clusters in use are lost.", lost, chk->used);
+
+        /* the free count of FSInfo may be unknown, but not wrong */
+        nfree = chk->fsinfo > 0L ? memgetle(chk->img + chk->fsinfo + 0x1E8, 4) : 0xFFFFFFFFUL;
+        if (nfree != 0xFFFFFFFFUL && nfree != (unsigned long) (chk->clusters - 2L - chk->used - bad))
+            chk_error(chk, "FSInfo counts %ld free clusters, there are %ld.",
+                      (long) nfree, chk->clusters - 2L - chk->used - bad);
+    }
+
+    free(chk->linked);
+    free(chk->owned);
+    chk->linked = chk->owned = NULL;
+    return rc;
+}
+
+/*
+ * Checks that an image file is a valid FAT12, FAT16 or FAT32 floppy or hard
+ * disk image: its partition, boot sector, FAT copies, cluster chains and
+ * directories, and for FAT32 the FSInfo sector and the backup boot sector.
+ * The image is mapped read-only where the host allows it. Returns
+ * EC_INV_IMAGE if there are problems, which are printed.
+ */
+int image_check(const char *filename) {
+    chkstate chk;
+    int rc;
+
+    if ((rc = chk_open(&chk, filename)) != 0)
+        return rc;
+
+    fprintf(stdout, "Checking image file \"%s\".\n", filename);
+    rc = chk_scan(&chk);
+    if (rc == 0 && chk.clusters > 0L) {
+        fprintf(stdout, "FAT%d volume with %ld clusters, %ld in use.\n",
+                chk.type, chk.clusters - 2L, chk.used);
+    }
+    chk_close(&chk);
+
+    if (rc != 0)
+        return rc;
+    if (chk.errors > 0) {
+        fprintf(stdout, "Found %d problems.\n", chk.errors);
+        return EC_INV_IMAGE;
+    }
+    fputs("No problems found.\n", stdout);
+    return 0;
+}
+
+/*
+ * Image being grown.
+ */
+typedef struct {
+    chkstate chk;             /* Layout of the image before growing */
+    FILE *fp;                 /* Image file */
+    long shift;               /* Clusters the data region moves by */
+    long *reloc;              /* New numbers of the clusters moved away */
+    long dataoff;             /* New offset of cluster 2 in bytes */
+    imgspec img;              /* New geometry */
+    fsspec fs;                /* New FAT type, copies and size */
+    long clusters;            /* New number of clusters plus 2 */
+    unsigned char *fat;       /* New FAT */
+    unsigned char *root;      /* Root directory, renumbered */
+    long moved;               /* Clusters moved */
+} growstate;
+
+/*
+ * New number of a cluster. Clusters under the grown FATs are moved to free
+ * clusters, the others stay in place and are renumbered.
+ */
+long grow_map(const growstate *gs, long cluster) {
+    if (cluster < 2L || cluster >= gs->chk.clusters)
+        return cluster;
+    if (cluster < gs->shift + 2L)
+        return gs->reloc[cluster - 2L];
+    return cluster - gs->shift;
+}
+
+int grow_dir(growstate *gs, long cluster, int depth);
+
+/*
+ * Renumbers the clusters of the directory entries in buf, descending into
+ * subdirectories. Returns 1 once the end of the directory is found.
+ */
+int grow_dirents(growstate *gs, unsigned char *buf, long len, int depth) {
+    unsigned char *ent;
+    long first;
+    int rc;
+
+    for (ent = buf; ent < buf + len; ent += FS_DIRENT_SIZE) {
+        if (ent[0] == 0x00)
+            return 1;
+        if (ent[0] == 0xE5 || ent[11] == 0x0F || (ent[11] & FS_ATTR_VOLUME))
+            continue;
+
+        first = (long) memgetle(ent + 26, 2);
+        if (first == 0L)
+            continue;
+        memcpyw(ent + 26, (int) grow_map(gs, first));
+
+        if ((ent[11] & FS_ATTR_DIR) && ent[0] != '.' && depth < CHECK_DEPTH_MAX &&
+            (rc = grow_dir(gs, first, depth + 1)) != 0)
+            return rc;
+    }
+    return 0;
+}
+
+/*
+ * Renumbers the entries of a subdirectory in place, following its chain in
+ * the old FAT.
+ */
+int grow_dir(growstate *gs, long cluster, int depth) {
+    const size_t csize = (size_t) gs->chk.spc * 512U;
+    unsigned char *buf;
+    long off;
+    int rc = 0;
+
+    if ((buf = malloc(csize)) == NULL)
+        return -1;
+
+    for (; rc == 0 && cluster >= 2L && cluster < gs->chk.clusters; cluster = chk_fatget(&gs->chk, cluster)) {
+        off = gs->dataoff + (grow_map(gs, cluster) - 2L) * (long) csize;
+        if (fseek(gs->fp, off, SEEK_SET) != 0 || fread(buf, 1, csize, gs->fp) != csize) {
+            rc = -1;
+            break;
+        }
+        rc = grow_dirents(gs, buf, (long) csize, depth);
+        if (fseek(gs->fp, off, SEEK_SET) != 0 || fwrite(buf, 1, csize, gs->fp) != csize)
+            rc = -1;
+    }
+
+    free(buf);
+    return rc < 0 ? rc : 0;
+}
+
+/*
+ * Lays out the grown volume: the new FAT size, the clusters to move and the
+ * new FAT in memory. Nothing is written yet.
+ */
+int grow_plan(growstate *gs, const char *filename) {
+    chkstate *chk = &gs->chk;
+    fsspec *fs = &gs->fs;
+    const long start = chk->voff / 512L;
+    const long bad = chk->bad;
+    const long fatsize = chk->fatlen / 512L;
+    long cluster, next = 2L;
+
+    /* each FAT grows by whole clusters, so that the others stay in place */
+    fs->fatsize = fs->type == FS_FAT12
+                  ? ((fs->vsize / chk->spc + 1L) * 3L / 2L + 511L) / 512L
+                  : (fs->vsize / chk->spc * 2L + 511L) / 512L;
+    if (fs->fatsize < fatsize)
+        fs->fatsize = fatsize;
+    while ((fs->fatsize - fatsize) * fs->fatnum % chk->spc != 0L)
+        fs->fatsize++;
+    gs->shift = (fs->fatsize - fatsize) * fs->fatnum / chk->spc;
+    gs->dataoff = chk->dataoff + gs->shift * chk->spc * 512L;
+    gs->clusters = (fs->vsize - (gs->dataoff - chk->voff) / 512L) / chk->spc + 2L;
+    if (gs->clusters > (fs->type == FS_FAT12 ? 0x0FF6L : 0xFFF6L)) {
+        fprintf(stderr, "Error: FAT%d with %d sectors per cluster cannot address %ld MiB.\n",
+                fs->type, chk->spc, (fs->vsize + start) / 2048L);
+        return EC_INV_CLUSTERS;
+    }
+
+    gs->reloc = calloc((size_t) gs->shift + 1U, sizeof(long));
+    gs->fat = calloc((size_t) fs->fatsize, 512);
+    gs->root = malloc((size_t) (chk->dataoff - chk->rootoff));
+    if (gs->reloc == NULL || gs->fat == NULL || gs->root == NULL) {
+        fputs("Not enough memory to grow the image.\n", stderr);
+        return EC_FILE_ERROR;
+    }
+
+    /* free clusters for the clusters under the grown FATs, bad ones are dropped */
+    for (cluster = 2L; cluster < gs->shift + 2L && cluster < chk->clusters; cluster++) {
+        if (chk_fatget(chk, cluster) == 0L || chk_fatget(chk, cluster) == bad)
+            continue;
+        while (next + gs->shift < chk->clusters && chk_fatget(chk, next + gs->shift) != 0L)
+            next++;
+        if (next >= gs->clusters) {
+            fprintf(stderr, "Error: \"%s\" has no free clusters for the grown FATs.\n", filename);
+            return EC_INV_CLUSTERS;
+        }
+        gs->reloc[cluster - 2L] = next++;
+    }
+
+    /* the new FAT is the old one renumbered */
+    fat_set(fs, gs->fat, 0L, chk_fatget(chk, 0L));
+    fat_set(fs, gs->fat, 1L, chk_fatget(chk, 1L));
+    for (cluster = chk_nextused(chk, 2L); cluster < chk->clusters; cluster = chk_nextused(chk, cluster + 1L)) {
+        if (grow_map(gs, cluster) >= 2L)
+            fat_set(fs, gs->fat, grow_map(gs, cluster), grow_map(gs, chk_fatget(chk, cluster)));
+    }
+    memcpy(gs->root, chk->img + chk->rootoff, (size_t) (chk->dataoff - chk->rootoff));
+
+    return 0;
+}
+
+/*
+ * Writes the grown volume: moves the clusters under the grown FATs, then
+ * renumbers the directories and rewrites the MBR, the boot sector, the FATs
+ * and the root directory.
+ */
+int grow_write(growstate *gs) {
+    const chkstate *chk = &gs->chk;
+    const imgspec *img = &gs->img;
+    const fsspec *fs = &gs->fs;
+    const long start = chk->voff / 512L;
+    const size_t csize = (size_t) chk->spc * 512U;
+    unsigned char sect[2][512];
+    unsigned char *buf;
+    long cluster;
+    int i;
+
+    if (image_alloc(gs->fp, (fs->vsize + start) * 512L, ALLOC_SPARSE) != 0) {
+        perror("Unable to extend the image file.");
+        return EC_FILE_ERROR;
+    }
+
+    /* move the clusters out of the way before anything overwrites them */
+    if ((buf = malloc(csize)) == NULL) {
+        fputs("Not enough memory to grow the image.\n", stderr);
+        return EC_FILE_ERROR;
+    }
+    for (cluster = 2L; cluster < gs->shift + 2L && cluster < chk->clusters; cluster++) {
+        if (gs->reloc[cluster - 2L] == 0L)
+            continue;
+        if (fseek(gs->fp, chk->dataoff + (cluster - 2L) * (long) csize, SEEK_SET) != 0 ||
+            fread(buf, 1, csize, gs->fp) != csize ||
+            fseek(gs->fp, gs->dataoff + (gs->reloc[cluster - 2L] - 2L) * (long) csize, SEEK_SET) != 0 ||
+            fwrite(buf, 1, csize, gs->fp) != csize) {
+            perror("Unable to move image file clusters.");
+            free(buf);
+            return EC_FILE_ERROR;
+        }
+        gs->moved++;
+    }
+    free(buf);
+
+    if (gs->shift > 0L && grow_dirents(gs, gs->root, chk->rtent * (long) FS_DIRENT_SIZE, 0) < 0) {
+        perror("Unable to update image file directories.");
+        return EC_FILE_ERROR;
+    }
+
+    /* partition entry, with the start CHS in the new geometry */
+    memcpy(sect[0], chk->img, 512);
+    sect[0][0x1BF] = (unsigned char) (start / img->sectors % img->heads);
+    sect[0][0x1C0] = (unsigned char) (start % img->sectors + 1L) |
+                     (unsigned char) ((start / img->sectors / img->heads & 0x300L) >> 2);
+    sect[0][0x1C1] = (unsigned char) (start / img->sectors / img->heads & 0xFFL);
+    sect[0][0x1C2] = (unsigned char) fs_parttype(fs, 0);
+    sect[0][0x1C3] = (unsigned char) (img->heads - 1);
+    sect[0][0x1C4] = (unsigned char) (img->sectors | (((img->cylinders - 1) & 0x300) >> 2));
+    sect[0][0x1C5] = (unsigned char) ((img->cylinders - 1) & 0xFF);
+    memcpydw(sect[0] + 0x1CA, fs->vsize);
+
+    /* boot sector total sectors, FAT size and geometry */
+    memcpy(sect[1], chk->img + chk->voff, 512);
+    memset(sect[1] + 0x013, 0, 2);
+    memset(sect[1] + 0x020, 0, 4);
+    if (fs->vsize > 0xFFFFL)
+        memcpydw(sect[1] + 0x020, fs->vsize);
+    else
+        memcpyw(sect[1] + 0x013, (int) fs->vsize);
+    memcpyw(sect[1] + 0x016, (int) fs->fatsize);
+    memcpyw(sect[1] + 0x018, img->sectors);
+    memcpyw(sect[1] + 0x01A, img->heads);
+
+    if (fseek(gs->fp, 0L, SEEK_SET) != 0 || fwrite(sect[0], 1, 512, gs->fp) != 512 ||
+        fseek(gs->fp, chk->voff, SEEK_SET) != 0 || fwrite(sect[1], 1, 512, gs->fp) != 512) {
+        perror("Unable to write image file MBR.");
+        return EC_FILE_ERROR;
+    }
+    for (i = 0; i < fs->fatnum; i++) {
+        if (fseek(gs->fp, chk->fatoff + fs->fatsize * 512L * i, SEEK_SET) != 0 ||
+            fwrite(gs->fat, 512, (size_t) fs->fatsize, gs->fp) != (size_t) fs->fatsize) {
+            perror("Unable to write image file FAT.");
+            return EC_FILE_ERROR;
+        }
+    }
+    if (fwrite(gs->root, 1, (size_t) (chk->dataoff - chk->rootoff), gs->fp) !=
+        (size_t) (chk->dataoff - chk->rootoff)) {
+        perror("Unable to write image file root directory.");
+        return EC_FILE_ERROR;
+    }
+
+    return 0;
+}
+
+/*
+ * Grows an existing hard disk image in place to the -size or -chs of the
+ * options. The file is extended sparsely and only the metadata is rewritten:
+ * the MBR, the boot sector, the FATs and the root directory. The FATs grow by
+ * whole clusters, so that data clusters stay where they are and are only
+ * renumbered, except for the few now under the FATs, which are moved to free
+ * clusters. The image is checked first; it is left inconsistent if writing
+ * fails half way.
+ */
+int image_grow(const char *filename, const options *opts) {
+    growstate gs;
+    chkstate *chk = &gs.chk;
+    long oldsize;
+    int rc;
+
+    memset(&gs, 0, sizeof(gs));
+    if ((rc = chk_open(chk, filename)) != 0)
+        return rc;
+
+    if ((rc = chk_scan(chk)) == 0 && chk->errors > 0) {
+        fprintf(stderr, "Error: \"%s\" has %d problems, check it with -check first.\n",
+                filename, chk->errors);
+        rc = EC_INV_IMAGE;
+    } else if (rc == 0 && chk->voff == 0L) {
+        fputs("Invalid -grow option. Only hard disk images can grow.", stderr);
+        rc = EC_INV_TYPE;
+    } else if (rc == 0 && chk->type == FS_FAT32) {
+        fputs("Invalid -grow option. Only FAT12 and FAT16 images can grow.", stderr);
+        rc = EC_INV_FAT;
+    } else if (rc == 0) {
+        rc = options_tocustomchs(opts, &gs.img);
+    }
+
+    if (rc == 0) {
+        oldsize = (long) memgetle(chk->img + chk->voff + 0x13, 2);
+        if (oldsize == 0L)
+            oldsize = (long) memgetle(chk->img + chk->voff + 0x20, 4);
+
+        /* the partition start, reserved sectors and clusters are kept */
+        gs.fs.type = chk->type;
+        gs.fs.fatnum = (int) ((chk->rootoff - chk->fatoff) / chk->fatlen);
+        gs.fs.vsize = (long) gs.img.cylinders * gs.img.heads * gs.img.sectors - chk->voff / 512L;
+        if (gs.fs.vsize <= oldsize || gs.fs.vsize * 512L + chk->voff < chk->size) {
+            fprintf(stderr, "Invalid -size option. The image already has %ld MiB.",
+                    (oldsize * 512L + chk->voff) / 1048576L);
+            rc = EC_INV_SIZE;
+        }
+    }
+
+    if (rc == 0)
+        rc = grow_plan(&gs, filename);
+    if (rc == 0 && (gs.fp = fopen(filename, "r+b")) == NULL) {
+        fprintf(stderr, "The file \"%s\" cannot be opened for writing.\n", filename);
+        rc = EC_FILE_ERROR;
+    }
+    if (rc == 0)
+        rc = grow_write(&gs);
+    if (gs.fp != NULL && fclose(gs.fp) != 0 && rc == 0) {
+        perror("Unable to close the image file.");
+        rc = EC_FILE_ERROR;
+    }
+
+    if (rc == 0) {
+        fprintf(stdout, "Grew \"%s\" to %d,%d,%d with %ld more clusters, moving %ld.\n",
+                filename, gs.img.cylinders, gs.img.heads, gs.img.sectors,
+                gs.clusters - chk->clusters, gs.moved);
+    }
+
+    free(gs.reloc);
+    free(gs.fat);
+    free(gs.root);
+    chk_close(chk);
+    return rc;
+}
+
+#if defined(_POSIX_SOURCE) && defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+/*
+ * Punches a hole over the whole host blocks of a byte range. The partial
+ * blocks at its ends are kept, they may hold data of the next clusters.
+ */
+int sparse_punch(int fd, long off, long end, long blksize) {
+    off = (off + blksize - 1L) / blksize * blksize;
+    end = end / blksize * blksize;
+    if (end <= off)
+        return 0;
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) off, (off_t) (end - off)) != 0;
+}
+#endif
+
+/*
+ * Frees the host blocks of the clusters of an image file that are free in
+ * its FAT, and with -zeros of the clusters in use that are all zeros, by
+ * punching holes over them. Holes read as zeros, so the files and the free
+ * space DOS sees are unchanged, only the contents of free clusters are lost.
+ * The image is checked first, so that a broken FAT cannot free data.
+ */
+int image_sparsify(const char *filename, const options *opts) {
+#if defined(_POSIX_SOURCE) && defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    chkstate chk;
+    struct stat st;
+    long csize, blksize, cluster, next, run, oldblocks, freed = 0L, zeros = 0L;
+    int fd = -1, rc;
+
+    if ((rc = chk_open(&chk, filename)) != 0)
+        return rc;
+
+    if ((rc = chk_scan(&chk)) == 0 && chk.errors > 0) {
+        fprintf(stderr, "Error: \"%s\" has %d problems, check it with -check first.\n",
+                filename, chk.errors);
+        rc = EC_INV_IMAGE;
+    } else if (rc == 0 && chk.clusters == 0L) {
+        fprintf(stderr, "Error: \"%s\" is not a FAT image.\n", filename);
+        rc = EC_INV_IMAGE;
+    } else if (rc == 0 && ((fd = open(filename, O_RDWR)) < 0 || fstat(fd, &st) != 0)) {
+        fprintf(stderr, "The file \"%s\" cannot be opened for writing.\n", filename);
+        rc = EC_FILE_ERROR;
+    }
+    if (rc != 0) {
+        if (fd >= 0)
+            close(fd);
+        chk_close(&chk);
+        return rc;
+    }
+
+    csize = chk.spc * 512L;
+    blksize = st.st_blksize > 0 ? (long) st.st_blksize : 4096L;
+    oldblocks = (long) st.st_blocks;
+
+    /* runs of free clusters, extended over the zero clusters that follow */
+    run = -1L;
+    for (cluster = 2L; rc == 0 && cluster < chk.clusters; cluster = next) {
+        next = chk_nextused(&chk, cluster);
+        if (next > cluster) {
+            if (run < 0L)
+                run = cluster;
+            freed += next - cluster;
+            continue;
+        }
+
+        next = cluster + 1L;
+        if ((opts->flags & OPTS_ZEROS) && chk_fatget(&chk, cluster) != chk.bad &&
+            chk.dataoff + (cluster - 1L) * csize <= chk.size &&
+            memzero(chk.img + chk.dataoff + (cluster - 2L) * csize, (size_t) csize)) {
+            if (run < 0L)
+                run = cluster;
+            zeros++;
+            continue;
+        }
+        if (run >= 0L)
+            rc = sparse_punch(fd, chk.dataoff + (run - 2L) * csize, chk.dataoff + (cluster - 2L) * csize, blksize);
+        run = -1L;
+    }
+    /* the last run may end past a truncated image file */
+    if (rc == 0 && run >= 0L) {
+        next = chk.dataoff + (chk.clusters - 2L) * csize;
+        rc = sparse_punch(fd, chk.dataoff + (run - 2L) * csize, next < chk.size ? next : chk.size, blksize);
+    }
+
+    if (rc != 0) {
+        fprintf(stderr, "Unable to punch holes in \"%s\": %s\n", filename, strerror(errno));
+        rc = EC_FILE_ERROR;
+    } else if (fstat(fd, &st) == 0) {
+        fprintf(stdout, "Sparsified \"%s\": %ld free and %ld zero clusters, %ld KiB allocated instead of %ld KiB.\n",
+                filename, freed, zeros, (long) st.st_blocks / 2L, oldblocks / 2L);
+    }
+
+    if (close(fd) != 0 && rc == 0) {
+        perror("Unable to close the image file.");
+        rc = EC_FILE_ERROR;
+    }
+    chk_close(&chk);
+    return rc;
+#else
+    (void) opts;
+    fprintf(stderr, "Invalid -sparsify option. Holes cannot be punched in \"%s\" on this system.\n", filename);
+    return EC_INV_USAGE;
+#endif
+}
+
+/*
+ * Host files measured by -plan.
+ */
+typedef struct {
+    long files;                  /* Number of files */
+    long dirs;                   /* Number of subdirectories */
+    long bytes;                  /* Total size of the files */
+    long sizes[PLAN_BUCKETS];    /* Files by size, in power of 2 buckets from 512 bytes */
+    long fanout[PLAN_BUCKETS];   /* Directories by entries, in power of 2 buckets from 16 */
+} planstats;
+
+/*
+ * Cost of the host files for a cluster size.
+ */
+typedef struct {
+    long clusters;               /* Clusters of the files and subdirectories */
+    long slack;                  /* Bytes allocated but not used */
+    long links;                  /* FAT links past the first cluster of each chain */
+    long longest;                /* Longest chain in clusters */
+} plancost;
+
+/*
+ * Bucket of a value, the first one holding up to base.
+ */
+int plan_bucket(long val, long base) {
+    int i;
+
+    for (i = 0; i < PLAN_BUCKETS - 1 && val > base; i++)
+        base <<= 1;
+    return i;
+}
+
+/*
+ * Builds the histograms of the file sizes and of the directory entries.
+ */
+void plan_measure(const fsnode *dir, planstats *ps) {
+    const fsnode *node;
+
+    for (node = dir->child; node != NULL; node = node->next) {
+        if (node->attr & FS_ATTR_DIR) {
+            ps->dirs++;
+            ps->fanout[plan_bucket(node->entries, 16L)]++;
+            plan_measure(node, ps);
+        } else {
+            ps->files++;
+            ps->bytes += node->size;
+            ps->sizes[plan_bucket(node->size, 512L)]++;
+        }
+    }
+}
+
+/*
+ * Adds a chain of the given number of bytes to the cost.
+ */
+void plan_chain(plancost *pc, long bytes, long csize) {
+    const long clusters = (bytes + csize - 1L) / csize;
+
+    pc->clusters += clusters;
+    pc->slack += clusters * csize - bytes;
+    if (clusters > 1L)
+        pc->links += clusters - 1L;
+    if (clusters > pc->longest)
+        pc->longest = clusters;
+}
+
+/*
+ * Adds the files and subdirectories of a directory to the cost, as laid out
+ * by fstree_alloc().
+ */
+void plan_dir(const fsnode *dir, long csize, plancost *pc) {
+    const fsnode *node;
+
+    for (node = dir->child; node != NULL; node = node->next) {
+        if (node->attr & FS_ATTR_DIR) {
+            /* "." and ".." take two entries */
+            plan_chain(pc, (node->entries + 2L) * FS_DIRENT_SIZE, csize);
+            plan_dir(node, csize, pc);
+        } else {
+            plan_chain(pc, node->size, csize);
+        }
+    }
+}
+
+/*
+ * Prints a histogram, with the upper bound of each bucket.
+ */
+void plan_histogram(const char *title, const long *buckets, long base, const char *unit) {
+    int i, last = 0;
+
+    for (i = 0; i < PLAN_BUCKETS; i++) {
+        if (buckets[i] > 0)
+            last = i;
+    }
+
+    fprintf(stdout, "%s:\n", title);
+    for (i = 0; i <= last; i++, base <<= 1) {
+        if (i == PLAN_BUCKETS - 1)
+            fprintf(stdout, "  %13s%s  %8ld\n", "more", unit, buckets[i]);
+        else
+            fprintf(stdout, "  <= %10ld%s  %8ld\n", base, unit, buckets[i]);
+    }
+}
+
+/*
+ * Scores a layout for the host files, or returns -1 if it is not legal or the
+ * files do not fit.
+ */
+long plan_try(const options *cand, imgspec *img, const fsnode *root, int need, plancost *pc) {
+    const fsspec *fs = img->fs;
+
+    /* spc is raised by the planner when the volume needs it */
+    if (options_tofsspec(cand, img) != 0 || fs->spc != cand->spc)
+        return -1L;
+
+    memset(pc, 0, sizeof(plancost));
+    if (fs->type == FS_FAT32) {
+        /* the root directory chain keeps an entry for the label */
+        plan_chain(pc, (root->entries + 1L) * FS_DIRENT_SIZE, fs->spc * 512L);
+    } else if (need > fs->rtent) {
+        return -1L;
+    } else {
+        pc->slack = (fs->rtent * (long) FS_DIRENT_SIZE + 511L) / 512L * 512L
+                    - need * (long) FS_DIRENT_SIZE;
+    }
+    plan_dir(root, fs->spc * 512L, pc);
+
+    if (pc->clusters > fsspec_clusters(fs) - 2L)
+        return -1L;
+    return pc->slack + pc->links * PLAN_LINK_BYTES;
+}
+
+/*
+ * Recommends the FAT type, cluster size and root directory size of an image
+ * holding the files of a host directory. Every legal combination is tried and
+ * the one with the least slack and the shortest FAT chains is printed with
+ * the command line that creates it. FAT32 is only tried with -fs 32.
+ */
+int image_plan(const char *path, const options *opts) {
+    const int fats[3] = {FS_FAT12, FS_FAT16, FS_FAT32};
+    planstats ps;
+    plancost pc, rowpc, best;
+    options cand;
+    label vlabel;
+    fsspec fs;
+    imgspec img;
+    fsnode root;
+    long score, rowscore, bestscore = -1L;
+    int i, spc, rtent, need, rowrtent = 0, rc;
+    int bestfat = 0, bestspc = 0, bestrtent = 0;
+
+    if (opts->type == NULL) {
+        fputs("Invalid -plan option. It requires -t.", stderr);
+        return EC_INV_USAGE;
+    }
+
+    /* geometry and defaults of the image, which the candidates keep */
+    fs.vlabel = &vlabel;
+    img.fs = &fs;
+    cand = *opts;
+    cand.copydir = NULL;
+    if ((rc = options_toimgspec(&cand, &img)) != 0)
+        return rc;
+    if (img.fs == NULL) {
+        fputs("Invalid -plan option. Files cannot be copied when -nofs is set.", stderr);
+        return EC_INV_USAGE;
+    }
+
+    memset(&root, 0, sizeof(root));
+    root.path = (char *) path;
+    root.attr = FS_ATTR_DIR;
+    if ((rc = fstree_scan(&root)) != 0) {
+        fstree_free(root.child);
+        return rc;
+    }
+
+    memset(&ps, 0, sizeof(ps));
+    plan_measure(&root, &ps);
+    fprintf(stdout, "Host directory \"%s\": %ld files in %ld directories, %ld bytes.\n",
+            path, ps.files, ps.dirs + 1L, ps.bytes);
+    plan_histogram("File sizes", ps.sizes, 512L, " B");
+    if (ps.dirs > 0L)
+        plan_histogram("Subdirectory entries", ps.fanout, 16L, "");
+
+    /* the root directory also holds the label */
+    need = root.entries + (opts->label != NULL ? 1 : 0);
+    fprintf(stdout, "Layouts that fit, scored by slack plus %d bytes per FAT link:\n", PLAN_LINK_BYTES);
+    fputs("   FAT  SPC  ROOTDIR  SLACK KiB     LINKS  LONGEST\n", stdout);
+
+    cand.flags |= OPTS_QUIET;
+    cand.label = NULL;
+    for (i = 0; i < 3; i++) {
+        if (opts->fat >= 0 ? fats[i] != opts->fat : fats[i] == FS_FAT32)
+            continue;
+        cand.fat = fats[i];
+
+        for (spc = 1; spc <= 128; spc <<= 1) {
+            cand.spc = spc;
+            rowscore = -1L;
+
+            /* root directories of whole sectors, FAT32 has none */
+            for (rtent = 16; rtent <= 4096; rtent += 16) {
+                cand.rootdir = fats[i] == FS_FAT32 ? -1 : rtent;
+                score = plan_try(&cand, &img, &root, need, &pc);
+                if (score >= 0L && (rowscore < 0L || score < rowscore)) {
+                    rowscore = score;
+                    rowpc = pc;
+                    rowrtent = fs.rtent;
+                }
+                if (fats[i] == FS_FAT32)
+                    break;
+            }
+            if (rowscore < 0L)
+                continue;
+
+            fprintf(stdout, "  %4d %4d %8d %10ld %9ld %8ld\n", fats[i], spc, rowrtent,
+                    (rowpc.slack + 1023L) / 1024L, rowpc.links, rowpc.longest);
+            if (bestscore < 0L || rowscore < bestscore) {
+                bestscore = rowscore;
+                best = rowpc;
+                bestfat = fats[i];
+                bestspc = spc;
+                bestrtent = rowrtent;
+            }
+        }
+    }
+    fstree_free(root.child);
+
+    if (bestscore < 0L) {
+        fprintf(stderr, "Error: \"%s\" does not fit in the image with any layout.\n", path);
+        return EC_INV_CLUSTERS;
+    }
+
+    fprintf(stdout, "Recommended: FAT%d with %d sectors per cluster", bestfat, bestspc);
+    if (bestfat != FS_FAT32)
+        fprintf(stdout, " and %d root directory entries", bestrtent);
+    fprintf(stdout, ", wasting %ld KiB with %ld FAT links.\n", (best.slack + 1023L) / 1024L, best.links);
+
+    fprintf(stdout, "  imgmake %s -t %s", opts->filename != NULL ? opts->filename : "IMGMAKE.IMG", opts->type);
+    if (opts->size >= 0)
+        fprintf(stdout, " -size %d", opts->size);
+    else if (opts->c >= 0)
+        fprintf(stdout, " -chs %d,%d,%d", opts->c, opts->h, opts->s);
+    fprintf(stdout, " -fs %d -spc %d", bestfat, bestspc);
+    if (bestfat != FS_FAT32)
+        fprintf(stdout, " -rootdir %d", bestrtent);
+    if (opts->fatcopies >= 0)
+        fprintf(stdout, " -fatcopies %d", opts->fatcopies);
+    if (opts->align > 0)
+        fprintf(stdout, " -align %ld", opts->align * 512L);
+    if (opts->label != NULL)
+        fprintf(stdout, " -label \"%s\"", opts->label);
+    fprintf(stdout, " -copy \"%s\"\n", path);
+    return 0;
+}
+
+/*
+ * Image templates, -fs, -spc, -fatcopies and -rootdir values tried by
+ * -validate, -1 leaving the choice to the planner.
+ */
+const char *validate_types[] = {
+        "fd_160", "fd_180", "fd_200", "fd_320", "fd_360", "fd_400", "fd_720",
+        "fd_1200", "fd_1440", "fd_2880", "hd_250", "hd_520", "hd_1gig",
+        "hd_2gig", "hd_st251", "hd_st225"
+};
+const int validate_fats[] = {-1, FS_FAT12, FS_FAT16, FS_FAT32};
+const int validate_spcs[] = {-1, 1, 2, 4, 8, 16, 32, 64, 128};
+const int validate_copies[] = {-1, 1, 2, 3, 4};
+const int validate_rootdirs[] = {-1, 1, 16, 17, 224, 512, 4080, 4096};
+
+/*
+ * Validation run, shared by the worker threads.
+ */
+typedef struct {
+    options base;         /* Options every case starts from */
+    long fat32;           /* Number of FAT32 cases past 2014 MiB */
+    long count;           /* Number of cases */
+    long next;            /* Next case to plan */
+    long valid;           /* Cases planned */
+    long rejected;        /* Cases refused with an exit code */
+    long violations;      /* Planned cases that break a rule */
+#ifdef _POSIX_SOURCE
+    pthread_mutex_t lock; /* Protects next, the counters and the output */
+#endif
+} valstate;
+
+/*
+ * Sets the filesystem options of a case from its index.
+ */
+void validate_fsopts(long i, options *o) {
+    o->fat = validate_fats[i % 4L];
+    o->spc = validate_spcs[i / 4L % 9L];
+    o->fatcopies = validate_copies[i / 36L % 5L];
+    o->rootdir = validate_rootdirs[i / 180L % 8L];
+}
+
+/*
+ * Sets the options of a case from its index: every template and every -size
+ * up to 2014 MiB with the filesystem options, every -size aligned, FAT32
+ * sizes beyond, ever further apart, and every -chs. Returns 0 past the last
+ * case.
+ */
+int validate_case(const valstate *vs, long i, options *o) {
+    long k;
+
+    *o = vs->base;
+    if (i < VAL_TEMPLATES) {
+        o->type = validate_types[i / VAL_FSOPTS];
+        validate_fsopts(i % VAL_FSOPTS, o);
+        return 1;
+    }
+
+    o->type = "hd";
+    if ((i -= VAL_TEMPLATES) < VAL_SIZES) {
+        o->size = (int) (3L + i / VAL_FSOPTS);
+        validate_fsopts(i % VAL_FSOPTS, o);
+    } else if ((i -= VAL_SIZES) < VAL_ALIGNED) {
+        o->size = (int) (3L + i / 8L);
+        o->fat = validate_fats[i / 2L % 4L];
+        /* 4k and 64k */
+        o->align = i % 2L == 0L ? 8 : 128;
+    } else if ((i -= VAL_ALIGNED) < vs->fat32) {
+        k = i / 45L + 1L;
+        o->size = (int) (2014L + k * k);
+        o->fat = FS_FAT32;
+        o->spc = validate_spcs[i % 9L];
+        o->fatcopies = validate_copies[i / 9L % 5L];
+    } else if ((i -= vs->fat32) < VAL_CHS) {
+        o->c = (int) (1L + i / (HD_HEAD_MAX * HD_SECT_MAX));
+        o->h = (int) (1L + i / HD_SECT_MAX % HD_HEAD_MAX);
+        o->s = (int) (1L + i % HD_SECT_MAX);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Checks a planned image against the rules DOS and the BIOS rely on, and
+ * against the options it was planned from. Returns NULL if they hold, or the
+ * rule that is broken.
+ */
+const char *validate_image(const options *o, const imgspec *img) {
+    const fsspec *fs = img->fs;
+    const long chs = (long) img->cylinders * img->heads * img->sectors;
+    const long rtsect = (fs->rtent * (long) FS_DIRENT_SIZE + 511L) / 512L;
+    const long datasect = fs->rsvd + fs->fatsize * fs->fatnum + rtsect;
+    const long bits = fs->type == FS_FAT12 ? 12L : fs->type;
+    const long maxcount = fs->type == FS_FAT12 ? 4084L : fs->type == FS_FAT16 ? 65524L : 0x0FFFFFF4L;
+    unsigned char mbr[512], boot[512];
+    long count, lba;
+    int cyl;
+
+    if (img->sectors < 1 || img->sectors > HD_SECT_MAX || img->heads < 1 ||
+        img->heads > (fs->type == FS_FAT32 ? HD_LBA_HEADS : HD_HEAD_MAX) || img->cylinders < 1 ||
+        (img->cylinders > HD_CYL_MAX && fs->type != FS_FAT32))
+        return "the geometry is out of range";
+    if (o->size >= 0 && (chs > o->size * 2048L || chs <= o->size * 2048L - (long) img->heads * img->sectors))
+        return "the geometry does not match -size";
+    if (o->size < 0 && o->c >= 0 && (img->cylinders != o->c || img->heads != o->h || img->sectors != o->s))
+        return "the geometry does not match -chs";
+
+    if (fs->voff + fs->vsize != chs || fs->voff < (fs->mdesc == HD_MDESC ? img->sectors : 0))
+        return "the volume does not fill the disk";
+    /* -spc is only raised if half the clusters would be too many */
+    if (fs->spc < 1 || fs->spc > 128 || (fs->spc & (fs->spc - 1)) != 0 ||
+        (o->spc >= 0 && fs->spc != o->spc && (fs->spc < o->spc || fs->vsize / (fs->spc / 2) < maxcount)))
+        return "the cluster size does not match -spc";
+    if (fs->fatnum != (o->fatcopies >= 0 ? o->fatcopies : 2))
+        return "the FAT copies do not match -fatcopies";
+    if (o->fat >= 0 && fs->type != o->fat)
+        return "the FAT type does not match -fs";
+    if (fs->type == FS_FAT32 ? fs->rtent != 0 : fs->rtent < 1 || (o->rootdir >= 0 && fs->rtent != o->rootdir))
+        return "the root directory does not match -rootdir";
+    if (fs->rsvd < (fs->type == FS_FAT32 ? FS_RSV_SECT32 : FS_RSV_SECT) || fs->rsvd > 0xFFFF)
+        return "the reserved sectors are out of range";
+    if (fs->type != FS_FAT32 && fs->fatsize > 0xFFFFL)
+        return "the FAT size does not fit the boot sector";
+    if (datasect >= fs->vsize)
+        return "the volume has no data region";
+    if (o->align > 0 && (fs->voff + datasect) % o->align != 0)
+        return "the data region does not match -align";
+
+    /* DOS tells the FAT type from the number of clusters alone */
+    count = (fs->vsize - datasect) / fs->spc;
+    if (fs->type != (count < 4085L ? FS_FAT12 : count < 65525L ? FS_FAT16 : FS_FAT32))
+        return "the cluster count reads as another FAT type";
+    if (fs->fatsize * 512L * 8L / bits < count + 2L)
+        return "the FAT is too small for the clusters";
+
+    memset(boot, 0, sizeof(boot));
+    imgspec_fillboot(img, boot);
+    if (memgetle(boot + 0x00B, 2) != 512UL || boot[0x00D] != fs->spc ||
+        memgetle(boot + 0x00E, 2) != (unsigned long) fs->rsvd || boot[0x010] != fs->fatnum ||
+        memgetle(boot + 0x011, 2) != (unsigned long) fs->rtent ||
+        (memgetle(boot + 0x013, 2) != 0UL
+         ? memgetle(boot + 0x013, 2) != (unsigned long) fs->vsize || fs->type == FS_FAT32
+         : memgetle(boot + 0x020, 4) != (unsigned long) fs->vsize || fs->vsize <= 0xFFFFL) ||
+        memgetle(fs->type == FS_FAT32 ? boot + 0x024 : boot + 0x016, fs->type == FS_FAT32 ? 4 : 2) !=
+            (unsigned long) fs->fatsize ||
+        memgetle(boot + 0x018, 2) != (unsigned long) img->sectors ||
+        memgetle(boot + 0x01A, 2) != (unsigned long) img->heads ||
+        memgetle(boot + 0x01C, 4) != (unsigned long) fs->voff)
+        return "the boot sector does not match the volume";
+
+    if (fs->mdesc != HD_MDESC)
+        return NULL;
+
+    imgspec_fillmbr(img, mbr);
+    if (mbr[0x1C2] != (fs->type == FS_FAT12 ? 0x01 : fs->type == FS_FAT16 ? (fs->vsize < 65536L ? 0x04 : 0x06)
+                       : img->cylinders > HD_CYL_MAX ? 0x0C : 0x0B))
+        return "the partition type does not match the volume";
+    if (memgetle(mbr + 0x1C6, 4) != (unsigned long) fs->voff || memgetle(mbr + 0x1CA, 4) != (unsigned long) fs->vsize)
+        return "the partition does not match the volume";
+
+    /* the CHS addresses of the partition, where they reach */
+    cyl = mbr[0x1C1] | (mbr[0x1C0] & 0xC0) << 2;
+    lba = ((long) cyl * img->heads + mbr[0x1BF]) * img->sectors + (mbr[0x1C0] & 0x3F) - 1L;
+    if (fs->voff < 1024L * img->heads * img->sectors && lba != fs->voff)
+        return "the partition start address does not match the volume";
+    cyl = mbr[0x1C5] | (mbr[0x1C4] & 0xC0) << 2;
+    lba = ((long) cyl * img->heads + mbr[0x1C3]) * img->sectors + (mbr[0x1C4] & 0x3F) - 1L;
+    if (img->cylinders <= HD_CYL_MAX && lba != chs - 1L)
+        return "the partition end address does not match the disk";
+
+    return NULL;
+}
+
+/*
+ * Writes the options of a case as a command line.
+ */
+void validate_cmdline(const options *o, char *buf) {
+    buf += sprintf(buf, "imgmake -t %s", o->type);
+    if (o->size >= 0)
+        buf += sprintf(buf, " -size %d", o->size);
+    else if (o->c >= 0)
+        buf += sprintf(buf, " -chs %d,%d,%d", o->c, o->h, o->s);
+    if (o->fat >= 0)
+        buf += sprintf(buf, " -fs %d", o->fat);
+    if (o->spc >= 0)
+        buf += sprintf(buf, " -spc %d", o->spc);
+    if (o->fatcopies >= 0)
+        buf += sprintf(buf, " -fatcopies %d", o->fatcopies);
+    if (o->rootdir >= 0)
+        buf += sprintf(buf, " -rootdir %d", o->rootdir);
+    if (o->align > 0)
+        sprintf(buf, " -align %ld", o->align * 512L);
+}
+
+/*
+ * Plans cases until there are none left, VAL_BATCH at a time.
+ */
+void *validate_worker(void *arg) {
+    valstate *vs = (valstate *) arg;
+    char cmd[128];
+    const char *why;
+    options o;
+    label vlabel;
+    fsspec fs;
+    imgspec img;
+    long i, end, valid, rejected;
+
+    for (;;) {
+#ifdef _POSIX_SOURCE
+        pthread_mutex_lock(&vs->lock);
+#endif
+        i = vs->next;
+        vs->next = end = i + VAL_BATCH < vs->count ? i + VAL_BATCH : vs->count;
+#ifdef _POSIX_SOURCE
+        pthread_mutex_unlock(&vs->lock);
+#endif
+        if (i >= end)
+            break;
+
+        for (valid = 0L, rejected = 0L; i < end; i++) {
+            validate_case(vs, i, &o);
+            fs.vlabel = &vlabel;
+            img.fs = &fs;
+            if (options_toimgspec(&o, &img) != 0) {
+                rejected++;
+                continue;
+            }
+            valid++;
+            if ((why = validate_image(&o, &img)) == NULL)
+                continue;
+
+            validate_cmdline(&o, cmd);
+#ifdef _POSIX_SOURCE
+            pthread_mutex_lock(&vs->lock);
+#endif
+            if (++vs->violations <= CHECK_MSG_MAX)
+                fprintf(stdout, "  %s: %s\n", cmd, why);
+            else if (vs->violations == CHECK_MSG_MAX + 1)
+                fputs("  ...\n", stdout);
+#ifdef _POSIX_SOURCE
+            pthread_mutex_unlock(&vs->lock);
+#endif
+        }
+
+#ifdef _POSIX_SOURCE
+        pthread_mutex_lock(&vs->lock);
+#endif
+        vs->valid += valid;
+        vs->rejected += rejected;
+#ifdef _POSIX_SOURCE
+        pthread_mutex_unlock(&vs->lock);
+#endif
+    }
+
+    return NULL;
+}
+
+/*
+ * Plans every image template, every -size and every legal -chs with the
+ * filesystem options, on a pool of worker threads, and checks every planned
+ * image against the rules of validate_image(). Prints the broken ones with
+ * the throughput, and returns EC_INV_IMAGE if there are any.
+ */
+int image_validate(const options *opts) {
+    valstate vs;
+    double start, seconds;
+    int i, threads;
+#ifdef _POSIX_SOURCE
+    pthread_t *workers;
+#endif
+
+    memset(&vs, 0, sizeof(vs));
+    options_init(&vs.base);
+    vs.base.flags |= OPTS_QUIET;
+    /* cpu_count() would be called for every case */
+    vs.base.threads = 1;
+    for (vs.fat32 = 0L; 2014L + (vs.fat32 + 1L) * (vs.fat32 + 1L) <= FS_FAT32_MIB_MAX; vs.fat32++);
+    vs.fat32 *= 45L;
+    vs.count = VAL_TEMPLATES + VAL_SIZES + VAL_ALIGNED + vs.fat32 + VAL_CHS;
+
+    threads = opts->threads < 0 ? cpu_count() : opts->threads;
+    fprintf(stdout, "Validating %ld plans on %d threads.\n", vs.count, threads);
+    fflush(stdout);
+    start = clock_monotonic();
+
+#ifdef _POSIX_SOURCE
+    pthread_mutex_init(&vs.lock, NULL);
+    workers = malloc(threads * sizeof(pthread_t));
+    /* the main thread is a worker too */
+    for (i = 1; workers != NULL && i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, validate_worker, &vs) != 0)
+            break;
+    }
+    threads = workers != NULL ? i : 1;
+    validate_worker(&vs);
+    for (i = 1; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&vs.lock);
+#else
+    (void) i;
+    validate_worker(&vs);
+#endif
+
+    seconds = clock_monotonic() - start;
+    fprintf(stdout, "Planned %ld images and rejected %ld option sets in %.2f s, %.0f plans/s.\n",
+            vs.valid, vs.rejected, seconds, seconds > 0.0 ? (double) vs.count / seconds : 0.0);
+    if (vs.violations > 0L) {
+        fprintf(stdout, "Found %ld images that break a rule.\n", vs.violations);
+        return EC_INV_IMAGE;
+    }
+    fputs("No problems found.\n", stdout);
+    return 0;
+}
+
+/*
+ * Writes the image to the given sink.
+ */
+int imgspec_write(const imgspec *img, imgsink *sink) {
+    const long size = (long) img->cylinders * img->heads * img->sectors * 512L;
+
+    sink->stats = img->stats;
+    sink->seeded = img->seeded;
+    sink->seed = img->seed;
+    if (sink->alloc(sink, size, img->alloc) != 0) {
+        fprintf(stderr, "Not enough space available for the image file. Need %ld bytes.\n", size);
+        return 1;
+    }
+    imgstats_phase(sink->stats, STATS_ALLOC);
+
+    if (img->fs != NULL && imgspec_writefs(img, sink) != 0)
+        return 1;
+    imgstats_phase(sink->stats, STATS_FILES);
+
+    if (sink->finish(sink, size) != 0) {
+        perror("Unable to complete image file");
+        return 1;
+    }
+    imgstats_phase(sink->stats, STATS_FINISH);
+
+    return 0;
+}
+
+/*
+ * Initializes the sink for the output format of the image.
+ */
+int imgsink_format(imgsink *sink, FILE *fp, const imgspec *img) {
+    if (img->format == FORMAT_VHD_DYNAMIC)
+        return imgsink_vhd(sink, fp, img);
+#ifdef _POSIX_SOURCE
+    if (img->format == FORMAT_RAW && img->device)
+        return imgsink_device(sink, fp);
+    if (img->format == FORMAT_RAW && img->ioengine == IOENGINE_MMAP)
+        return imgsink_mmap(sink, fp, img->advice, img->msync || img->sync != SYNC_NONE);
+#endif
+#ifdef _POSIX_SOURCE
+    if (img->format == FORMAT_RAW && img->direct)
+        return imgsink_direct(sink, fp);
+#endif
+#ifdef _POSIX_SOURCE
+    if (img->format == FORMAT_RAW && img->ioengine == IOENGINE_URING) {
+#if defined(__linux__) && defined(HAVE_IO_URING)
+        if (imgsink_uring(sink, fp) == 0)
+            return 0;
+        sink->release(sink);
+#endif
+        /* the kernel or the build may lack io_uring */
+        fputs("Warning: io_uring is not available, writing the image file with pwrite().\n", stderr);
+        return imgsink_pwrite(sink, fp);
+    }
+    if (img->format == FORMAT_RAW && img->ioengine == IOENGINE_PWRITE)
+        return imgsink_pwrite(sink, fp);
+#endif
+#ifdef HAVE_ZLIB
+    if (img->format == FORMAT_GZIP)
+        return imgsink_gzip(sink, fp, img->threads);
+#endif
+    imgsink_file(sink, fp);
+    return 0;
+}
+
+/*
+ * Plans an image from the options and loads the host files to copy into it.
+ * img->fs must point to a filesystem specification whose vlabel points to a
+ * label, so that planning needs no memory allocation. On success the image
+ * must be freed with imgspec_free().
+ */
+int imgspec_plan(const options *opts, imgspec *img) {
+    int rc;
+
+    if ((rc = options_toimgspec(opts, img)) != 0)
+        return rc;
+
+    if (opts->copydir != NULL) {
+        if (img->fs == NULL) {
+            fputs("Invalid -copy option. Files cannot be copied when -nofs is set.", stderr);
+            return EC_INV_USAGE;
+        }
+        if (fstree_load(img->fs, opts->copydir, opts->trace) != 0) {
+            /* error messages are printed by fstree_load */
+            fstree_free(img->fs->root);
+            free(img->fs->fat);
+            return EC_COPY_ERROR;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Frees the host files and FAT of a planned image.
+ */
+void imgspec_free(imgspec *img) {
+    if (img->fs != NULL) {
+        fstree_free(img->fs->root);
+        free(img->fs->fat);
+        img->fs->root = NULL;
+        img->fs->trace = NULL;
+        img->fs->fat = NULL;
+    }
+}
+
+/*
+ * Adds bytes to the two FNV-1a hashes of an image specification. The second
+ * hash also mixes in the byte count, so that both do not collide together.
+ */
+void spechash_bytes(unsigned long *h, const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *) buf;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h[0] = ((h[0] ^ p[i]) * FNV_PRIME) & 0xFFFFFFFFUL;
+        h[1] = ((h[1] ^ p[i] ^ (h[2] & 0xFF)) * FNV_PRIME) & 0xFFFFFFFFUL;
+        h[2]++;
+    }
+}
+
+/*
+ * Adds a number to the hashes as 8 little-endian bytes, so that keys do not
+ * depend on the size of long.
+ */
+void spechash_long(unsigned long *h, long val) {
+    unsigned char buf[8];
+    unsigned long lo = (unsigned long) val;
+    /* two shifts, a single shift by 32 is undefined for a 32-bit long */
+    unsigned long hi = lo >> 16 >> 16;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        buf[i] = (unsigned char) (lo & 0xFF);
+        buf[i + 4] = (unsigned char) (hi & 0xFF);
+        lo >>= 8;
+        hi >>= 8;
+    }
+    spechash_bytes(h, buf, sizeof(buf));
+}
+
+/*
+ * Adds a host file or directory tree to the hashes. Host files are identified
+ * by path, size and modification time rather than by their contents.
+ */
+void spechash_node(unsigned long *h, const fsnode *node) {
+    for (; node != NULL; node = node->next) {
+        spechash_bytes(h, node->path, strlen(node->path) + 1);
+        spechash_bytes(h, node->name, sizeof(node->name));
+        spechash_long(h, node->attr);
+        spechash_long(h, (long) node->mdate);
+        spechash_long(h, (long) node->mtime);
+        spechash_long(h, node->size);
+        spechash_long(h, node->cluster);
+        spechash_long(h, node->clusters);
+        spechash_long(h, node->htime);
+        spechash_node(h, node->child);
+        /* ends the directory so that nesting changes the key */
+        spechash_long(h, -1L);
+    }
+}
+
+/*
+ * Computes the cache key of a planned reproducible image: 16 hex digits that
+ * change with everything that is written into the image. key must hold
+ * SPEC_KEY_SIZE characters.
+ */
+void imgspec_hash(const imgspec *img, char *key) {
+    unsigned long h[3];
+    const fsspec *fs = img->fs;
+
+    h[0] = FNV_BASIS;
+    h[1] = FNV_BASIS;
+    h[2] = 0;
+    spechash_bytes(h, SPEC_HASH_VERSION, sizeof(SPEC_HASH_VERSION));
+    spechash_long(h, img->cylinders);
+    spechash_long(h, img->heads);
+    spechash_long(h, img->sectors);
+    spechash_long(h, img->format);
+    spechash_long(h, img->alloc);
+    spechash_long(h, img->seeded);
+    spechash_long(h, (long) img->seed);
+    spechash_long(h, fs != NULL);
+    if (fs != NULL) {
+        spechash_long(h, fs->type);
+        spechash_long(h, fs->spc);
+        spechash_long(h, fs->rtent);
+        spechash_long(h, fs->mdesc);
+        spechash_long(h, fs->fatnum);
+        spechash_long(h, fs->rsvd);
+        spechash_long(h, fs->fatsize);
+        spechash_long(h, fs->voff);
+        spechash_long(h, fs->vsize);
+        spechash_long(h, fs->padding);
+        spechash_long(h, fs->vlabel != NULL ? (long) fs->vlabel->len : -1L);
+        if (fs->vlabel != NULL)
+            spechash_bytes(h, fs->vlabel->text, fs->vlabel->len);
+        spechash_node(h, fs->root);
+    }
+    sprintf(key, "%08lX%08lX", h[0], h[1]);
+}
+
+/*
+ * Allocates the buffers shared by all images up front, so that the first
+ * image of a long-running process does not pay for them. Returns non-zero if
+ * there is not enough memory.
+ */
+int imglib_warm(void) {
+#ifdef HAVE_ZLIB
+    const unsigned char *zout;
+    unsigned long zolen, zcrc;
+
+    if (gz_zeroget(&zout, &zolen, &zcrc) != 0)
+        return 1;
+#endif
+    return zero_bufget() == NULL;
+}
+
+/*
+ * Plans an image from the options and writes it to the given sink, which
+ * decides the output format. The sink is not released.
+ */
+int image_build(const options *opts, imgsink *sink) {
+    label vlabel;
+    fsspec fs;
+    imgspec img;
+    int rc;
+
+    /* avoids malloc() */
+    fs.vlabel = &vlabel;
+    img.fs = &fs;
+
+    if ((rc = imgspec_plan(opts, &img)) != 0)
+        return rc;
+
+    if (imgspec_write(&img, sink) != 0) {
+        /* error messages are printed by imgspec_write */
+        rc = EC_FILE_ERROR;
+    }
+
+    imgspec_free(&img);
+    return rc;
+}
+
+/*
+ * Initializes the options to their defaults.
+ */
+void options_init(options *opts) {
+    memset(opts, 0, sizeof(options));
+    opts->size = -1;
+    opts->c = -1;
+    opts->h = -1;
+    opts->s = -1;
+    opts->spc = -1;
+    opts->fatcopies = -1;
+    opts->rootdir = -1;
+    opts->fat = -1;
+    opts->threads = -1;
+    opts->alloc = ALLOC_SPARSE;
+    opts->format = FORMAT_RAW;
+}
+
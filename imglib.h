@@ -0,0 +1,371 @@
+/*
+ * libimgmake: plans and writes floppy and hard disk images.
+ *
+ * The planner turns options into an image specification, and the writer
+ * writes the specification to a sink: a file, a stream, a memory buffer or
+ * a callback. Functions return the EC_* codes below instead of exiting, and
+ * print the reason of a failure to standard error. Build the library and
+ * its users with the same _POSIX_SOURCE and HAVE_ZLIB settings.
+ */
+#ifndef IMGLIB_H
+#define IMGLIB_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Do not write filesystem information */
+#define OPTS_NOFS 0x1
+/* Force overwrite */
+#define OPTS_FORCE 0x2
+/* Create .BAT file */
+#define OPTS_BAT 0x4
+/* Flush mapped image files with msync() */
+#define OPTS_MSYNC 0x8
+/* Print timing and I/O statistics */
+#define OPTS_STATS 0x10
+/* Write raw image files with O_DIRECT */
+#define OPTS_DIRECT 0x20
+/* Reproducible image, stamped with the seed instead of the current time */
+#define OPTS_SEED 0x40
+/* Existing target, like a block device, cleared and written in place */
+#define OPTS_DEVICE 0x80
+/* Options only tried by the planner, errors are not printed */
+#define OPTS_QUIET 0x100
+/* Validate the planner instead of creating an image */
+#define OPTS_VALIDATE 0x200
+/* Also free the clusters in use that are all zeros with -sparsify */
+#define OPTS_ZEROS 0x400
+
+/* Image files are not flushed to disk, the default */
+#define SYNC_NONE 0
+/* Image file data and directory entries are flushed to disk */
+#define SYNC_DATA 1
+/* Image file data, metadata and directory entries are flushed to disk */
+#define SYNC_FULL 2
+
+/* Sparse file, the default */
+#define ALLOC_SPARSE 0
+/* Reserve space on disk without writing it */
+#define ALLOC_RESERVE 1
+/* Fill the whole file with zeros */
+#define ALLOC_FULL 2
+
+/* Raw image, the default */
+#define FORMAT_RAW 0
+/* Dynamic VHD image */
+#define FORMAT_VHD_DYNAMIC 1
+/* Differencing VHD image */
+#define FORMAT_VHD_DIFF 2
+/* Gzip compressed raw image */
+#define FORMAT_GZIP 3
+
+/* Raw image files written with stdio, the default */
+#define IOENGINE_STDIO 0
+/* Raw image files written through a memory mapping */
+#define IOENGINE_MMAP 1
+/* Raw image files written with pwrite() */
+#define IOENGINE_PWRITE 2
+/* Raw image files written through io_uring, with many writes in flight */
+#define IOENGINE_URING 3
+
+/* No access advice for mapped images, the default */
+#define MMAP_ADVICE_NORMAL 0
+/* Mapped image written sequentially */
+#define MMAP_ADVICE_SEQUENTIAL 1
+/* Mapped image pages dropped from the process once written */
+#define MMAP_ADVICE_DONTNEED 2
+
+/* Invalid usage */
+#define EC_INV_USAGE 1
+/* Invalid FAT type parameter exit code */
+#define EC_INV_FAT 2
+/* Invalid number of FATs exit code */
+#define EC_INV_FATCOPIES 3
+/* Invalid sectors per cluster exit code */
+#define EC_INV_SPC 4
+/* Invalid root directory entries exit code */
+#define EC_INV_ROOTDIR 5
+/* Invalid disk size exit code */
+#define EC_INV_SIZE 6
+/* Invalid disk chs exit code */
+#define EC_INV_CHS 7
+/* Invalid disk type exit code */
+#define EC_INV_TYPE 8
+/* File error exit code */
+#define EC_FILE_ERROR 9
+/* Invalid FAT size exit code */
+#define EC_INV_FATSIZE 10
+/* Invalid cluster count exit code */
+#define EC_INV_CLUSTERS 11
+/* Host directory copy exit code */
+#define EC_COPY_ERROR 12
+/* Invalid base image exit code */
+#define EC_INV_BASE 13
+/* Invalid image found by -check exit code */
+#define EC_INV_IMAGE 14
+
+/* Command line parsing phase */
+#define STATS_PARSE 0
+/* Planning phase, including the scan of the host files */
+#define STATS_PLAN 1
+/* Image file opening phase */
+#define STATS_OPEN 2
+/* Preallocation phase */
+#define STATS_ALLOC 3
+/* MBR, boot sector and FAT writing phase */
+#define STATS_METADATA 4
+/* Directory and file writing phase */
+#define STATS_FILES 5
+/* Image completion phase */
+#define STATS_FINISH 6
+/* Image file closing phase */
+#define STATS_CLOSE 7
+/* Number of phases */
+#define STATS_PHASES 8
+
+/* Hard Disk max cylinders */
+#define HD_CYL_MAX 1023
+/* Hard Disk max heads */
+#define HD_HEAD_MAX 65
+/* Hard Disk max sectors */
+#define HD_SECT_MAX 63
+/* Heads of LBA disks beyond 1023 cylinders */
+#define HD_LBA_HEADS 255
+/* Hard Disk media descriptor */
+#define HD_MDESC 0xF8
+
+/* FAT12 filesystem */
+#define FS_FAT12 12
+/* FAT16 filesystem */
+#define FS_FAT16 16
+/* FAT32 filesystem */
+#define FS_FAT32 32
+/* Largest -align value in bytes */
+#define FS_ALIGN_MAX 1048576L
+/* Length of an image cache key with its terminating null */
+#define SPEC_KEY_SIZE 17
+
+/*
+ * Program options.
+ */
+typedef struct {
+    const char *filename; /* Image filename */
+    const char *type;     /* Image type */
+    const char *label;    /* Image volume label */
+    int size;             /* Image size in MiB */
+    int c;                /* Image cylinders */
+    int h;                /* Image heads */
+    int s;                /* Image sectors */
+    int spc;              /* Image sectors per cluster */
+    int fatcopies;        /* Number of FAT copies of image */
+    int rootdir;          /* Number of root directory entries of image */
+    int fat;              /* Image filesystem type */
+    int flags;            /* Program flags */
+    const char *copydir;  /* Host directory to copy into the image */
+    const char *trace;    /* Access trace ordering the copied files */
+    const char *manifest; /* Manifest file with one image per line */
+    int threads;          /* Number of worker threads for the manifest */
+    int alloc;            /* Preallocation policy */
+    int format;           /* Output format */
+    const char *base;     /* Parent of a differencing VHD image */
+    int align;            /* Data area alignment in sectors, 0 if not aligned */
+    int ioengine;         /* I/O engine of raw image files */
+    int advice;           /* Access advice of mapped image files */
+    const char *bench;    /* Directories to run the benchmark in */
+    const char *check;    /* Existing image file to validate */
+    const char *grow;     /* Existing image file to grow to -size or -chs */
+    const char *sparsify; /* Existing image file to punch holes in */
+    int sync;             /* How image files are flushed to disk */
+    struct imgstats *stats; /* Statistics to fill, NULL if not collected */
+    unsigned long seed;   /* Serial and time stamp of reproducible images */
+    const char *cache;    /* Directory of cached images */
+    const char *plan;     /* Host directory to recommend a layout for */
+    const char *serve;    /* Unix socket to serve image requests on */
+} options;
+
+/*
+ * Timing and I/O statistics of the creation of an image.
+ */
+typedef struct imgstats {
+    double phase[STATS_PHASES]; /* Seconds spent in each phase */
+    double mark;                /* Start of the current phase */
+    long writes;                /* Write calls to the sink */
+    long seeks;                 /* Writes not following the previous one */
+    long bytes;                 /* Bytes written to the sink */
+    long next;                  /* Offset following the previous write */
+    long logical;               /* Image file size, -1 if unknown */
+    long allocated;             /* Image file allocated size, -1 if unknown */
+} imgstats;
+
+/*
+ * Region of the image written by a vectored write.
+ */
+typedef struct {
+    long off;        /* Image offset */
+    const void *buf; /* Data to write */
+    size_t len;      /* Data length in bytes */
+} imgextent;
+
+/*
+ * Image output. The writer issues writes in increasing offset order, so that
+ * sinks that cannot seek can fill the gaps with zeros.
+ */
+typedef struct imgsink {
+    /* Preallocates an image of the given size */
+    int (*alloc)(struct imgsink *sink, long size, int policy);
+    /* Writes a buffer at the given image offset */
+    int (*write)(struct imgsink *sink, long off, const void *buf, size_t len);
+    /* Writes extents in increasing offset order, NULL to write them one by one */
+    int (*writev)(struct imgsink *sink, const imgextent *ext, int count);
+    /* Completes an image of the given size */
+    int (*finish)(struct imgsink *sink, long size);
+    /* Frees the resources of the sink */
+    void (*release)(struct imgsink *sink);
+    FILE *fp;            /* Output file */
+    long pos;            /* Current output position, -1 if unknown */
+    void *data;          /* Format specific state */
+    char *zero;          /* Zero page for streams */
+    imgstats *stats;     /* Statistics to fill, can be NULL */
+    int seeded;          /* Non-zero if the image is reproducible */
+    unsigned long seed;  /* Serial and time stamp of reproducible images */
+#ifdef _POSIX_SOURCE
+    int fd;              /* Output file descriptor for streams */
+    int pipe;            /* Non-zero if the stream is a pipe */
+#endif
+} imgsink;
+
+/**
+ * Filesystem label.
+ */
+typedef struct {
+    const char *text; /* Label text */
+    size_t len;       /* Label text length */
+} label;
+
+/*
+ * Host file or directory to copy into the image.
+ */
+typedef struct fsnode {
+    struct fsnode *next;  /* Next entry of the same directory */
+    struct fsnode *child; /* First entry of a directory */
+    char *path;           /* Host path */
+    char name[11];        /* Short name, space padded */
+    int attr;             /* FAT attributes */
+    unsigned mdate;       /* FAT modification date */
+    unsigned mtime;       /* FAT modification time */
+    long size;            /* File size in bytes */
+    long cluster;         /* First cluster, 0 if no clusters are allocated */
+    long clusters;        /* Number of allocated clusters */
+    int entries;          /* Number of entries of a directory */
+    long htime;           /* Host modification time */
+    int traced;           /* Non-zero if the file is in the access trace */
+    struct fsnode *tnext; /* Next file of the access trace */
+} fsnode;
+
+/*
+ * Filesystem specification.
+ */
+typedef struct {
+    int type;       /* File system type */
+    int spc;        /* Sectors per cluster */
+    int rtent;      /* Root entries */
+    int mdesc;      /* Media descriptor */
+    int fatnum;     /* Number of FATs */
+    int rsvd;       /* Reserved sectors */
+    long fatsize;   /* Size of each FAT in sectors */
+    long voff;      /* Volume offset in sectors */
+    long vsize;     /* Volume size in sectors */
+    label *vlabel;  /* Volume label */
+    fsnode *root;   /* Host files to copy, can be NULL */
+    fsnode *trace;  /* Host files in first-access order, can be NULL */
+    unsigned char *fat; /* FAT built in memory, NULL if there are no files */
+    long fatused;   /* Number of FAT sectors in use */
+    long padding;   /* Sectors added to align the data area */
+    long next;      /* First free cluster */
+} fsspec;
+
+/*
+ * Image specification.
+ */
+typedef struct {
+    int cylinders; /* Disk cylinders */
+    int heads;     /* Disk heads */
+    int sectors;   /* Disk sectors */
+    int alloc;     /* Preallocation policy */
+    int format;    /* Output format */
+    int threads;   /* Number of output worker threads */
+    int ioengine;  /* I/O engine of raw image files */
+    int advice;    /* Access advice of mapped image files */
+    int msync;     /* Non-zero to msync() mapped image files */
+    int direct;    /* Non-zero to write raw image files with O_DIRECT */
+    int sync;      /* How image files are flushed to disk */
+    int seeded;    /* Non-zero if the image is reproducible */
+    unsigned long seed; /* Serial and time stamp of reproducible images */
+    int device;    /* Non-zero to clear an existing target in place */
+    imgstats *stats; /* Statistics to fill, can be NULL */
+    fsspec *fs;    /* Filesystem specification, can be NULL */
+} imgspec;
+
+/*
+ * Receives the data written by a callback sink, in increasing offset order.
+ * The regions that are never written are zeros. It is called a last time
+ * with a NULL buffer and the image size as offset. Returns non-zero on error.
+ */
+typedef int (*imgsink_fn)(void *ctx, long off, const void *buf, size_t len);
+
+/* Planner */
+void options_init(options *opts);
+int options_toimgspec(const options *opts, imgspec *img);
+int options_tofsspec(const options *opts, imgspec *img);
+int imgspec_plan(const options *opts, imgspec *img);
+void imgspec_free(imgspec *img);
+void imgspec_hash(const imgspec *img, char *key);
+int fstree_load(fsspec *fs, const char *path, const char *trace);
+void fstree_free(fsnode *node);
+
+/* Writer */
+int imgspec_write(const imgspec *img, imgsink *sink);
+int sink_write(imgsink *sink, long off, const void *buf, size_t len);
+int sink_writev(imgsink *sink, const imgextent *ext, int count);
+int image_build(const options *opts, imgsink *sink);
+int image_check(const char *filename);
+int image_grow(const char *filename, const options *opts);
+int image_sparsify(const char *filename, const options *opts);
+int image_plan(const char *path, const options *opts);
+int image_validate(const options *opts);
+int imglib_warm(void);
+
+/* Sinks */
+void imgsink_file(imgsink *sink, FILE *fp);
+int imgsink_stream(imgsink *sink, FILE *fp);
+int imgsink_memory(imgsink *sink, void *buf, long size);
+int imgsink_callback(imgsink *sink, imgsink_fn fn, void *ctx);
+int imgsink_vhd(imgsink *sink, FILE *fp, const imgspec *img);
+int imgsink_vhddiff(imgsink *sink, FILE *fp, const unsigned char *parent,
+                    const char *parentpath, const char *childpath);
+#ifdef _POSIX_SOURCE
+int imgsink_mmap(imgsink *sink, FILE *fp, int advice, int sync);
+int imgsink_direct(imgsink *sink, FILE *fp);
+int imgsink_pwrite(imgsink *sink, FILE *fp);
+int imgsink_device(imgsink *sink, FILE *fp);
+#endif
+#if defined(__linux__) && defined(HAVE_IO_URING)
+int imgsink_uring(imgsink *sink, FILE *fp);
+#endif
+#ifdef HAVE_ZLIB
+int imgsink_gzip(imgsink *sink, FILE *fp, int threads);
+#endif
+int imgsink_format(imgsink *sink, FILE *fp, const imgspec *img);
+
+/* Helpers */
+int cpu_count(void);
+double clock_monotonic(void);
+void imgstats_init(imgstats *stats);
+void imgstats_phase(imgstats *stats, int phase);
+unsigned long memgetbe(const void *src, int len);
+unsigned long memgetle(const void *src, int len);
+size_t memnonzero(const void *buf, size_t len);
+int memzero(const void *buf, size_t len);
+int vhd_readfooter(const char *path, unsigned char *footer);
+
+#endif
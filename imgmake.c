@@ -1,81 +1,94 @@
+#ifdef _POSIX_SOURCE
+/* POSIX.1-2001 is needed for threads */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#ifndef _XOPEN_SOURCE
+/* mkstemp() for the image cache */
+#define _XOPEN_SOURCE 600
+#endif
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
-#include <time.h>
+#include <ctype.h>
+#include <sys/stat.h>
 
 #ifdef _POSIX_SOURCE
 #include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 /* stricmp() is only available in MS systems */
 #define stricmp(x, y) strcasecmp(x, y)
 #endif
 
-/* Do not write filesystem information */
-#define OPTS_NOFS 0x1
-/* Force overwrite */
-#define OPTS_FORCE 0x2
-/* Create .BAT file */
-#define OPTS_BAT 0x4
-
-/* Invalid usage */
-#define EC_INV_USAGE 1
-/* Invalid FAT type parameter exit code */
-#define EC_INV_FAT 2
-/* Invalid number of FATs exit code */
-#define EC_INV_FATCOPIES 3
-/* Invalid sectors per cluster exit code */
-#define EC_INV_SPC 4
-/* Invalid root directory entries exit code */
-#define EC_INV_ROOTDIR 5
-/* Invalid disk size exit code */
-#define EC_INV_SIZE 6
-/* Invalid disk chs exit code */
-#define EC_INV_CHS 7
-/* Invalid disk type exit code */
-#define EC_INV_TYPE 8
-/* File error exit code */
-#define EC_FILE_ERROR 9
-/* Invalid FAT size exit code */
-#define EC_INV_FATSIZE 10
-/* Invalid cluster count exit code */
-#define EC_INV_CLUSTERS 11
-
-/* Hard Disk max cylinders */
-#define HD_CYL_MAX 1023
-/* Hard Disk max heads */
-#define HD_HEAD_MAX 65
-/* Hard Disk max sectors */
-#define HD_SECT_MAX 63
-/* Hard Disk media descriptor */
-#define HD_MDESC 0xF8
-
-/* FAT12 filesystem */
-#define FS_FAT12 12
-/* FAT16 filesystem */
-#define FS_FAT16 16
-/* Size of reserved area in sectors */
-#define FS_RSV_SECT 1
-
-/*
- * Examples message.
- */
+#ifdef __linux__
+/* FICLONE */
+#include <linux/fs.h>
+#endif
+
+#include "imglib.h"
+
+/* Maximum length of a manifest line */
+#define MF_LINE_MAX 4096
+/* Maximum number of options in a manifest line */
+#define MF_ARGS_MAX 64
+
+/* Image file created in the benchmark directories */
+#define BENCH_FILE "IMGBENCH.IMG"
+#ifdef __MSDOS__
+/* Separator of the benchmark directories, like in PATH */
+#define BENCH_PATH_SEP ";"
+#else
+#define BENCH_PATH_SEP ":"
+#endif
+
+/* Size of the blocks copied into the image cache, zero blocks become holes */
+#define CACHE_BLOCK_SIZE 65536
+
 const char *examples = "Some usage examples of IMGMAKE:\n\n"
 "  \033[32;1mIMGMAKE -t fd\033[0m                  - create a 1.44MB floppy image \033[33;1mIMGMAKE.IMG\033[0m\n"
 "  \033[32;1mIMGMAKE -t fd_1440 -force\033[0m      - force to create a floppy image \033[33;1mIMGMAKE.IMG\033[0m\n"
 "  \033[32;1mIMGMAKE dos.img -t fd_2880\033[0m     - create a 2.88MB floppy image named dos.img\n"
 "  \033[32;1mIMGMAKE c:\\disk.img -t hd -size 50\033[0m      - create a 50MB HDD image c:\\disk.img\n"
 "  \033[32;1mIMGMAKE c:\\disk.img -t hd_520 -nofs\033[0m     - create a 520MB blank HDD image\n"
-"  \033[32;1mIMGMAKE c:\\disk.img -t hd -chs 65,2,17\033[0m  - create a HDD image of specified CHS\n";
+"  \033[32;1mIMGMAKE c:\\disk.img -t hd -chs 65,2,17\033[0m  - create a HDD image of specified CHS\n"
+"  \033[32;1mIMGMAKE c:\\game.img -t hd -size 100 -copy c:\\game\033[0m - create a HDD image with the files of c:\\game\n"
+"  \033[32;1mIMGMAKE c:\\big.img -t hd -size 32768 -fs 32\033[0m - create a 32GB FAT32 HDD image\n"
+"  \033[32;1mIMGMAKE hd.img.gz -t hd_2gig -format gz\033[0m - create a compressed 2GB HDD image\n"
+"  \033[32;1mIMGMAKE c:\\disk.vhd -t hd_2gig -format vhd-dynamic\033[0m - create a 2GB dynamic VHD image\n"
+"  \033[32;1mIMGMAKE job.vhd -format vhd-diff -base c:\\disk.vhd\033[0m - create a VHD that only stores changes to disk.vhd\n"
+"  \033[32;1mIMGMAKE -manifest images.txt -force\033[0m   - create all the images listed in images.txt\n"
+"  \033[32;1mIMGMAKE -check c:\\disk.img\033[0m            - check the partition and FAT filesystem of disk.img\n"
+"  \033[32;1mIMGMAKE -grow c:\\disk.img -size 200\033[0m   - grow disk.img to 200MB keeping its files\n"
+"  \033[32;1mIMGMAKE -sparsify c:\\disk.img -zeros\033[0m  - free the host blocks of unused clusters\n"
+"  \033[32;1mIMGMAKE game.img -t hd -size 100 -plan c:\\game\033[0m - suggest the layout for c:\\game\n"
+"  \033[32;1mIMGMAKE os.img -t hd -size 64 -copy os -seed 1 -cache imgcache\033[0m - reuse identical images\n"
+"  \033[32;1mIMGMAKE -serve /run/imgmake.sock -force\033[0m - create the images requested on a socket\n"
+"  \033[32;1mIMGMAKE -validate -threads 4\033[0m        - check the layout of every possible image\n";
 
 /*
  * Usage message.
  */
 const char *usage = "Creates floppy or hard disk images.\n"
-"Usage: \033[34;1mIMGMAKE [-?] [file] [-t type] [[-size size] | [-chs geometry]] [-spc]\033[0m\n"
-"  \033[34;1m[-label label] [-nofs] [-bat] [-fs] [-fatcp] [-rootdir] [-force] [-examples]"
-"\033[0m\n"
+"Usage: \033[34;1mIMGMAKE [-?] [file | -o file] [-t type] [[-size size] | [-chs geometry]] [-spc]\033[0m\n"
+"  \033[34;1m[-label label] [-nofs] [-bat] [-fs] [-fatcp] [-rootdir] [-force]\n"
+"  [-copy dir [-trace file]] [-alloc policy] [-align size]\n"
+"  [-format format [-base file]] [-manifest file] [-threads n]\n"
+"  [-ioengine engine [-madvise advice] [-msync]] [-bench dirs]\n"
+"  [-sync mode] [-direct] [-stats json] [-check file]\n"
+"  [-grow file] [-sparsify file [-zeros]] [-plan dir] [-seed n] [-cache dir]\n"
+"  [-device] [-serve socket] [-validate] [-examples]\033[0m\n"
 "  file: Image file to create (or \033[33;1mIMGMAKE.IMG\033[0m if not set)\n"
+"  -o: Image file to create, same as file. Use - for standard output.\n"
 "  -t: Type of image.\n"
 "    \033[33;1mFloppy disk templates\033[0m (names resolve to floppy sizes in KB or fd=fd_1440):\n"
 "     fd_160 fd_180 fd_200 fd_320 fd_360 fd_400 fd_720 fd_1200 fd_1440 fd_2880\n"
@@ -84,138 +97,130 @@ const char *usage = "Creates floppy or hard disk images.\n"
 "     hd_1gig: 1GB image, hd_2gig: 2GB image\n"
 "     hd_st251: 40MB image, hd_st225: 20MB image (geometry from old drives)\n"
 "    \033[33;1mCustom hard disk images:\033[0m hd (requires -size or -chs)\n"
-"     -size: Size of a custom hard disk image in MB.\n"
-"     -chs: Disk geometry in c(1-1023),h(1-65),s(1-63).\n"
+"     -size: Size of a custom hard disk image in MB (3-2014, more with -fs 32).\n"
+"     -chs: Disk geometry in c(1-1023),h(1-65),s(1-63), or LBA disks with\n"
+"     more cylinders and up to 255 heads with -fs 32.\n"
 "  -nofs: Add this parameter if a blank image should be created.\n"
 "  -force: Force to overwrite the existing image file.\n"
 "  -bat: Create a .bat file with the IMGMOUNT command required for this image.\n"
-"  -fs: FAT filesystem type (12 or 16).\n"
+"  -fs: FAT filesystem type (12, 16 or 32). FAT32 is only used when set.\n"
 "  -spc: Sectors per cluster override. Must be a power of 2.\n"
 "  -fatcp: Override number of FAT table copies.\n"
 "  -label: Volume label (max 11 characters).\n"
 "  -rootdir: Size of root directory in entries.\n"
+"  -copy: Copy the contents of a host directory into the image.\n"
+"  -trace: Access trace of the copied files, one path per line, optionally\n"
+"     followed by the offset read. The files are placed first, contiguously,\n"
+"     in the order they are first read, so that loading them reads the image\n"
+"     sequentially.\n"
+"  -alloc: How the image file is preallocated: sparse (default), reserve\n"
+"     (allocate space without writing it) or full (fill with zeros).\n"
+"  -align: Align the partition and the data clusters to a host block size in\n"
+"     bytes, like 4k. Clusters are made at least as large, unless -spc is set.\n"
+"  -format: Image file format: raw (default), vhd-dynamic, vhd-diff or gz.\n"
+"  -base: Parent VHD image of a vhd-diff image, which takes its geometry.\n"
+"  -ioengine: How raw image files are written: stdio (default), mmap (map\n"
+"     the file and write the structures in place), pwrite, or io_uring (many\n"
+"     writes in flight, falls back to pwrite where not available).\n"
+"  -madvise: Access advice for mmap: normal (default), sequential or dontneed\n"
+"     (drop the pages from memory once written).\n"
+"  -msync: Flush mapped image files to disk before closing them.\n"
+"  -sync: How image and .BAT files are flushed to disk with their directory:\n"
+"     none (default), data (fdatasync) or full (fsync).\n"
+"  -direct: Write raw image files with O_DIRECT, bypassing the page cache.\n"
+"  -manifest: Create the images listed in a file, one per line with the same\n"
+"     options as the command line. Command line options apply to every image.\n"
+"  -threads: Number of images to create in parallel with -manifest, or of\n"
+"     compression threads for gz images.\n"
+"  -stats: Print the time spent in each phase and the I/O of the image, in\n"
+"     JSON.\n"
+"  -bench: Create every template and a range of -size images, sparse and\n"
+"     fully allocated, in each directory of a " BENCH_PATH_SEP "-separated list, and print\n"
+"     their timings and I/O as JSON lines. Other options apply to every image.\n"
+"  -check: Check the partition, boot sector, FATs and directories of an\n"
+"     existing FAT12, FAT16 or FAT32 image file instead of creating one.\n"
+"  -grow: Grow an existing hard disk image file in place to -size or -chs,\n"
+"     keeping its files.\n"
+"  -sparsify: Punch holes in an existing image file over the clusters that\n"
+"     are free in its FAT, so that they take no space on the host.\n"
+"  -zeros: With -sparsify, also punch holes over clusters in use that are all\n"
+"     zeros.\n"
+"  -plan: Recommend the FAT type, cluster size and root directory size that\n"
+"     waste the least space for the files of a host directory, with the\n"
+"     command line to create the image. FAT32 is only tried with -fs 32.\n"
+"  -seed: Make the image reproducible, stamping it with this number instead of\n"
+"     the current time. Defaults to SOURCE_DATE_EPOCH if it is set.\n"
+"  -device: Write the image in place onto an existing file, clearing it\n"
+"     instead of truncating it, as done for block devices. -t hd without -size\n"
+"     or -chs takes the size of the device.\n"
+"  -cache: Take the image from a cache directory if an identical one was\n"
+"     created before, or store it there. Requires -seed. Host files are\n"
+"     identified by path, size and modification time.\n"
+"  -serve: Create images on request over a Unix socket, on -threads threads.\n"
+"     Each line sent is a request with the same options as the command line,\n"
+"     on top of the server options, and gets the JSON line of -stats back.\n"
+"  -validate: Plan every template, -size and -chs with every filesystem option\n"
+"     on -threads threads, and check the layouts against the FAT and partition\n"
+"     rules, without creating any image.\n"
 "  \033[32;1m-examples: Show some usage examples.\033[0m\n";
 
 /*
- * Blank MBR with the FreeDOS bootstrap code.
- */
-const unsigned char mbr[] = {
-        0x33, 0xC0, 0x8E, 0xC0, 0x8E, 0xD8, 0x8E, 0xD0,
-        0xBC, 0x00, 0x7C, 0xFC, 0x8B, 0xF4, 0xBF, 0x00,
-        0x06, 0xB9, 0x00, 0x01, 0xF2, 0xA5, 0xEA, 0x67,
-        0x06, 0x00, 0x00, 0x8B, 0xD5, 0x58, 0xA2, 0x4F,
-        0x07, 0x3C, 0x35, 0x74, 0x23, 0xB4, 0x10, 0xF6,
-        0xE4, 0x05, 0xAE, 0x04, 0x8B, 0xF0, 0x80, 0x7C,
-        0x04, 0x00, 0x74, 0x44, 0x80, 0x7C, 0x04, 0x05,
-        0x74, 0x3E, 0xC6, 0x04, 0x80, 0xE8, 0xDA, 0x00,
-        0x8A, 0x74, 0x01, 0x8B, 0x4C, 0x02, 0xEB, 0x08,
-        0xE8, 0xCF, 0x00, 0xB9, 0x01, 0x00, 0x32, 0xD1,
-        0xBB, 0x00, 0x7C, 0xB8, 0x01, 0x02, 0xCD, 0x13,
-        0x72, 0x1E, 0x81, 0xBF, 0xFE, 0x01, 0x55, 0xAA,
-        0x75, 0x16, 0xEA, 0x00, 0x7C, 0x00, 0x00, 0x80,
-        0xFA, 0x81, 0x74, 0x02, 0xB2, 0x80, 0x8B, 0xEA,
-        0x42, 0x80, 0xF2, 0xB3, 0x88, 0x16, 0x41, 0x07,
-        0xBF, 0xBE, 0x07, 0xB9, 0x04, 0x00, 0xC6, 0x06,
-        0x34, 0x07, 0x31, 0x32, 0xF6, 0x88, 0x2D, 0x8A,
-        0x45, 0x04, 0x3C, 0x00, 0x74, 0x23, 0x3C, 0x05,
-        0x74, 0x1F, 0xFE, 0xC6, 0xBE, 0x31, 0x07, 0xE8,
-        0x71, 0x00, 0xBE, 0x4F, 0x07, 0x46, 0x46, 0x8B,
-        0x1C, 0x0A, 0xFF, 0x74, 0x05, 0x32, 0x7D, 0x04,
-        0x75, 0xF3, 0x8D, 0xB7, 0x7B, 0x07, 0xE8, 0x5A,
-        0x00, 0x83, 0xC7, 0x10, 0xFE, 0x06, 0x34, 0x07,
-        0xE2, 0xCB, 0x80, 0x3E, 0x75, 0x04, 0x02, 0x74,
-        0x0B, 0xBE, 0x42, 0x07, 0x0A, 0xF6, 0x75, 0x0A,
-        0xCD, 0x18, 0xEB, 0xAC, 0xBE, 0x31, 0x07, 0xE8,
-        0x39, 0x00, 0xE8, 0x36, 0x00, 0x32, 0xE4, 0xCD,
-        0x1A, 0x8B, 0xDA, 0x83, 0xC3, 0x60, 0xB4, 0x01,
-        0xCD, 0x16, 0xB4, 0x00, 0x75, 0x0B, 0xCD, 0x1A,
-        0x3B, 0xD3, 0x72, 0xF2, 0xA0, 0x4F, 0x07, 0xEB,
-        0x0A, 0xCD, 0x16, 0x8A, 0xC4, 0x3C, 0x1C, 0x74,
-        0xF3, 0x04, 0xF6, 0x3C, 0x31, 0x72, 0xD6, 0x3C,
-        0x35, 0x77, 0xD2, 0x50, 0xBE, 0x2F, 0x07, 0xBB,
-        0x1B, 0x06, 0x53, 0xFC, 0xAC, 0x50, 0x24, 0x7F,
-        0xB4, 0x0E, 0xCD, 0x10, 0x58, 0xA8, 0x80, 0x74,
-        0xF2, 0xC3, 0x56, 0xB8, 0x01, 0x03, 0xBB, 0x00,
-        0x06, 0xB9, 0x01, 0x00, 0x32, 0xF6, 0xCD, 0x13,
-        0x5E, 0xC6, 0x06, 0x4F, 0x07, 0x3F, 0xC3, 0x0D,
-        0x8A, 0x0D, 0x0A, 0x46, 0x35, 0x20, 0x2E, 0x20,
-        0x2E, 0x20, 0x2E, 0xA0, 0x64, 0x69, 0x73, 0x6B,
-        0x20, 0x32, 0x0D, 0x0A, 0x0A, 0x44, 0x65, 0x66,
-        0x61, 0x75, 0x6C, 0x74, 0x3A, 0x20, 0x46, 0x31,
-        0xA0, 0x00, 0x01, 0x00, 0x04, 0x00, 0x06, 0x03,
-        0x07, 0x07, 0x0A, 0x0A, 0x63, 0x0E, 0x64, 0x0E,
-        0x65, 0x14, 0x80, 0x19, 0x81, 0x19, 0x82, 0x19,
-        0x83, 0x1E, 0x93, 0x24, 0xA5, 0x2B, 0x9F, 0x2F,
-        0x75, 0x33, 0x52, 0x33, 0xDB, 0x36, 0x40, 0x3B,
-        0xF2, 0x41, 0x00, 0x44, 0x6F, 0xF3, 0x48, 0x70,
-        0x66, 0xF3, 0x4F, 0x73, 0xB2, 0x55, 0x6E, 0x69,
-        0xF8, 0x4E, 0x6F, 0x76, 0x65, 0x6C, 0xEC, 0x4D,
-        0x69, 0x6E, 0x69, 0xF8, 0x4C, 0x69, 0x6E, 0x75,
-        0xF8, 0x41, 0x6D, 0x6F, 0x65, 0x62, 0xE1, 0x46,
-        0x72, 0x65, 0x65, 0x42, 0x53, 0xC4, 0x42, 0x53,
-        0x44, 0xE9, 0x50, 0x63, 0x69, 0xF8, 0x43, 0x70,
-        0xED, 0x56, 0x65, 0x6E, 0x69, 0xF8, 0x44, 0x6F,
-        0x73, 0x73, 0x65, 0xE3, 0x3F, 0xBF, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x55, 0xAA
+ * Names of the statistics phases in JSON.
+ */
+const char *stats_names[] = {
+        "parse", "plan", "open", "alloc", "metadata", "files", "finish", "close"
 };
 
 /*
- * Program options.
+ * Image templates created by the benchmark, as in options_toimgspec().
  */
-typedef struct {
-    const char *filename; /* Image filename */
-    const char *type;     /* Image type */
-    const char *label;    /* Image volume label */
-    int size;             /* Image size in MiB */
-    int c;                /* Image cylinders */
-    int h;                /* Image heads */
-    int s;                /* Image sectors */
-    int spc;              /* Image sectors per cluster */
-    int fatcopies;        /* Number of FAT copies of image */
-    int rootdir;          /* Number of root directory entries of image */
-    int fat;              /* Image filesystem type */
-    int flags;            /* Program flags */
-} options;
-
-/**
- * Filesystem label.
+const char *bench_types[] = {
+        "fd_160", "fd_180", "fd_200", "fd_320", "fd_360", "fd_400", "fd_720",
+        "fd_1200", "fd_1440", "fd_2880", "hd_250", "hd_520", "hd_1gig",
+        "hd_2gig", "hd_st251", "hd_st225", NULL
+};
+
+/*
+ * Custom hard disk sizes in MiB created by the benchmark.
+ */
+const int bench_sizes[] = {3, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2014, 0};
+
+/*
+ * Image of a manifest file.
  */
 typedef struct {
-    const char *text; /* Label text */
-    size_t len;       /* Label text length */
-} label;
+    options opts;      /* Image options */
+    char *line;        /* Manifest line the options point into */
+    const char **argv; /* Manifest line arguments */
+    int lineno;        /* Manifest line number */
+    int rc;            /* Exit code of the image creation or parsing */
+} mfentry;
 
 /*
- * Filesystem specification.
+ * Manifest file, shared by the worker threads.
  */
 typedef struct {
-    int type;       /* File system type */
-    int spc;        /* Sectors per cluster */
-    int rtent;      /* Root entries */
-    int mdesc;      /* Media descriptor */
-    int fatnum;     /* Number of FATs */
-    long fatsize;   /* Size of each FAT in sectors */
-    long voff;      /* Volume offset in sectors */
-    long vsize;     /* Volume size in sectors */
-    label *vlabel;  /* Volume label */
-} fsspec;
+    mfentry *entries;      /* Images to create */
+    int count;             /* Number of images */
+    int next;              /* Next image to create */
+    int done;              /* Number of images processed */
+    int failed;            /* Number of images that failed */
+#ifdef _POSIX_SOURCE
+    pthread_mutex_t lock;  /* Protects next, done, failed and the output */
+#endif
+} manifest;
 
+#ifdef _POSIX_SOURCE
 /*
- * Image specification.
+ * Image server, shared by the worker threads.
  */
 typedef struct {
-    int cylinders; /* Disk cylinders */
-    int heads;     /* Disk heads */
-    int sectors;   /* Disk sectors */
-    fsspec *fs;    /* Filesystem specification, can be NULL */
-} imgspec;
+    const options *defaults; /* Options every request starts from */
+    int fd;                  /* Listening socket */
+    long served;             /* Number of requests served */
+    pthread_mutex_t lock;    /* Protects served and the output */
+} server;
+#endif
 
 /*
  * Alphanumeric to integer with error checking.
@@ -224,6 +229,9 @@ int atois(const char *str, int *val) {
     char *rest;
     long conv;
 
+    if (str == NULL)
+        return 1;
+
     errno = 0;
     conv = strtol(str, &rest, 10);
     if (errno == ERANGE || *rest != '\0' || str == rest) {
@@ -240,65 +248,145 @@ int atois(const char *str, int *val) {
 }
 
 /*
- * Copies a word (2 bytes) into the destination memory address.
+ * Alphanumeric size in bytes, with an optional k or m suffix, to long with
+ * error checking.
+ */
+int atosize(const char *str, long *val) {
+    char *rest;
+
+    if (str == NULL)
+        return 1;
+
+    errno = 0;
+    *val = strtol(str, &rest, 10);
+    if (errno == ERANGE || str == rest || *val < 0L)
+        return 1;
+
+    if ((*rest == 'k' || *rest == 'K') && *val <= 0x1FFFFFL) {
+        *val <<= 10;
+        rest++;
+    } else if ((*rest == 'm' || *rest == 'M') && *val <= 0x7FFL) {
+        *val <<= 20;
+        rest++;
+    }
+
+    return *rest != '\0';
+}
+
+/*
+ * Alphanumeric seed to a 32-bit unsigned number with error checking.
  */
-void *memcpyw(void *dest, int word) {
-    ((char *) dest)[0] = (char) (word & 0x00FF);
-    ((char *) dest)[1] = (char) ((word & 0xFF00) >> 8);
-    return dest;
+int atoseed(const char *str, unsigned long *val) {
+    char *rest;
+
+    if (str == NULL || !isdigit((unsigned char) *str))
+        return 1;
+
+    errno = 0;
+    *val = strtoul(str, &rest, 10);
+    return errno == ERANGE || *rest != '\0' || *val > 0xFFFFFFFFUL;
 }
 
 /*
- * Copies a double word (4 bytes) into the destination memory address.
+ * Next comma separated field of a value, which is split in place. Unlike
+ * strtok(), no state is kept, so that requests can be parsed in parallel.
  */
-void *memcpydw(void *dest, long dword) {
-    ((char *) dest)[0] = (char) (dword & 0x000000FFL);
-    ((char *) dest)[1] = (char) ((dword & 0x0000FF00L) >> 8);
-    ((char *) dest)[2] = (char) ((dword & 0x00FF0000L) >> 16);
-    ((char *) dest)[3] = (char) ((dword & 0xFF000000L) >> 24);
-    return dest;
+char *field_next(char **rest) {
+    char *field = *rest, *comma;
+
+    if (field == NULL)
+        return NULL;
+    if ((comma = strchr(field, ',')) != NULL)
+        *comma++ = '\0';
+    *rest = comma;
+    return field;
 }
 
-void options_parse(options *opts, const int argc, const char **argv) {
+/*
+ * Options followed by a value.
+ */
+const char *valued_opts[] = {
+    "-t", "-size", "-chs", "-spc", "-fs", "-fatcopies", "-rootdir", "-label", "-o",
+    "-copy", "-trace", "-alloc", "-format", "-align", "-base", "-ioengine", "-madvise",
+    "-sync", "-manifest", "-stats", "-bench", "-check", "-grow", "-sparsify", "-plan",
+    "-serve", "-seed", "-cache", "-threads", NULL
+};
+
+/*
+ * Checks whether an option is followed by a value.
+ */
+int option_valued(const char *opt) {
     int i;
-    char val[16], *tok;
+
+    for (i = 0; valued_opts[i] != NULL; i++) {
+        if (stricmp(opt, valued_opts[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Checks whether the options ask for something else than creating an image,
+ * which manifest lines and requests cannot do.
+ */
+int options_notimage(const options *opts) {
+    return opts->serve != NULL || opts->manifest != NULL || opts->bench != NULL ||
+           opts->check != NULL || opts->grow != NULL || opts->sparsify != NULL ||
+           opts->plan != NULL || (opts->flags & OPTS_VALIDATE);
+}
+
+/*
+ * Parses the command line options. Returns 0 on success, -1 if a help screen
+ * was shown or the exit code on error.
+ */
+int options_parse(options *opts, const int argc, const char **argv) {
+    int i;
+    long lval;
+    char val[16], *tok, *rest;
     /* skip the first argument, it is the filename */
     for (i = 1; i < argc; i++) {
         errno = 0;
+        /* the value may be missing at the end of a manifest line or request */
+        if (i + 1 >= argc && option_valued(argv[i])) {
+            fprintf(stderr, "Invalid %s option. It needs a value.", argv[i]);
+            return EC_INV_USAGE;
+        }
         if (stricmp(argv[i], "-?") == 0) {
             fputs(usage, stdout);
-            exit(0);
+            return -1;
         } else if (stricmp(argv[i], "-examples") == 0) {
             fputs(examples, stdout);
-            exit(0);
+            return -1;
         } else if (stricmp(argv[i], "-t") == 0) {
             opts->type = argv[++i];
         } else if (stricmp(argv[i], "-size") == 0) {
             if (atois(argv[++i], &opts->size) != 0) {
                 fputs("Invalid -size option. Unrecognized value format.", stderr);
-                exit(EC_INV_SIZE);
+                return EC_INV_SIZE;
             }
         } else if (stricmp(argv[i], "-chs") == 0) {
-            strncpy(val, argv[++i], sizeof(val));
-            tok = strtok(val, ",");
+            strncpy(val, argv[++i], sizeof(val) - 1);
+            val[sizeof(val) - 1] = '\0';
+            rest = val;
+            tok = field_next(&rest);
             if (tok == NULL || atois(tok, &opts->c) != 0) {
                 fputs("Invalid -chs option. Unrecognized value format.", stderr);
-                exit(EC_INV_CHS);
+                return EC_INV_CHS;
             }
-            tok = strtok(NULL, ",");
+            tok = field_next(&rest);
             if (tok == NULL || atois(tok, &opts->h) != 0) {
                 fputs("Invalid -chs option. Unrecognized value format.", stderr);
-                exit(EC_INV_CHS);
+                return EC_INV_CHS;
             }
-            tok = strtok(NULL, ",");
+            tok = field_next(&rest);
             if (tok == NULL || atois(tok, &opts->s) != 0) {
                 fputs("Invalid -chs option. Unrecognized value format.", stderr);
-                exit(EC_INV_CHS);
+                return EC_INV_CHS;
             }
         } else if (stricmp(argv[i], "-spc") == 0) {
             if (atois(argv[++i], &opts->spc) != 0) {
                 fputs("Invalid -spc option. Unrecognized value format.", stderr);
-                exit(EC_INV_SPC);
+                return EC_INV_SPC;
             }
         } else if (stricmp(argv[i], "-nofs") == 0) {
             opts->flags |= OPTS_NOFS;
@@ -307,565 +395,1432 @@ void options_parse(options *opts, const int argc, const char **argv) {
         } else if (stricmp(argv[i], "-fs") == 0) {
             if (atois(argv[++i], &opts->fat) != 0) {
                 fputs("Invalid -fs option. Unrecognized value format.", stderr);
-                exit(EC_INV_FAT);
+                return EC_INV_FAT;
             }
         } else if (stricmp(argv[i], "-fatcopies") == 0) {
             if (atois(argv[++i], &opts->fatcopies) != 0) {
                 fputs("Invalid -fatcopies option. Unrecognized value format.", stderr);
-                exit(EC_INV_FATCOPIES);
+                return EC_INV_FATCOPIES;
             }
         } else if (stricmp(argv[i], "-rootdir") == 0) {
             if (atois(argv[++i], &opts->rootdir) != 0) {
                 fputs("Invalid -rootdir option. Unrecognized value format.", stderr);
-                exit(EC_INV_ROOTDIR);
+                return EC_INV_ROOTDIR;
             }
         } else if (stricmp(argv[i], "-force") == 0) {
             opts->flags |= OPTS_FORCE;
         } else if (stricmp(argv[i], "-label") == 0) {
             opts->label = argv[++i];
+        } else if (stricmp(argv[i], "-o") == 0) {
+            opts->filename = argv[++i];
+        } else if (stricmp(argv[i], "-copy") == 0) {
+            opts->copydir = argv[++i];
+        } else if (stricmp(argv[i], "-trace") == 0) {
+            opts->trace = argv[++i];
+        } else if (stricmp(argv[i], "-alloc") == 0) {
+            if (++i < argc && stricmp(argv[i], "sparse") == 0) {
+                opts->alloc = ALLOC_SPARSE;
+            } else if (i < argc && stricmp(argv[i], "reserve") == 0) {
+                opts->alloc = ALLOC_RESERVE;
+            } else if (i < argc && stricmp(argv[i], "full") == 0) {
+                opts->alloc = ALLOC_FULL;
+            } else {
+                fputs("Invalid -alloc option. Must be sparse, reserve or full.", stderr);
+                return EC_INV_USAGE;
+            }
+        } else if (stricmp(argv[i], "-format") == 0) {
+            if (++i < argc && stricmp(argv[i], "raw") == 0) {
+                opts->format = FORMAT_RAW;
+            } else if (i < argc && stricmp(argv[i], "vhd-dynamic") == 0) {
+                opts->format = FORMAT_VHD_DYNAMIC;
+            } else if (i < argc && stricmp(argv[i], "vhd-diff") == 0) {
+                opts->format = FORMAT_VHD_DIFF;
+            } else if (i < argc && stricmp(argv[i], "gz") == 0) {
+#ifdef HAVE_ZLIB
+                opts->format = FORMAT_GZIP;
+#else
+                fputs("Invalid -format option. This build has no gzip support.", stderr);
+                return EC_INV_USAGE;
+#endif
+            } else {
+                fputs("Invalid -format option. Must be raw, vhd-dynamic, vhd-diff or gz.", stderr);
+                return EC_INV_USAGE;
+            }
+        } else if (stricmp(argv[i], "-align") == 0) {
+            if (atosize(argv[++i], &lval) != 0 || lval < 512L || lval > FS_ALIGN_MAX ||
+                (lval & (lval - 1L)) != 0) {
+                fputs("Invalid -align option. Must be a power of 2 between 512 and 1m.", stderr);
+                return EC_INV_USAGE;
+            }
+            opts->align = (int) (lval / 512L);
+        } else if (stricmp(argv[i], "-base") == 0) {
+            opts->base = argv[++i];
+        } else if (stricmp(argv[i], "-ioengine") == 0) {
+            if (++i < argc && stricmp(argv[i], "stdio") == 0) {
+                opts->ioengine = IOENGINE_STDIO;
+            } else if (i < argc && stricmp(argv[i], "mmap") == 0) {
+#ifdef _POSIX_SOURCE
+                opts->ioengine = IOENGINE_MMAP;
+#else
+                fputs("Invalid -ioengine option. This build has no mmap support.", stderr);
+                return EC_INV_USAGE;
+#endif
+            } else if (i < argc && stricmp(argv[i], "pwrite") == 0) {
+#ifdef _POSIX_SOURCE
+                opts->ioengine = IOENGINE_PWRITE;
+#else
+                fputs("Invalid -ioengine option. This build has no pwrite support.", stderr);
+                return EC_INV_USAGE;
+#endif
+            } else if (i < argc && stricmp(argv[i], "io_uring") == 0) {
+#ifdef _POSIX_SOURCE
+                opts->ioengine = IOENGINE_URING;
+#else
+                fputs("Invalid -ioengine option. This build has no io_uring support.", stderr);
+                return EC_INV_USAGE;
+#endif
+            } else {
+                fputs("Invalid -ioengine option. Must be stdio, mmap, pwrite or io_uring.", stderr);
+                return EC_INV_USAGE;
+            }
+        } else if (stricmp(argv[i], "-madvise") == 0) {
+            if (++i < argc && stricmp(argv[i], "normal") == 0) {
+                opts->advice = MMAP_ADVICE_NORMAL;
+            } else if (i < argc && stricmp(argv[i], "sequential") == 0) {
+                opts->advice = MMAP_ADVICE_SEQUENTIAL;
+            } else if (i < argc && stricmp(argv[i], "dontneed") == 0) {
+                opts->advice = MMAP_ADVICE_DONTNEED;
+            } else {
+                fputs("Invalid -madvise option. Must be normal, sequential or dontneed.", stderr);
+                return EC_INV_USAGE;
+            }
+        } else if (stricmp(argv[i], "-sync") == 0) {
+            if (++i < argc && stricmp(argv[i], "none") == 0) {
+                opts->sync = SYNC_NONE;
+            } else if (i < argc && stricmp(argv[i], "data") == 0) {
+                opts->sync = SYNC_DATA;
+            } else if (i < argc && stricmp(argv[i], "full") == 0) {
+                opts->sync = SYNC_FULL;
+            } else {
+                fputs("Invalid -sync option. Must be none, data or full.", stderr);
+                return EC_INV_USAGE;
+            }
+        } else if (stricmp(argv[i], "-direct") == 0) {
+#ifdef _POSIX_SOURCE
+            opts->flags |= OPTS_DIRECT;
+#else
+            fputs("Invalid -direct option. This build has no direct I/O support.", stderr);
+            return EC_INV_USAGE;
+#endif
+        } else if (stricmp(argv[i], "-msync") == 0) {
+            opts->flags |= OPTS_MSYNC;
+        } else if (stricmp(argv[i], "-manifest") == 0) {
+            opts->manifest = argv[++i];
+        } else if (stricmp(argv[i], "-stats") == 0) {
+            if (++i < argc && stricmp(argv[i], "json") == 0) {
+                opts->flags |= OPTS_STATS;
+            } else {
+                fputs("Invalid -stats option. Must be json.", stderr);
+                return EC_INV_USAGE;
+            }
+        } else if (stricmp(argv[i], "-bench") == 0) {
+            opts->bench = argv[++i];
+        } else if (stricmp(argv[i], "-check") == 0) {
+            opts->check = argv[++i];
+        } else if (stricmp(argv[i], "-grow") == 0) {
+            opts->grow = argv[++i];
+        } else if (stricmp(argv[i], "-sparsify") == 0) {
+            opts->sparsify = argv[++i];
+        } else if (stricmp(argv[i], "-zeros") == 0) {
+            opts->flags |= OPTS_ZEROS;
+        } else if (stricmp(argv[i], "-plan") == 0) {
+            opts->plan = argv[++i];
+        } else if (stricmp(argv[i], "-validate") == 0) {
+            opts->flags |= OPTS_VALIDATE;
+        } else if (stricmp(argv[i], "-serve") == 0) {
+#ifdef _POSIX_SOURCE
+            opts->serve = argv[++i];
+#else
+            fputs("Invalid -serve option. This build has no server support.", stderr);
+            return EC_INV_USAGE;
+#endif
+        } else if (stricmp(argv[i], "-device") == 0) {
+#ifdef _POSIX_SOURCE
+            opts->flags |= OPTS_DEVICE;
+#else
+            fputs("Invalid -device option. This build has no device support.", stderr);
+            return EC_INV_USAGE;
+#endif
+        } else if (stricmp(argv[i], "-seed") == 0) {
+            if (++i >= argc || atoseed(argv[i], &opts->seed) != 0) {
+                fputs("Invalid -seed option. Must be a number.", stderr);
+                return EC_INV_USAGE;
+            }
+            opts->flags |= OPTS_SEED;
+        } else if (stricmp(argv[i], "-cache") == 0) {
+#ifdef _POSIX_SOURCE
+            opts->cache = argv[++i];
+#else
+            fputs("Invalid -cache option. This build has no image cache support.", stderr);
+            return EC_INV_USAGE;
+#endif
+        } else if (stricmp(argv[i], "-threads") == 0) {
+            if (atois(argv[++i], &opts->threads) != 0 || opts->threads < 1) {
+                fputs("Invalid -threads option. Must be a positive number.", stderr);
+                return EC_INV_USAGE;
+            }
         } else if (opts->filename == NULL) {
             opts->filename = argv[i];
         };
     }
+
+    return 0;
 }
 
-void options_tocustomchs(const options *opts, imgspec *img) {
-    /* prioritize -size when both -size and -chs are set */
-    if (opts->size >= 0) {
-        /*
-         * chs = size in B / 512
-         *     = size in MiB * 1024 * 1024 / 512
-         *     = size in MiB * 2048
-         */
-        long target_chs = opts->size * 2048L;
-        int eff_size;
+/*
+ * Flushes the directory entry of a file to disk.
+ */
+int dir_sync(const char *filename) {
+#ifdef _POSIX_SOURCE
+    const char *slash = strrchr(filename, '/');
+    char *dir;
+    int fd, rc;
 
-        if (opts->size < 3 || opts->size > 2014) {
-            fputs("Invalid -size option. Must be between 3 and 2014 MiB.", stderr);
-            exit(EC_INV_SIZE);
-        }
+    if (slash == NULL)
+        return dir_sync("./");
 
-        /* Figure out good CHS values */
-        img->heads = 2;
-        while ((long) img->heads * HD_SECT_MAX * HD_CYL_MAX < target_chs)
-            img->heads <<= 1;
-        if (img->heads > HD_HEAD_MAX)
-            img->heads = HD_HEAD_MAX;
-
-        img->sectors = 8;
-        while ((long) img->heads * img->sectors * HD_CYL_MAX < target_chs)
-            img->sectors <<= 1;
-        if (img->sectors > HD_SECT_MAX)
-            img->sectors = HD_SECT_MAX;
-
-        img->cylinders = (int) (target_chs / (img->heads * img->sectors));
-        if (img->cylinders > HD_CYL_MAX)
-            img->cylinders = HD_CYL_MAX;
-
-        eff_size = (int) ((long) img->cylinders * img->heads * img->sectors /
-                          2048L);
-        if (opts->size != eff_size) {
-            fprintf(stderr, "Warning: effective image size will be %d MiB.\n", eff_size);
-        }
+    dir = malloc((size_t) (slash - filename) + 2);
+    if (dir == NULL)
+        return 1;
+    /* keeps the slash of the root directory */
+    memcpy(dir, filename, (size_t) (slash - filename) + 1);
+    dir[slash == filename ? 1 : slash - filename] = '\0';
 
-    } else if (opts->c >= 0 && opts->h >= 0 && opts->s >= 0) {
-        if (opts->c > HD_CYL_MAX) {
-            fprintf(stderr,"Invalid -chs option. Cylinders must be between 1 and %d.", HD_CYL_MAX);
-            exit(EC_INV_CHS);
-        }
-        if (opts->h > HD_HEAD_MAX) {
-            fprintf(stderr, "Invalid -chs option. Heads must be between 1 and %d.", HD_HEAD_MAX);
-            exit(EC_INV_CHS);
-        }
-        if (opts->s > HD_SECT_MAX) {
-            fprintf(stderr, "Invalid -chs option. Sectors must be between 1 and %d.", HD_SECT_MAX);
-            exit(EC_INV_CHS);
-        }
-        if (opts->c * opts->h * opts->s < 6144L /* 3 MiB */) {
-            fputs("Invalid -chs option. The provided geometry specifies a disk that is smaller than 3 MiB.", stderr);
-            exit(EC_INV_CHS);
-        }
-        img->cylinders = opts->c;
-        img->heads = opts->h;
-        img->sectors = opts->s;
-    } else {
-        fputs("You must specify a valid -size or -chs when using type \"hd\".", stderr);
-        exit(EC_INV_TYPE);
-    }
-}
-
-void options_tofsspec(const options *opts, imgspec *img) {
-    if (opts->flags & OPTS_NOFS) {
-        img->fs = NULL;
-    } else {
-        const long chs = (long) img->cylinders * img->heads * img->sectors;
-        long clusters, max_clusters, min_clusters;
-        long eff_vsize;
-        fsspec *fs = img->fs;
-
-        /* copy the label even if it is NULL */
-        if (opts->label == NULL) {
-            fs->vlabel = NULL;
-        } else {
-            fs->vlabel->text = opts->label;
-            fs->vlabel->len = strlen(opts->label);
+    fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd == -1)
+        return 1;
+    rc = fsync(fd) != 0;
+    close(fd);
+    return rc;
+#else
+    (void) filename;
+    return 0;
+#endif
+}
 
-            if (fs->vlabel->len > 11) {
-                fputs("Warning: provided label is too long, truncating to 11 characters.", stderr);
-                fs->vlabel->len = 11;
-            }
-        }
+/*
+ * Closes a file, flushing it to disk with its directory entry according to
+ * the sync mode.
+ */
+int file_close(FILE *fp, const char *filename, int sync) {
+    int rc = fflush(fp) != 0;
 
-        /* volume offset and size (in sectors) */
-        fs->voff = fs->mdesc == HD_MDESC ? img->sectors : 0L;
-        fs->vsize = chs - fs->voff;
+#ifdef _POSIX_SOURCE
+    if (rc == 0 && sync == SYNC_DATA)
+        rc = fdatasync(fileno(fp)) != 0;
+    else if (rc == 0 && sync == SYNC_FULL)
+        rc = fsync(fileno(fp)) != 0;
+#endif
+    if (fclose(fp) != 0)
+        rc = 1;
 
-        if (opts->fat >= 0) {
-            if (opts->fat != FS_FAT12 && opts->fat != FS_FAT16) {
-                fputs("Invalid -fat option. Must be 12 or 16.", stderr);
-                exit(EC_INV_FAT);
-            }
-            if (opts->fat == FS_FAT12 && fs->vsize >= 65536L /* 32 MiB */) {
-                fputs("Invalid -fat option. Disk is too large for FAT12.", stderr);
-                exit(EC_INV_FAT);
-            }
-            fs->type = opts->fat;
-        } else {
-            fs->type = fs->vsize >= 24576L /* 12 MiB */ ? FS_FAT16 : FS_FAT12;
-        }
+    /* a new file is only durable once its directory entry is */
+    if (rc == 0 && sync != SYNC_NONE)
+        rc = dir_sync(filename);
+    return rc;
+}
 
-        if (fs->type == FS_FAT12) {
-            max_clusters = 0x0FF6L;
-            min_clusters = 0L;
-        } else {
-            max_clusters = 0xFFF6L;
-            min_clusters = 0x0FF6L;
-        }
+/*
+ * Writes a .BAT file with the IMGMOUNT command for the image.
+ */
+int image_writebat(const imgspec *img, int mdesc, const char *filename) {
+    const size_t len = strlen(filename);
+    char *bat;
+    FILE *fp;
+
+    bat = malloc(len + 5);
+    if (bat == NULL) {
+        fputs("Not enough memory to write the .BAT file.\n", stderr);
+        return EC_FILE_ERROR;
+    }
 
-        if (opts->fatcopies >= 0) {
-            if (opts->fatcopies < 1 || opts->fatcopies > 4) {
-                fputs("Invalid -fatcopies option, must be between 1 and 4.", stderr);
-                exit(EC_INV_FATCOPIES);
-            }
-            fs->fatnum = opts->fatcopies;
-        } else {
-            fs->fatnum = 2;
-        }
+    /* replace the extension, if any, with .BAT */
+    strcpy(bat, filename);
+    strcpy(bat + (len > 3 && bat[len - 4] == '.' ? len - 4 : len), ".BAT");
 
-        if (opts->spc >= 0) {
-            if (opts->spc < 1 || opts->spc > 128) {
-                fputs("Invalid -spc option, must be between 1 and 128.", stderr);
-                exit(EC_INV_SPC);
-            }
-            if ((opts->spc & (opts->spc - 1)) != 0) {
-                fputs("Invalid -spc option, must be a power of 2.", stderr);
-                exit(EC_INV_SPC);
-            }
-            fs->spc = opts->spc;
-        } else {
-            if (chs >= 1048576L /* 512 MiB */)
-                fs->spc = 4;
-            else if (chs >= 131072L /* 64 MiB */)
-                fs->spc = 2;
-            else
-                fs->spc = 1;
-        }
+    fp = fopen(bat, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "The file \"%s\" cannot be opened for writing.\n", bat);
+        free(bat);
+        return EC_FILE_ERROR;
+    }
 
-        /* SPC just enough that we don't use more clusters than possible */
-        while (fs->vsize >= fs->spc * (max_clusters - 2L) && fs->spc < 128)
-            fs->spc <<= 1;
+    if (fprintf(fp, "imgmount %c %s -size 512,%d,%d,%d\r\n",
+                mdesc == HD_MDESC ? 'c' : 'a', filename,
+                img->cylinders, img->heads, img->sectors) < 0) {
+        perror("Unable to write to .BAT file");
+        fclose(fp);
+        remove(bat);
+        free(bat);
+        return EC_FILE_ERROR;
+    }
 
-        fs->fatsize = fs->type == FS_FAT12
-                      ? ((fs->vsize / fs->spc + 1L) * 3L / 2L + 511L) / 512L
-                      : (fs->vsize / fs->spc * 2L + 511L) / 512L;
+    if (file_close(fp, bat, img->sync) != 0) {
+        perror("Unable to flush .BAT file to disk");
+        free(bat);
+        return EC_FILE_ERROR;
+    }
+    free(bat);
+    return 0;
+}
 
-        if (fs->fatsize > 65536L) {
-            fputs("Error: Generated filesystem has more than 64K sectors per FAT.\n", stderr);
-            exit(EC_INV_FATSIZE);
-        }
+/*
+ * Records the logical and allocated sizes of a regular image file.
+ */
+void image_filestats(imgstats *stats, FILE *fp) {
+    struct stat st;
 
-        /*
-         * Effective volume size in sectors without:
-         * - Reserved sectors (always 1)
-         * - FAT copies area
-         * - Root filesystem entries area
-         */
-        eff_vsize = fs->vsize - FS_RSV_SECT - (fs->fatsize * fs->fatnum)
-                    - ((fs->rtent * 32L) + 511L) / 512L;
-        clusters = eff_vsize / fs->spc + 2L;
-
-        if (clusters < min_clusters) {
-            fputs("Error: Generated filesystem has too few clusters given the parameters.\n", stderr);
-            exit(EC_INV_CLUSTERS);
-        }
+    if (stats == NULL || fflush(fp) != 0 || fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        return;
 
-        if (clusters > max_clusters) {
-            fputs("Error: Cluster count is too high given the volume size.\n", stderr);
-            exit(EC_INV_CLUSTERS);
-        }
+    stats->logical = (long) st.st_size;
+#ifdef _POSIX_SOURCE
+    stats->allocated = (long) st.st_blocks * 512L;
+#endif
+}
 
-        /* if not overridden here, rtent should be already set */
-        if (opts->rootdir >= 0) {
-            if (opts->rootdir < 1 || opts->rootdir > 4096) {
-                fputs("Invalid -rootdir option, must be between 1 and 4096.", stderr);
-                exit(EC_INV_ROOTDIR);
-            }
-            img->fs->rtent = opts->rootdir;
-        }
+/*
+ * Prints the statistics of an image as a JSON object.
+ */
+void stats_print(const imgstats *stats, int rc, FILE *fp) {
+    int i;
+
+    fprintf(fp, "{\"rc\": %d, \"phases\": {", rc);
+    for (i = 0; i < STATS_PHASES; i++)
+        fprintf(fp, "%s\"%s\": %.6f", i > 0 ? ", " : "", stats_names[i], stats->phase[i]);
+    fprintf(fp, "}, \"writes\": %ld, \"seeks\": %ld, \"bytes\": %ld, "
+            "\"logical\": %ld, \"allocated\": %ld}\n",
+            stats->writes, stats->seeks, stats->bytes, stats->logical, stats->allocated);
+}
+
+/*
+ * Removes an existing regular file before it is created again, so that files
+ * sharing its contents through a hard link, like cache entries, are kept.
+ */
+void file_replace(const char *filename) {
+    struct stat st;
+
+    if (stat(filename, &st) == 0 && S_ISREG(st.st_mode))
+        remove(filename);
+}
+
+/*
+ * Opens a new image file for writing, unless it exists and overwriting was
+ * not requested. Devices are opened in place, without truncating them.
+ */
+FILE *image_open(const char *filename, int flags) {
+    FILE *fp;
+
+    if (!(flags & OPTS_FORCE) && (fp = fopen(filename, "r")) != NULL) {
+        fprintf(stderr, "The file \"%s\" already exists. You can specify \"-force\" to overwrite.\n", filename);
+        fclose(fp);
+        return NULL;
     }
+    if (!(flags & OPTS_DEVICE))
+        file_replace(filename);
+
+    fp = fopen(filename, flags & OPTS_DEVICE ? "r+" : "w+");
+    if (fp == NULL)
+        fprintf(stderr, "The file \"%s\" cannot be opened for writing.\n", filename);
+    return fp;
 }
 
-void options_toimgspec(const options *opts, imgspec *img) {
-    /* hard disk defaults */
-    img->fs->mdesc = HD_MDESC;
-    img->fs->rtent = 512;
-
-    if (stricmp(opts->type, "fd_160") == 0) {
-        img->fs->mdesc = 0xFE;
-        img->fs->rtent = 56;
-        img->cylinders = 40;
-        img->heads = 1;
-        img->sectors = 8;
-    } else if (stricmp(opts->type, "fd_180") == 0) {
-        img->fs->mdesc = 0xFC;
-        img->fs->rtent = 56;
-        img->cylinders = 40;
-        img->heads = 1;
-        img->sectors = 9;
-    } else if (stricmp(opts->type, "fd_200") == 0) {
-        img->fs->mdesc = 0xFC;
-        img->fs->rtent = 56;
-        img->cylinders = 40;
-        img->heads = 1;
-        img->sectors = 10;
-    } else if (stricmp(opts->type, "fd_320") == 0) {
-        img->fs->mdesc = 0xFF;
-        img->fs->rtent = 112;
-        img->cylinders = 40;
-        img->heads = 2;
-        img->sectors = 8;
-    } else if (stricmp(opts->type, "fd_360") == 0) {
-        img->fs->mdesc = 0xFD;
-        img->fs->rtent = 112;
-        img->cylinders = 40;
-        img->heads = 2;
-        img->sectors = 9;
-    } else if (stricmp(opts->type, "fd_400") == 0) {
-        img->fs->mdesc = 0xFD;
-        img->fs->rtent = 112;
-        img->cylinders = 40;
-        img->heads = 2;
-        img->sectors = 10;
-    } else if (stricmp(opts->type, "fd_720") == 0) {
-        img->fs->mdesc = 0xF9;
-        img->fs->rtent = 112;
-        img->cylinders = 80;
-        img->heads = 2;
-        img->sectors = 9;
-    } else if (stricmp(opts->type, "fd_1200") == 0) {
-        img->fs->mdesc = 0xF9;
-        img->fs->rtent = 224;
-        img->cylinders = 80;
-        img->heads = 2;
-        img->sectors = 15;
-    } else if (stricmp(opts->type, "fd_1440") == 0 ||
-               stricmp(opts->type, "fd") == 0 ||
-               stricmp(opts->type, "floppy") == 0) {
-        img->fs->mdesc = 0xF0;
-        img->fs->rtent = 224;
-        img->cylinders = 80;
-        img->heads = 2;
-        img->sectors = 18;
-    } else if (stricmp(opts->type, "fd_2880") == 0) {
-        img->fs->mdesc = 0xF0;
-        img->fs->rtent = 512;
-        img->cylinders = 80;
-        img->heads = 2;
-        img->sectors = 36;
-    } else if (stricmp(opts->type, "hd_250") == 0) {
-        img->cylinders = 489;
-        img->heads = 16;
-        img->sectors = 63;
-    } else if (stricmp(opts->type, "hd_520") == 0) {
-        img->cylinders = 1023;
-        img->heads = 16;
-        img->sectors = 63;
-    } else if (stricmp(opts->type, "hd_1gig") == 0) {
-        img->cylinders = 1023;
-        img->heads = 32;
-        img->sectors = 63;
-    } else if (stricmp(opts->type, "hd_2gig") == 0) {
-        img->cylinders = 1023;
-        img->heads = 64;
-        img->sectors = 63;
-    } else if (stricmp(opts->type, "hd_st251") == 0) {
-        img->cylinders = 820;
-        img->heads = 6;
-        img->sectors = 17;
-    } else if (stricmp(opts->type, "hd_st225") == 0) {
-        img->cylinders = 615;
-        img->heads = 4;
-        img->sectors = 17;
-    } else if (stricmp(opts->type, "hd") == 0) {
-        options_tocustomchs(opts, img);
-    } else {
-        fputs("Invalid -t option. Type \"imgmake -?\" for possible values.", stderr);
-        exit(EC_INV_TYPE);
-    }
-
-    options_tofsspec(opts, img);
-}
-
-int imgspec_write(const imgspec *img, FILE *fp) {
-    const fsspec *fs = img->fs;
-    const long chs = (long) img->cylinders * img->heads * img->sectors;
-    const long size = chs * 512L;
-    unsigned char buf[512];
-    long i;
-
-    /* preallocate space on HDD by writing the last byte */
-    if (fseek(fp, size - 1L, SEEK_SET) != 0 || fwrite("\0", 1, 1, fp) != 1) {
-        fprintf(stderr, "Not enough space available for the image file. Need %ld bytes.\n", size);
-        return 1;
+/*
+ * Writes the image to a new file.
+ */
+int image_writefile(const imgspec *img, const char *filename, int flags) {
+    imgsink sink;
+    FILE *fp;
+
+    if ((fp = image_open(filename, flags)) == NULL)
+        return EC_FILE_ERROR;
+    imgstats_phase(img->stats, STATS_OPEN);
+
+    fprintf(stdout, "Creating image file \"%s\" with %u cylinders, %u heads and %u sectors.\n",
+            filename, img->cylinders, img->heads, img->sectors);
+    if (imgsink_format(&sink, fp, img) != 0) {
+        fputs("Not enough memory to set up the image file.\n", stderr);
+        sink.release(&sink);
+        fclose(fp);
+        if (!img->device)
+            remove(filename);
+        return EC_FILE_ERROR;
     }
 
-    if (fs == NULL) {
-        return 0;
+    if (imgspec_write(img, &sink) != 0) {
+        /* error messages are printed by imgspec_write, devices are kept */
+        sink.release(&sink);
+        fclose(fp);
+        if (!img->device)
+            remove(filename);
+        return EC_FILE_ERROR;
     }
 
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-        perror("Error while accessing image file");
-        return 1;
+    sink.release(&sink);
+    image_filestats(img->stats, fp);
+    if (file_close(fp, filename, img->sync) != 0) {
+        perror("Unable to flush image file to disk");
+        return EC_FILE_ERROR;
     }
+    imgstats_phase(img->stats, STATS_CLOSE);
+    return 0;
+}
 
-    /* if it is an hard disk, write MBR */
-    if (fs->mdesc == HD_MDESC) {
-        /* load default MBR into buffer */
-        memcpy(buf, mbr, sizeof(mbr));
-
-        /* active partition marker */
-        buf[0x1BE] = 0x80;
-        /* start head: head 0 has partition table, head 1 first partition */
-        buf[0x1BF] = 1;
-        /* start sector with bits 8-9 of start cylinder in bits 6-7 */
-        buf[0x1C0] = 1;
-        /* start cylinder bits 0-7 */
-        buf[0x1C1] = 0;
-
-        /* partition type */
-        if (chs < 65536L) {
-            /* FAT12 (0x01), FAT16 (0x04) */
-            buf[0x1C2] = fs->type == FS_FAT12 ? 0x01 : 0x04;
-        } else {
-            /* FAT16B (0x06) the only option when more than 65536 sectors */
-            buf[0x1C2] = 0x06;
-        }
+/*
+ * Writes the image sequentially to a stream, like standard output.
+ */
+int image_writestream(const imgspec *img, FILE *fp) {
+    imgsink sink;
+    int rc = 0;
+
+    /* standard output carries the image, messages go to standard error */
+    fprintf(stderr, "Writing image with %u cylinders, %u heads and %u sectors to standard output.\n",
+            img->cylinders, img->heads, img->sectors);
+    if (img->format != FORMAT_RAW ? imgsink_format(&sink, fp, img) != 0 : imgsink_stream(&sink, fp) != 0) {
+        fputs("Unable to set up standard output for the image.\n", stderr);
+        rc = EC_FILE_ERROR;
+    } else if (imgspec_write(img, &sink) != 0) {
+        /* error messages are printed by imgspec_write */
+        rc = EC_FILE_ERROR;
+    }
 
-        /* end head (0-based) */
-        buf[0x1C3] = img->heads - 1;
-        /* end sector with bits 8-9 of end cylinder (0-based) in bits 6-7 */
-        buf[0x1C4] = img->sectors | (((img->cylinders - 1) & 0x300) >> 2);
-        /* end cylinder (0-based) bits 0-7 */
-        buf[0x1C5] = (img->cylinders - 1) & 0xFF;
+    sink.release(&sink);
+    image_filestats(img->stats, fp);
+    return rc;
+}
 
-        /* first absolute sector of partition 1 */
-        memcpydw(buf + 0x1C6, fs->voff);
-        /* sector size of partition 1 */
-        memcpydw(buf + 0x1CA, fs->vsize);
+/*
+ * Writes a differencing VHD file, taking size and geometry from its parent.
+ */
+int image_writediff(const options *opts, const char *filename) {
+    unsigned char parent[512];
+    unsigned long size;
+    imgspec img;
+    imgsink sink;
+    FILE *fp;
+    int rc;
 
-        if (fwrite(buf, 1, 512, fp) != 512) {
-            perror("Unable to write image file MBR.");
-            return 1;
-        }
+    if (opts->base == NULL) {
+        fputs("Invalid -format option. Differencing VHD images require -base.", stderr);
+        return EC_INV_USAGE;
+    }
+    if (opts->copydir != NULL) {
+        fputs("Invalid -copy option. Files cannot be copied into differencing VHD images.", stderr);
+        return EC_INV_USAGE;
     }
+    if ((rc = vhd_readfooter(opts->base, parent)) != 0)
+        return rc;
+
+    /* current size and geometry of the parent */
+    size = memgetbe(parent + 0x030, 8);
+    memset(&img, 0, sizeof(img));
+    img.cylinders = (int) memgetbe(parent + 0x038, 2);
+    img.heads = parent[0x03A];
+    img.sectors = parent[0x03B];
+    img.sync = opts->sync;
+
+    if ((fp = image_open(filename, opts->flags)) == NULL)
+        return EC_FILE_ERROR;
 
-    /* write boot sector */
-    memset(buf, 0, sizeof(buf));
+    fprintf(stdout, "Creating differencing image file \"%s\" of \"%s\" with %u cylinders, %u heads and %u sectors.\n",
+            filename, opts->base, img.cylinders, img.heads, img.sectors);
+    rc = imgsink_vhddiff(&sink, fp, parent, opts->base, filename);
+    sink.seeded = (opts->flags & OPTS_SEED) != 0;
+    sink.seed = opts->seed;
+    if (rc != 0) {
+        fputs("Unable to set up the differencing VHD image.\n", stderr);
+    } else if (sink.alloc(&sink, (long) size, ALLOC_SPARSE) != 0 ||
+               sink.finish(&sink, (long) size) != 0) {
+        perror("Unable to write image file");
+        rc = 1;
+    }
 
-    /* ML to jump to boot code */
-    buf[0x000] = 0xEB;
-    buf[0x001] = 0x3C;
-    buf[0x002] = 0x90;
+    sink.release(&sink);
+    if (rc != 0) {
+        fclose(fp);
+        remove(filename);
+        return EC_FILE_ERROR;
+    }
+    if (file_close(fp, filename, img.sync) != 0) {
+        perror("Unable to flush image file to disk");
+        return EC_FILE_ERROR;
+    }
 
-    /* OEM name */
-    memcpy(buf + 0x003, "MSDOS5.0", 8);
+    if (opts->flags & OPTS_BAT)
+        return image_writebat(&img, HD_MDESC, filename);
+    return 0;
+}
+
+#ifdef _POSIX_SOURCE
+/*
+ * Size in bytes of a block device, or of an existing file written in place,
+ * -1 if it cannot be read.
+ */
+long target_size(const char *filename) {
+    struct stat st;
+#if defined(__linux__) && defined(BLKGETSIZE64)
+    unsigned long long bytes;
+    int fd, rc;
+#endif
 
-    /* always 512 bytes per sector */
-    memcpyw(buf + 0x00B, 512);
+    if (stat(filename, &st) != 0)
+        return -1L;
+#if defined(__linux__) && defined(BLKGETSIZE64)
+    if (S_ISBLK(st.st_mode)) {
+        if ((fd = open(filename, O_RDONLY)) == -1)
+            return -1L;
+        rc = ioctl(fd, BLKGETSIZE64, &bytes);
+        close(fd);
+        if (rc != 0)
+            return -1L;
+        return bytes > (unsigned long long) LONG_MAX ? LONG_MAX : (long) bytes;
+    }
+#endif
+    return S_ISREG(st.st_mode) || S_ISBLK(st.st_mode) ? (long) st.st_size : -1L;
+}
 
-    /* sectors per cluster */
-    buf[0x00D] = fs->spc;
+/*
+ * Checks the options of an image written onto a device, and sizes custom
+ * hard disks after the device. opts is copied into local if it changes.
+ */
+int device_options(const options **opts, options *local, const char *filename, long *devsize) {
+    if ((*opts)->format != FORMAT_RAW || ((*opts)->ioengine != IOENGINE_STDIO && (*opts)->ioengine != IOENGINE_PWRITE) ||
+        ((*opts)->flags & (OPTS_DIRECT | OPTS_BAT)) || (*opts)->cache != NULL) {
+        fputs("Invalid options for a device. Devices are written as raw images with pwrite(), "
+              "without -direct, -bat or -cache.", stderr);
+        return EC_INV_USAGE;
+    }
+    if ((*devsize = target_size(filename)) <= 0L) {
+        fprintf(stderr, "The size of \"%s\" cannot be read. It must be an existing block device or file.\n", filename);
+        return EC_FILE_ERROR;
+    }
 
-    /* reserved sectors (always 1 for FAT12/16) */
-    memcpyw(buf + 0x00E, FS_RSV_SECT);
+    *local = **opts;
+    local->flags |= OPTS_DEVICE;
+    if (stricmp(local->type, "hd") == 0 && local->size < 0 && local->c < 0) {
+        local->size = *devsize / 1048576L > (long) INT_MAX ? INT_MAX : (int) (*devsize / 1048576L);
+        fprintf(stdout, "Using the whole of \"%s\", %d MiB.\n", filename, local->size);
+    }
+    *opts = local;
+    return 0;
+}
 
-    /* number of FATs */
-    buf[0x010] = fs->fatnum;
+/*
+ * Makes a file share the blocks of another one, on filesystems that support
+ * it. Returns non-zero if the blocks cannot be shared.
+ */
+int file_clone(int dst, int src) {
+#ifdef FICLONE
+    return ioctl(dst, FICLONE, src) != 0;
+#else
+    (void) dst;
+    (void) src;
+    return 1;
+#endif
+}
 
-    /* root entries */
-    memcpyw(buf + 0x011, fs->rtent);
+/*
+ * Copies a file, leaving holes where the source has blocks of zeros.
+ */
+int file_copy(int dst, int src) {
+    char *buf = malloc(CACHE_BLOCK_SIZE);
+    off_t size = 0;
+    ssize_t len;
+    int rc = 0;
 
-    /* total sectors in the filesystem */
-    if (fs->vsize > 0xFFFFL) {
-        memcpydw(buf + 0x020, fs->vsize);
-    } else {
-        memcpyw(buf + 0x013, (int) fs->vsize);
+    if (buf == NULL)
+        return 1;
+
+    while (rc == 0 && (len = read(src, buf, CACHE_BLOCK_SIZE)) > 0) {
+        if (memzero(buf, (size_t) len))
+            rc = lseek(dst, len, SEEK_CUR) == (off_t) -1;
+        else
+            rc = write(dst, buf, (size_t) len) != len;
+        size += len;
     }
+    if (len < 0)
+        rc = 1;
+
+    /* a trailing hole is only allocated by setting the size */
+    if (rc == 0)
+        rc = ftruncate(dst, size) != 0;
+    free(buf);
+    return rc;
+}
 
-    /* media descriptor */
-    buf[0x015] = fs->mdesc;
+/*
+ * Path of the cache entry of an image key. It must be freed by the caller.
+ */
+char *cache_path(const char *dir, const char *key) {
+    char *path = malloc(strlen(dir) + SPEC_KEY_SIZE + 5);
 
-    /* size of each FAT in sectors, always less than 2^16 for FAT12/16 */
-    memcpyw(buf + 0x016, (int) fs->fatsize);
+    if (path != NULL)
+        sprintf(path, "%s/%s.img", dir, key);
+    return path;
+}
 
-    /* geometry */
-    memcpyw(buf + 0x018, img->sectors);
-    memcpyw(buf + 0x01A, img->heads);
+/*
+ * Creates the image file from its cache entry, sharing the blocks of the entry
+ * if the filesystem can, and copying it otherwise. Returns 0 on success, -1 if the entry does not exist or the exit
+ * code on error.
+ */
+int cache_fetch(const char *entry, const char *filename, int flags, int sync) {
+    int src, dst, rc;
 
-    /* sectors before the start partition */
-    memcpydw(buf + 0x01C, fs->voff);
+    if ((src = open(entry, O_RDONLY)) == -1)
+        return -1;
 
-    /* BIOS INT 13h drive number (0x00 first floppy, 0x80 first hard disk) */
-    if (fs->mdesc == HD_MDESC)
-        buf[0x024] = 0x80;
+    if (!(flags & OPTS_FORCE) && access(filename, F_OK) == 0) {
+        fprintf(stderr, "The file \"%s\" already exists. You can specify \"-force\" to overwrite.\n", filename);
+        close(src);
+        return EC_FILE_ERROR;
+    }
 
-    /* extended boot signature */
-    buf[0x026] = 0x29;
+    fprintf(stdout, "Taking image file \"%s\" from the cache entry \"%s\".\n", filename, entry);
+    file_replace(filename);
+    dst = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dst == -1) {
+        fprintf(stderr, "The file \"%s\" cannot be opened for writing.\n", filename);
+        close(src);
+        return EC_FILE_ERROR;
+    }
 
-    /* volume serial number */
-    memcpydw(buf + 0x027, time(NULL));
+    rc = file_clone(dst, src) != 0 && file_copy(dst, src) != 0;
+    close(src);
 
-    /* volume label */
-    if (fs->vlabel != NULL) {
-        memcpy(buf + 0x02B, fs->vlabel->text, fs->vlabel->len);
-        memset(buf + 0x02B + fs->vlabel->len, ' ', 11 - fs->vlabel->len);
-    } else {
-        memcpy(buf + 0x02B, "NO NAME    ", 11);
+    if (rc == 0 && sync != SYNC_NONE)
+        rc = fsync(dst) != 0 || dir_sync(filename) != 0;
+    if (close(dst) != 0)
+        rc = 1;
+    if (rc != 0) {
+        perror("Unable to copy the cache entry");
+        remove(filename);
+        return EC_FILE_ERROR;
     }
+    return 0;
+}
 
-    /* ASCII filesystem type */
-    if (fs->type == FS_FAT12) {
-        memcpy(buf + 0x036, "FAT12   ", 8);
-    } else {
-        memcpy(buf + 0x036, "FAT16   ", 8);
+/*
+ * Stores a new image file as a read-only cache entry. The entry is written
+ * under a temporary name and renamed, so that concurrent runs never take a
+ * partial entry. Failures only print a warning.
+ */
+void cache_store(const char *entry, const char *dir, const char *filename) {
+    char *tmp = malloc(strlen(dir) + 12);
+    int src = -1, dst = -1, rc = 1;
+
+    if (tmp != NULL) {
+        sprintf(tmp, "%s/.imgXXXXXX", dir);
+        dst = mkstemp(tmp);
+    }
+    if (dst != -1 && (src = open(filename, O_RDONLY)) != -1) {
+        rc = file_clone(dst, src) != 0 && file_copy(dst, src) != 0;
+        close(src);
+    }
+    if (dst != -1) {
+        if (rc == 0)
+            rc = fchmod(dst, 0444) != 0;
+        if (close(dst) != 0)
+            rc = 1;
+        if (rc == 0)
+            rc = rename(tmp, entry) != 0;
+        if (rc != 0)
+            remove(tmp);
     }
 
-    /* boot sector signature */
-    buf[0x1FE] = 0x55;
-    buf[0x1FF] = 0xAA;
+    if (rc != 0)
+        fprintf(stderr, "Warning: the image cannot be stored in the cache directory \"%s\".\n", dir);
+    free(tmp);
+}
+#endif
 
-    if (fseek(fp, fs->voff * 512, SEEK_SET) != 0 ||
-        fwrite(&buf, 512, 1, fp) != 1) {
-        perror("Unable to write image file boot sector.\n");
-        return 1;
+/*
+ * Creates the image described by the given options, along with its .BAT file
+ * if requested. Returns 0 on success or the exit code on error.
+ */
+int image_create(const options *opts) {
+    const char *filename = opts->filename == NULL ? "IMGMAKE.IMG" : opts->filename;
+#ifdef _POSIX_SOURCE
+    char key[SPEC_KEY_SIZE];
+    char *entry = NULL;
+    options local;
+    struct stat st;
+    long devsize = 0L;
+#endif
+    label vlabel;
+    fsspec fs;
+    imgspec img;
+    int rc;
+
+    /* avoids malloc() */
+    fs.vlabel = &vlabel;
+    img.fs = &fs;
+
+    if (strcmp(filename, "-") == 0 && (opts->flags & OPTS_BAT)) {
+        fputs("Invalid -bat option. Images written to standard output have no .BAT file.", stderr);
+        return EC_INV_USAGE;
+    }
+    if (strcmp(filename, "-") == 0 && opts->format != FORMAT_RAW && opts->format != FORMAT_GZIP) {
+        fputs("Invalid -format option. Only raw and gz images can be written to standard output.", stderr);
+        return EC_INV_USAGE;
+    }
+    if (opts->base != NULL && opts->format != FORMAT_VHD_DIFF) {
+        fputs("Invalid -base option. It requires -format vhd-diff.", stderr);
+        return EC_INV_USAGE;
+    }
+    if (opts->trace != NULL && opts->copydir == NULL) {
+        fputs("Invalid -trace option. It requires -copy.", stderr);
+        return EC_INV_USAGE;
+    }
+    if (opts->ioengine != IOENGINE_STDIO && (opts->format != FORMAT_RAW || strcmp(filename, "-") == 0)) {
+        fputs("Invalid -ioengine option. Only raw image files can use another engine than stdio.", stderr);
+        return EC_INV_USAGE;
+    }
+    if ((opts->flags & OPTS_DIRECT) &&
+        (opts->format != FORMAT_RAW || strcmp(filename, "-") == 0 || opts->ioengine != IOENGINE_STDIO)) {
+        fputs("Invalid -direct option. Only raw image files written with stdio can use direct I/O.", stderr);
+        return EC_INV_USAGE;
     }
+    if (opts->cache != NULL &&
+        (!(opts->flags & OPTS_SEED) || strcmp(filename, "-") == 0 || opts->format == FORMAT_VHD_DIFF)) {
+        fputs("Invalid -cache option. It requires -seed and cannot be used with standard output or vhd-diff.", stderr);
+        return EC_INV_USAGE;
+    }
+    if (opts->format == FORMAT_VHD_DIFF)
+        return image_writediff(opts, filename);
+
+#ifdef _POSIX_SOURCE
+    /* block devices are always written in place */
+    if (((opts->flags & OPTS_DEVICE) || (stat(filename, &st) == 0 && S_ISBLK(st.st_mode))) &&
+        (rc = device_options(&opts, &local, filename, &devsize)) != 0)
+        return rc;
+#endif
+
+    if ((rc = imgspec_plan(opts, &img)) != 0)
+        return rc;
+    imgstats_phase(opts->stats, STATS_PLAN);
 
-    /* write FATs */
-    if (fs->type == FS_FAT16) {
-        memcpydw(buf, 0xFFFFFF00L | fs->mdesc);
-    } else {
-        memcpydw(buf, 0x00FFFF00L | fs->mdesc);
+#ifdef _POSIX_SOURCE
+    if (img.device && (long) img.cylinders * img.heads * img.sectors > devsize / 512L) {
+        fprintf(stderr, "The image needs %ld sectors, but \"%s\" only has %ld.\n",
+                (long) img.cylinders * img.heads * img.sectors, filename, devsize / 512L);
+        imgspec_free(&img);
+        return EC_INV_SIZE;
     }
+#endif
 
-    for (i = 0; i < fs->fatnum; i++) {
-        long off = (fs->voff + FS_RSV_SECT + fs->fatsize * i) * 512L;
+    if (img.fs != NULL && opts->align > 0) {
+        /* standard output may carry the image */
+        fprintf(strcmp(filename, "-") == 0 ? stderr : stdout,
+                "Aligning data area to %ld bytes with %d sectors per cluster, "
+                "using %ld KB of padding.\n",
+                opts->align * 512L, fs.spc, fs.padding / 2L);
+    }
 
-        if (fseek(fp, off, SEEK_SET) != 0 ||
-            fwrite(&buf, 4, 1, fp) != 1) {
-            perror("Unable to write image file FAT.\n");
-            return 1;
+    rc = -1;
+#ifdef _POSIX_SOURCE
+    if (opts->cache != NULL) {
+        imgspec_hash(&img, key);
+        if ((entry = cache_path(opts->cache, key)) == NULL) {
+            fputs("Not enough memory to look up the image cache.\n", stderr);
+            imgspec_free(&img);
+            return EC_FILE_ERROR;
         }
+        rc = cache_fetch(entry, filename, opts->flags, opts->sync);
     }
+#endif
 
-    /* create the special filesystem entry for the label */
-    if (fs->vlabel != NULL) {
-        long off = (fs->voff + FS_RSV_SECT + fs->fatsize * fs->fatnum) * 512L;
+    if (rc < 0 && strcmp(filename, "-") == 0) {
+        rc = image_writestream(&img, stdout);
+    } else if (rc < 0) {
+        rc = image_writefile(&img, filename, opts->flags);
+#ifdef _POSIX_SOURCE
+        if (rc == 0 && entry != NULL)
+            cache_store(entry, opts->cache, filename);
+#endif
+    }
 
-        memcpy(buf, fs->vlabel->text, fs->vlabel->len);
-        memset(buf + fs->vlabel->len, ' ', 11 - fs->vlabel->len);
-        buf[11] = 0x08;
+#ifdef _POSIX_SOURCE
+    free(entry);
+#endif
+    imgspec_free(&img);
 
-        if (fseek(fp, off, SEEK_SET) != 0 ||
-            fwrite(&buf, 12, 1, fp) != 1) {
-            perror("Unable to write image file filesystem entry for volume label.\n");
-            return 1;
-        }
+    if (rc == 0 && (opts->flags & OPTS_BAT))
+        rc = image_writebat(&img, fs.mdesc, filename);
+
+    /* the server replies with the statistics itself */
+    if (opts->stats != NULL && (opts->flags & OPTS_STATS))
+        stats_print(opts->stats, rc, strcmp(filename, "-") == 0 ? stderr : stdout);
+
+    return rc;
+}
+
+/*
+ * Writes a string as a JSON string literal.
+ */
+void json_puts(const char *str, FILE *fp) {
+    fputc('"', fp);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(fp, "\\%c", *str);
+        else if ((unsigned char) *str < 0x20)
+            fprintf(fp, "\\u%04x", (unsigned char) *str);
+        else
+            fputc(*str, fp);
     }
+    fputc('"', fp);
+}
 
-    return 0;
+/*
+ * Reads the number of write system calls and the bytes written so far by the
+ * process. Returns 1 if the host does not account them.
+ */
+int proc_iocount(long *syscalls, long *bytes) {
+#ifdef __linux__
+    char key[16];
+    long val;
+    int found = 0;
+    FILE *fp = fopen("/proc/self/io", "r");
+
+    if (fp == NULL)
+        return 1;
+    while (fscanf(fp, "%15[^:]: %ld\n", key, &val) == 2) {
+        if (strcmp(key, "syscw") == 0) {
+            *syscalls = val;
+            found++;
+        } else if (strcmp(key, "wchar") == 0) {
+            *bytes = val;
+            found++;
+        }
+    }
+    fclose(fp);
+    return found != 2;
+#else
+    (void) syscalls;
+    (void) bytes;
+    return 1;
+#endif
 }
 
-int main(const int argc, const char* argv[]) {
-    options opts = {NULL, NULL, NULL, -1, -1, -1, -1, -1, -1, -1, -1, 0};
+/*
+ * Creates one benchmark image and prints its measurements as a JSON line.
+ */
+int bench_case(const options *opts, const char *dir, const char *path) {
     label vlabel;
     fsspec fs;
     imgspec img;
-    FILE* fp;
+    imgsink sink;
+    FILE *fp;
+    struct stat st;
+    double start, seconds;
+    long syscalls = -1L, bytes = -1L, syscalls0, bytes0;
+    long allocated = -1L, logical = -1L;
+    int io, rc;
 
     /* avoids malloc() */
     fs.vlabel = &vlabel;
     img.fs = &fs;
 
-    options_parse(&opts, argc, argv);
-    if (opts.type == NULL) {
-        fputs(usage, stderr);
-        return EC_INV_USAGE;
+    /* pending output would be accounted to the image */
+    fflush(stdout);
+    io = proc_iocount(&syscalls0, &bytes0) == 0;
+    start = clock_monotonic();
+
+    if ((rc = imgspec_plan(opts, &img)) == 0) {
+        if ((fp = fopen(path, "w+")) == NULL) {
+            fprintf(stderr, "The file \"%s\" cannot be opened for writing.\n", path);
+            rc = EC_FILE_ERROR;
+        } else {
+            if (imgsink_format(&sink, fp, &img) != 0 || imgspec_write(&img, &sink) != 0)
+                rc = EC_FILE_ERROR;
+            sink.release(&sink);
+            if (fclose(fp) != 0)
+                rc = EC_FILE_ERROR;
+        }
+        imgspec_free(&img);
+    }
+
+    seconds = clock_monotonic() - start;
+    if (io && proc_iocount(&syscalls, &bytes) == 0) {
+        syscalls -= syscalls0;
+        bytes -= bytes0;
+    }
+    if (stat(path, &st) == 0) {
+        logical = (long) st.st_size;
+#ifdef _POSIX_SOURCE
+        allocated = (long) st.st_blocks * 512L;
+#endif
     }
+    remove(path);
+
+    fputs("{\"dir\": ", stdout);
+    json_puts(dir, stdout);
+    fprintf(stdout, ", \"type\": \"%s\", ", opts->type);
+    if (opts->size >= 0)
+        fprintf(stdout, "\"size\": %d, ", opts->size);
+    fprintf(stdout, "\"alloc\": \"%s\", \"rc\": %d, "
+            "\"seconds\": %.6f, \"write_syscalls\": %ld, \"bytes_written\": %ld, "
+            "\"allocated\": %ld, \"logical\": %ld}\n",
+            opts->alloc == ALLOC_FULL ? "full" : "sparse", rc,
+            seconds, syscalls, bytes, allocated, logical);
+    return rc;
+}
 
-    opts.filename = opts.filename == NULL ? "IMGMAKE.IMG" : opts.filename;
-    options_toimgspec(&opts, &img);
+/*
+ * Creates every image template and a range of custom hard disk sizes, sparse
+ * and fully allocated, in each of the benchmark directories. The other
+ * options apply to every image.
+ */
+int bench_run(const options *opts) {
+    options bench;
+    char *dirs, *dir, *path;
+    int i, j, rc = 0;
+
+    dirs = malloc(strlen(opts->bench) + 1);
+    path = malloc(strlen(opts->bench) + sizeof(BENCH_FILE) + 1);
+    if (dirs == NULL || path == NULL) {
+        fputs("Not enough memory to run the benchmark.\n", stderr);
+        free(dirs);
+        free(path);
+        return EC_FILE_ERROR;
+    }
+    strcpy(dirs, opts->bench);
 
-    if (!(opts.flags & OPTS_FORCE)) {
-        fp = fopen(opts.filename, "r");
-        if (fp != NULL) {
-            fprintf(stderr,"The file \"%s\" already exists. You can specify \"-force\" to overwrite.\n", opts.filename);
-            fclose(fp);
-            return EC_FILE_ERROR;
+    for (dir = strtok(dirs, BENCH_PATH_SEP); dir != NULL; dir = strtok(NULL, BENCH_PATH_SEP)) {
+        sprintf(path, "%s/%s", dir, BENCH_FILE);
+
+        for (i = 0; i < 2; i++) {
+            bench = *opts;
+            bench.bench = NULL;
+            bench.alloc = i == 0 ? ALLOC_SPARSE : ALLOC_FULL;
+
+            for (j = 0; bench_types[j] != NULL; j++) {
+                bench.type = bench_types[j];
+                if (bench_case(&bench, dir, path) != 0)
+                    rc = EC_FILE_ERROR;
+            }
+
+            /* custom hard disks, from the smallest to the largest size */
+            bench.type = "hd";
+            bench.c = bench.h = bench.s = -1;
+            for (j = 0; bench_sizes[j] != 0; j++) {
+                bench.size = bench_sizes[j];
+                if (bench_case(&bench, dir, path) != 0)
+                    rc = EC_FILE_ERROR;
+            }
+        }
+    }
+
+    free(dirs);
+    free(path);
+    return rc;
+}
+
+/*
+ * Splits a manifest line in place into at most max - 1 arguments, starting
+ * from argv[1] like a command line. Arguments are separated by blanks and can
+ * be enclosed in double quotes. Returns the argument count, or -1 if there
+ * are too many arguments.
+ */
+int manifest_split(char *line, const char **argv, int max) {
+    int argc = 1;
+    char *out;
+
+    argv[0] = "imgmake";
+    while (*line != '\0') {
+        if (isspace((unsigned char) *line)) {
+            line++;
+            continue;
+        }
+        if (argc == max - 1)
+            return -1;
+
+        argv[argc++] = out = line;
+        while (*line != '\0' && !isspace((unsigned char) *line)) {
+            if (*line == '"') {
+                for (line++; *line != '\0' && *line != '"'; line++)
+                    *out++ = *line;
+                if (*line == '"')
+                    line++;
+            } else {
+                *out++ = *line++;
+            }
         }
+        if (*line != '\0')
+            line++;
+        *out = '\0';
     }
 
-    fp = fopen(opts.filename, "w+");
+    argv[argc] = NULL;
+    return argc;
+}
+
+/*
+ * Loads a manifest file, one image per line. Every line holds the same
+ * options as the command line, applied on top of the command line options.
+ */
+int manifest_load(manifest *mf, const options *defaults) {
+    char buf[MF_LINE_MAX];
+    const char *argv[MF_ARGS_MAX];
+    mfentry *entry;
+    char *line;
+    FILE *fp;
+    int argc, lineno, rc = 0;
+
+    fp = fopen(defaults->manifest, "r");
     if (fp == NULL) {
-        fprintf(stderr,"The file \"%s\" cannot be opened for writing.\n", opts.filename);
+        fprintf(stderr, "The file \"%s\" cannot be opened for reading.\n", defaults->manifest);
         return EC_FILE_ERROR;
     }
 
-    fprintf(stdout, "Creating image file \"%s\" with %u cylinders, %u heads and %u sectors.\n",
-           opts.filename, img.cylinders, img.heads, img.sectors);
-    if (imgspec_write(&img, fp) != 0) {
-        /* error messages are printed by imgspec_write */
-        fclose(fp);
-        remove(opts.filename);
-        return EC_FILE_ERROR;
+    for (lineno = 1; rc == 0 && fgets(buf, sizeof(buf), fp) != NULL; lineno++) {
+        if (strchr(buf, '\n') == NULL && !feof(fp)) {
+            fprintf(stderr, "Manifest line %d is too long.\n", lineno);
+            rc = EC_INV_USAGE;
+            break;
+        }
+
+        /* options point into the line, so it must outlive the entry */
+        line = malloc(strlen(buf) + 1);
+        if (line == NULL) {
+            fputs("Not enough memory to load the manifest.\n", stderr);
+            rc = EC_INV_USAGE;
+            break;
+        }
+        strcpy(line, buf);
+
+        argc = manifest_split(line, argv, MF_ARGS_MAX);
+        if (argc == 1 || (argc > 1 && argv[1][0] == '#')) {
+            free(line);
+            continue;
+        }
+        if (argc < 0) {
+            fprintf(stderr, "Manifest line %d has too many options.\n", lineno);
+            free(line);
+            rc = EC_INV_USAGE;
+            break;
+        }
+
+        if (mf->count % 64 == 0) {
+            entry = realloc(mf->entries, (mf->count + 64) * sizeof(mfentry));
+            if (entry == NULL) {
+                fputs("Not enough memory to load the manifest.\n", stderr);
+                free(line);
+                rc = EC_INV_USAGE;
+                break;
+            }
+            mf->entries = entry;
+        }
+
+        entry = &mf->entries[mf->count];
+        entry->line = line;
+        entry->argv = malloc((argc + 1) * sizeof(const char *));
+        if (entry->argv == NULL) {
+            fputs("Not enough memory to load the manifest.\n", stderr);
+            free(line);
+            rc = EC_INV_USAGE;
+            break;
+        }
+        memcpy(entry->argv, argv, (argc + 1) * sizeof(const char *));
+        entry->lineno = lineno;
+        entry->rc = 0;
+        entry->opts = *defaults;
+        entry->opts.manifest = NULL;
+        /* images are already created in parallel, unless the line says so */
+        entry->opts.threads = 1;
+        mf->count++;
+
+        rc = options_parse(&entry->opts, argc, entry->argv);
+        if (rc == 0 && entry->opts.manifest != NULL) {
+            fputs("Invalid -manifest option. Manifests cannot be nested.", stderr);
+            rc = EC_INV_USAGE;
+        } else if (rc == 0 && options_notimage(&entry->opts)) {
+            fputs("Invalid manifest line. Manifest lines can only create images.", stderr);
+            rc = EC_INV_USAGE;
+        } else if (rc == 0 && (entry->opts.flags & OPTS_STATS)) {
+            fputs("Invalid -stats option. It applies to a single image.", stderr);
+            rc = EC_INV_USAGE;
+        } else if (rc == 0 && entry->opts.filename != NULL && strcmp(entry->opts.filename, "-") == 0) {
+            fputs("Invalid -o option. Manifest images cannot be written to standard output.", stderr);
+            rc = EC_INV_USAGE;
+        } else if (rc == 0 && entry->opts.type == NULL && entry->opts.format != FORMAT_VHD_DIFF) {
+            fputs("Missing -t option.", stderr);
+            rc = EC_INV_USAGE;
+        }
+        if (rc != 0) {
+            /* only this image fails, it is reported along with the others */
+            fprintf(stderr, " (manifest line %d)\n", lineno);
+            entry->rc = rc < 0 ? EC_INV_USAGE : rc;
+            rc = 0;
+        }
     }
 
     fclose(fp);
+    return rc;
+}
 
-    /* write the .BAT file */
-    if (opts.flags & OPTS_BAT) {
-        char bat[12];
-        size_t batlen = strlen(opts.filename);
+/*
+ * Creates manifest images until there are none left, reporting the status of
+ * each one.
+ */
+void *manifest_worker(void *arg) {
+    manifest *mf = (manifest *) arg;
+    mfentry *entry;
+    int i, rc;
 
-        strncpy(bat, opts.filename, sizeof(bat));
-        strncpy(bat + (batlen > 3 ? batlen - 4 : batlen), ".BAT", 4);
+    for (;;) {
+#ifdef _POSIX_SOURCE
+        pthread_mutex_lock(&mf->lock);
+#endif
+        i = mf->next < mf->count ? mf->next++ : -1;
+#ifdef _POSIX_SOURCE
+        pthread_mutex_unlock(&mf->lock);
+#endif
+        if (i < 0)
+            break;
 
-        fp = fopen(bat, "w");
-        if (fp == NULL) {
-            fprintf(stderr, "The file \"%s\" cannot be opened for writing.\n", bat);
-            return EC_FILE_ERROR;
+        entry = &mf->entries[i];
+        rc = entry->rc != 0 ? entry->rc : image_create(&entry->opts);
+
+#ifdef _POSIX_SOURCE
+        pthread_mutex_lock(&mf->lock);
+#endif
+        mf->done++;
+        if (rc == 0) {
+            fprintf(stdout, "[%d/%d] line %d: \"%s\" OK\n", mf->done, mf->count, entry->lineno,
+                    entry->opts.filename == NULL ? "IMGMAKE.IMG" : entry->opts.filename);
+        } else {
+            /* the messages of the line end with it, unless it failed parsing */
+            if (entry->rc == 0)
+                fprintf(stderr, " (manifest line %d)\n", entry->lineno);
+            mf->failed++;
+            fprintf(stdout, "[%d/%d] line %d: \"%s\" FAILED (exit code %d)\n", mf->done, mf->count,
+                    entry->lineno, entry->opts.filename == NULL ? "IMGMAKE.IMG" : entry->opts.filename, rc);
         }
+        entry->rc = rc;
+        fflush(stdout);
+#ifdef _POSIX_SOURCE
+        pthread_mutex_unlock(&mf->lock);
+#endif
+    }
 
-        if (fprintf(fp, "imgmount %c %s -size 512,%d,%d,%d\r\n",
-                    fs.mdesc == HD_MDESC ? 'c' : 'a', opts.filename,
-                    img.cylinders, img.heads, img.sectors) < 0) {
-            perror("Unable to write to .BAT file");
-            fclose(fp);
-            remove(bat);
-            return EC_FILE_ERROR;
+    return NULL;
+}
+
+/*
+ * Creates all the images of a manifest file on a pool of worker threads.
+ * Returns 0 if all images were created, or the exit code of the first failed
+ * image in manifest order.
+ */
+int manifest_run(const options *opts) {
+    manifest mf;
+    int i, threads, rc;
+#ifdef _POSIX_SOURCE
+    pthread_t *workers;
+#endif
+
+    memset(&mf, 0, sizeof(mf));
+    rc = manifest_load(&mf, opts);
+
+    if (rc == 0) {
+        threads = opts->threads < 0 ? cpu_count() : opts->threads;
+        if (threads > mf.count)
+            threads = mf.count;
+
+#ifdef _POSIX_SOURCE
+        pthread_mutex_init(&mf.lock, NULL);
+        workers = malloc(threads * sizeof(pthread_t));
+        /* the main thread is a worker too */
+        for (i = 1; workers != NULL && i < threads; i++) {
+            if (pthread_create(&workers[i], NULL, manifest_worker, &mf) != 0)
+                break;
         }
+        threads = workers != NULL ? i : 1;
+        manifest_worker(&mf);
+        for (i = 1; i < threads; i++)
+            pthread_join(workers[i], NULL);
+        free(workers);
+        pthread_mutex_destroy(&mf.lock);
+#else
+        manifest_worker(&mf);
+#endif
 
-        fclose(fp);
+        fprintf(stdout, "Created %d of %d images.\n", mf.count - mf.failed, mf.count);
+        for (i = 0; i < mf.count && rc == 0; i++)
+            rc = mf.entries[i].rc;
     }
 
-    return 0;
+    for (i = 0; i < mf.count; i++) {
+        free(mf.entries[i].line);
+        free(mf.entries[i].argv);
+    }
+    free(mf.entries);
+    return rc;
+}
+
+#ifdef _POSIX_SOURCE
+/*
+ * Creates the image of a request line, which holds the same options as the
+ * command line, applied on top of the server options. Returns the exit code.
+ */
+int serve_request(server *srv, char *line, imgstats *stats) {
+    const char *argv[MF_ARGS_MAX];
+    options opts;
+    int rc = 0;
+    int argc = manifest_split(line, argv, MF_ARGS_MAX);
+
+    opts = *srv->defaults;
+    opts.serve = NULL;
+    /* requests are already served in parallel, unless the line says so */
+    opts.threads = 1;
+
+    if (argc < 0) {
+        fputs("Invalid request. It has too many options.", stderr);
+        rc = EC_INV_USAGE;
+    } else if ((rc = options_parse(&opts, argc, argv)) != 0) {
+        rc = rc < 0 ? EC_INV_USAGE : rc;
+    } else if (options_notimage(&opts)) {
+        fputs("Invalid request. Requests can only create images.", stderr);
+        rc = EC_INV_USAGE;
+    } else if (opts.filename != NULL && strcmp(opts.filename, "-") == 0) {
+        fputs("Invalid -o option. Served images cannot be written to standard output.", stderr);
+        rc = EC_INV_USAGE;
+    } else if (opts.type == NULL && opts.format != FORMAT_VHD_DIFF) {
+        fputs("Missing -t option.", stderr);
+        rc = EC_INV_USAGE;
+    }
+    if (rc == 0) {
+        /* the statistics are the reply, they are not printed */
+        opts.flags &= ~OPTS_STATS;
+        opts.stats = stats;
+        imgstats_phase(stats, STATS_PARSE);
+        rc = image_create(&opts);
+    }
+
+    /* the messages of the command line end with the exit */
+    pthread_mutex_lock(&srv->lock);
+    srv->served++;
+    if (rc != 0)
+        fputs(" (request)\n", stderr);
+    pthread_mutex_unlock(&srv->lock);
+    return rc;
+}
+
+/*
+ * Answers the requests of a connection until the client closes it, one per
+ * line. Every reply is a line with the JSON statistics of -stats, whose rc is
+ * the exit code of the request. Empty lines and lines starting with # get no
+ * reply.
+ */
+void serve_conn(server *srv, int fd) {
+    char buf[MF_LINE_MAX];
+    imgstats stats;
+    FILE *in, *out = NULL;
+    const char *p;
+    int ofd, rc;
+
+    if ((in = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return;
+    }
+    if ((ofd = dup(fd)) < 0 || (out = fdopen(ofd, "w")) == NULL) {
+        if (ofd >= 0)
+            close(ofd);
+        fclose(in);
+        return;
+    }
+
+    while (fgets(buf, sizeof(buf), in) != NULL) {
+        imgstats_init(&stats);
+        if (strchr(buf, '\n') == NULL && !feof(in)) {
+            fputs("Invalid request. The line is too long.\n", stderr);
+            stats_print(&stats, EC_INV_USAGE, out);
+            break;
+        }
+
+        for (p = buf; isspace((unsigned char) *p); p++);
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        rc = serve_request(srv, buf, &stats);
+        fflush(stdout);
+        stats_print(&stats, rc, out);
+        if (fflush(out) != 0)
+            break;
+    }
+
+    fclose(out);
+    fclose(in);
+}
+
+/*
+ * Takes connections until the listening socket fails.
+ */
+void *serve_worker(void *arg) {
+    server *srv = (server *) arg;
+    int fd;
+
+    for (;;) {
+        fd = accept(srv->fd, NULL, NULL);
+        if (fd >= 0)
+            serve_conn(srv, fd);
+        else if (errno != EINTR && errno != ECONNABORTED)
+            break;
+    }
+
+    return NULL;
+}
+
+/*
+ * Checks whether a socket file was left by a server that is gone, which is
+ * the case if nothing accepts connections on it.
+ */
+int serve_stale(const struct sockaddr_un *addr) {
+    struct stat st;
+    int fd, stale;
+
+    if (stat(addr->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode) ||
+        (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return 0;
+    stale = connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) != 0 && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+/*
+ * Serves image requests on a Unix socket, on a pool of worker threads that
+ * each take one connection at a time. The options apply to every request.
+ * Only returns if the socket fails.
+ */
+int serve_run(const options *opts) {
+    struct sockaddr_un addr;
+    server srv;
+    pthread_t *workers;
+    int i, threads;
+
+    if (strlen(opts->serve) >= sizeof(addr.sun_path)) {
+        fputs("Invalid -serve option. The socket path is too long.", stderr);
+        return EC_INV_USAGE;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, opts->serve);
+
+    srv.defaults = opts;
+    srv.served = 0L;
+    srv.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (srv.fd < 0 ||
+        (bind(srv.fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 &&
+         (errno != EADDRINUSE || !serve_stale(&addr) || remove(opts->serve) != 0 ||
+          bind(srv.fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)) ||
+        listen(srv.fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Unable to listen on \"%s\". It may be in use.\n", opts->serve);
+        if (srv.fd >= 0)
+            close(srv.fd);
+        return EC_FILE_ERROR;
+    }
+
+    /* clients that leave before their reply must not stop the server */
+    signal(SIGPIPE, SIG_IGN);
+    if (imglib_warm() != 0) {
+        fputs("Not enough memory to serve images.\n", stderr);
+        close(srv.fd);
+        remove(opts->serve);
+        return EC_FILE_ERROR;
+    }
+
+    pthread_mutex_init(&srv.lock, NULL);
+    threads = opts->threads < 0 ? cpu_count() : opts->threads;
+    fprintf(stdout, "Serving images on \"%s\" with %d threads.\n", opts->serve, threads);
+    fflush(stdout);
+
+    workers = malloc(threads * sizeof(pthread_t));
+    /* the main thread is a worker too */
+    for (i = 1; workers != NULL && i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, serve_worker, &srv) != 0)
+            break;
+    }
+    threads = workers != NULL ? i : 1;
+    serve_worker(&srv);
+    perror("Unable to accept connections");
+    /* the other workers stop as well once the socket is closed */
+    shutdown(srv.fd, SHUT_RDWR);
+    close(srv.fd);
+    for (i = 1; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&srv.lock);
+    remove(opts->serve);
+    fprintf(stdout, "Served %ld requests.\n", srv.served);
+    return EC_FILE_ERROR;
+}
+#endif
+
+int main(const int argc, const char* argv[]) {
+    const char *epoch;
+    options opts;
+    imgstats stats;
+    int rc;
+
+    imgstats_init(&stats);
+    options_init(&opts);
+    if ((rc = options_parse(&opts, argc, argv)) != 0)
+        return rc < 0 ? 0 : rc;
+
+    /* reproducible builds give the time stamp of their outputs */
+    epoch = getenv("SOURCE_DATE_EPOCH");
+    if (!(opts.flags & OPTS_SEED) && epoch != NULL && *epoch != '\0') {
+        if (atoseed(epoch, &opts.seed) != 0) {
+            fputs("Invalid SOURCE_DATE_EPOCH. Must be a number.", stderr);
+            return EC_INV_USAGE;
+        }
+        opts.flags |= OPTS_SEED;
+    }
+
+    if (opts.check != NULL)
+        return image_check(opts.check);
+    if (opts.grow != NULL)
+        return image_grow(opts.grow, &opts);
+    if (opts.sparsify != NULL)
+        return image_sparsify(opts.sparsify, &opts);
+    if (opts.plan != NULL)
+        return image_plan(opts.plan, &opts);
+    if (opts.flags & OPTS_VALIDATE)
+        return image_validate(&opts);
+
+    if (opts.flags & OPTS_STATS) {
+        if (opts.manifest != NULL || opts.bench != NULL || opts.serve != NULL) {
+            fputs("Invalid -stats option. It applies to a single image.", stderr);
+            return EC_INV_USAGE;
+        }
+        opts.stats = &stats;
+        imgstats_phase(&stats, STATS_PARSE);
+    }
+
+#ifdef _POSIX_SOURCE
+    if (opts.serve != NULL)
+        return serve_run(&opts);
+#endif
+    if (opts.manifest != NULL)
+        return manifest_run(&opts);
+    if (opts.bench != NULL)
+        return bench_run(&opts);
+
+    if (opts.type == NULL && opts.format != FORMAT_VHD_DIFF) {
+        fputs(usage, stderr);
+        return EC_INV_USAGE;
+    }
+
+    return image_create(&opts);
 }